@@ -3,7 +3,7 @@ TARGET = harbour-maep-qt
 DEPENDPATH += .
 INCLUDEPATH += .
 CONFIG += link_pkgconfig hide_symbols
-PKGCONFIG += gobject-2.0 cairo libsoup-2.4 dconf libxml-2.0 libcurl
+PKGCONFIG += gobject-2.0 cairo libsoup-2.4 dconf libxml-2.0 libcurl libpng
 QT += qml quick positioning sensors
 LIBS += -ljpeg
 
@@ -29,8 +29,8 @@ DEFINES += VERSION=\"\\\"\"1.4.10\"\\\"\"
 DEFINES += G_LOG_DOMAIN=\\\"Maep\\\"
 
 # Input
-HEADERS += src/config.h src/misc.h src/conf.h src/net_io.h src/geonames.h src/search.h src/track.h src/img_loader.h src/icon.h src/converter.h src/osm-gps-map/osm-gps-map.h src/osm-gps-map/osm-gps-map-layer.h src/osm-gps-map/sourcemodel.h src/osm-gps-map/osm-gps-map-qt.h src/osm-gps-map/osm-gps-map-osd-classic.h src/osm-gps-map/layer-wiki.h src/osm-gps-map/layer-gps.h src/osm-gps-map/source.h
-SOURCES += src/misc.c src/conf.c src/net_io.c src/geonames.c src/search.c src/track.c src/img_loader.c src/icon.c src/converter.c src/osm-gps-map/osm-gps-map.c src/osm-gps-map/osm-gps-map-layer.c src/osm-gps-map/sourcemodel.cpp src/osm-gps-map/osm-gps-map-qt.cpp src/osm-gps-map/osm-gps-map-osd-classic.c src/osm-gps-map/layer-wiki.c src/osm-gps-map/layer-gps.c src/osm-gps-map/source.c src/main.cpp
+HEADERS += src/config.h src/misc.h src/conf.h src/net_io.h src/geonames.h src/search.h src/track.h src/img_loader.h src/icon.h src/converter.h src/osm-gps-map/osm-gps-map.h src/osm-gps-map/tile-cache.h src/osm-gps-map/tile-index.h src/osm-gps-map/tile-store.h src/osm-gps-map/tile-missing.h src/osm-gps-map/osm-gps-map-layer.h src/osm-gps-map/region.h src/osm-gps-map/sourcemodel.h src/osm-gps-map/regionmodel.h src/osm-gps-map/osm-gps-map-qt.h src/osm-gps-map/osm-gps-map-osd-classic.h src/osm-gps-map/layer-wiki.h src/osm-gps-map/layer-gps.h src/osm-gps-map/source.h
+SOURCES += src/misc.c src/conf.c src/net_io.c src/geonames.c src/search.c src/track.c src/img_loader.c src/icon.c src/converter.c src/osm-gps-map/osm-gps-map.c src/osm-gps-map/tile-cache.c src/osm-gps-map/tile-index.c src/osm-gps-map/tile-store.c src/osm-gps-map/tile-missing.c src/osm-gps-map/osm-gps-map-layer.c src/osm-gps-map/region.c src/osm-gps-map/sourcemodel.cpp src/osm-gps-map/regionmodel.cpp src/osm-gps-map/osm-gps-map-qt.cpp src/osm-gps-map/osm-gps-map-osd-classic.c src/osm-gps-map/layer-wiki.c src/osm-gps-map/layer-gps.c src/osm-gps-map/source.c src/main.cpp
 
 # Installation
 target.path = $$PREFIX/bin
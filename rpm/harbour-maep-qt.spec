@@ -34,6 +34,7 @@ BuildRequires: pkgconfig(Qt5Positioning)
 BuildRequires: pkgconfig(Qt5Sensors)
 BuildRequires: pkgconfig(gobject-2.0)
 BuildRequires: pkgconfig(cairo)
+BuildRequires: pkgconfig(libpng)
 BuildRequires: pkgconfig(libsoup-2.4)
 BuildRequires: pkgconfig(dconf)
 BuildRequires: pkgconfig(libxml-2.0)
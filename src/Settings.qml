@@ -47,6 +47,18 @@ SilicaFlickable {
             width: parent.width
         }
 
+        TextSwitch {
+            text: qsTr("Prepare neighbouring zoom levels")
+            description: qsTr("When the map is left idle, the tiles of the " +
+            "zoom levels around the view are also decoded, so zooming shows " +
+            "them at once, at the price of memory.")
+            checked: map.idle_decode
+            automaticCheck: false
+            onClicked: { map.idle_decode = !map.idle_decode }
+
+            width: parent.width
+        }
+
         ComboBox {
             label: qsTr("Compass mode")
             width: page.width
@@ -133,7 +133,17 @@ Page {
             Label {
                 color: Theme.secondaryColor
                 font.pixelSize: Theme.fontSizeExtraSmall
-                text: model.active ? copyrightNotice : qsTr("tile service discontinued")
+                text: {
+                    if (manageMode && model.cacheUsage > 0) {
+                        var usage = model.cacheQuota > 0
+                            ? qsTr("%1 of %2 on disk").arg(Format.formatFileSize(model.cacheUsage)).arg(Format.formatFileSize(model.cacheQuota))
+                            : qsTr("%1 on disk").arg(Format.formatFileSize(model.cacheUsage))
+                        if (model.evictedBytes > 0)
+                            usage += qsTr(", %1 freed").arg(Format.formatFileSize(model.evictedBytes))
+                        return usage
+                    }
+                    return model.active ? copyrightNotice : qsTr("tile service discontinued")
+                }
                 anchors.right: parent.right
                 anchors.rightMargin: Theme.horizontalPageMargin + Theme.paddingSmall
                 anchors.bottom: parent.bottom
@@ -188,6 +198,38 @@ Page {
                         text: qsTr("Open map copyright in browser")
                         onClicked: Qt.openUrlExternally(copyrightUrl)
                     }
+                    MenuItem {
+                        text: model.packed ? qsTr("Store tiles in separate files")
+                                           : qsTr("Store tiles in a single file")
+                        onClicked: model.packed = !model.packed
+                    }
+                    MenuItem {
+                        // Cycle between none, a week, a month and any age.
+                        text: {
+                            if (model.maxStale < 0)
+                                return qsTr("Outdated tiles: always shown")
+                            else if (model.maxStale == 0)
+                                return qsTr("Outdated tiles: never shown")
+                            return qsTr("Outdated tiles: up to %n day(s) old", "",
+                                        Math.round(model.maxStale / 86400))
+                        }
+                        onClicked: {
+                            if (model.maxStale < 0)
+                                model.maxStale = 0
+                            else if (model.maxStale < 7 * 86400)
+                                model.maxStale = 7 * 86400
+                            else if (model.maxStale < 30 * 86400)
+                                model.maxStale = 30 * 86400
+                            else
+                                model.maxStale = -1
+                        }
+                    }
+                    MenuItem {
+                        // Cycle between 2, 4 and 8 downloads at once.
+                        text: qsTr("Downloads at once: %1").arg(model.maxConnections)
+                        onClicked: model.maxConnections =
+                                   (model.maxConnections < 8) ? 2 * model.maxConnections : 2
+                    }
                 }
             }
         }
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <turbojpeg.h>
 #include <jpeglib.h>
+#include <png.h>
 #include <setjmp.h>
 
 static GQuark loader_quark = 0;
@@ -43,9 +44,10 @@ static void _error_exit(j_common_ptr cinfo)
 }
 
 static gboolean img_loader_jpeg(struct jpeg_decompress_struct *cinfo,
+                                gfloat scale, MaepLoaderQuality quality,
                                 cairo_surface_t **surf, GError **error)
 {
-  guint res, jpeg_stride, cairo_stride;
+  guint res, cairo_stride;
   unsigned char *data;
 
   /* Step 3: read file parameters with jpeg_read_header() */
@@ -57,6 +59,18 @@ static gboolean img_loader_jpeg(struct jpeg_decompress_struct *cinfo,
     return FALSE;
   }
 
+  /* Step 4: set parameters for decompression */
+  /* Scaling is done within the IDCT, by eighths. */
+  cinfo->scale_num = CLAMP((guint)(scale * 8.f + 0.5f), 1, 16);
+  cinfo->scale_denom = 8;
+  if (quality == MAEP_LOADER_QUALITY_PREVIEW) {
+    cinfo->dct_method = JDCT_IFAST;
+    cinfo->do_fancy_upsampling = FALSE;
+    cinfo->do_block_smoothing = FALSE;
+  }
+  /* Cairo RGB24 pixels are 32 bits, written directly by libjpeg-turbo. */
+  cinfo->out_color_space = JCS_EXT_BGRX;
+
   /* Step 5: Start decompressor */
   if (!jpeg_start_decompress(cinfo)) {
     g_set_error(error, MAEP_LOADER_ERROR, MAEP_LOADER_ERROR_JPEG_DECOMPRESS,
@@ -69,22 +83,17 @@ static gboolean img_loader_jpeg(struct jpeg_decompress_struct *cinfo,
   *surf = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
                                      cinfo->output_width, cinfo->output_height);
   cairo_stride = cairo_image_surface_get_stride(*surf);
-  jpeg_stride = cinfo->output_width * cinfo->output_components;
 
   /* Step 6: Read data to Cairo surface. */
   cairo_surface_flush(*surf);
   data = cairo_image_surface_get_data(*surf);
   /* memset(data, '\0', cairo_stride * cinfo->output_height); */
-  if (jpeg_stride == cairo_stride)
-    res = jpeg_read_scanlines(cinfo, (JSAMPARRAY)&data, cinfo->output_height);
-  else {
-    cinfo->out_color_space = JCS_EXT_BGRX;
-    while (cinfo->output_scanline < cinfo->output_height) {
-      res = jpeg_read_scanlines(cinfo, (JSAMPARRAY)&data, 1);
-      data += cairo_stride;
-    }
+  res = 1;
+  while (res == 1 && cinfo->output_scanline < cinfo->output_height) {
+    res = jpeg_read_scanlines(cinfo, (JSAMPARRAY)&data, 1);
+    data += cairo_stride;
   }
-  if (res != ((jpeg_stride == cairo_stride)?cinfo->output_height:1)) {
+  if (res != 1) {
     g_set_error(error, MAEP_LOADER_ERROR, MAEP_LOADER_ERROR_JPEG_SCANLINES,
                 "scanlines error");
     jpeg_destroy_decompress(cinfo);
@@ -100,9 +109,12 @@ static gboolean img_loader_jpeg(struct jpeg_decompress_struct *cinfo,
   return TRUE;
 }
 
-#if JPEG_LIB_VERSION >= 80
-cairo_surface_t* maep_loader_jpeg_from_mem(const unsigned char *buffer,
-                                               size_t len, GError **error)
+/* libjpeg-turbo provides jpeg_mem_src() with the 6b API too. */
+#if JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED)
+cairo_surface_t* maep_loader_jpeg_from_mem_scaled(const unsigned char *buffer,
+                                                  size_t len, gfloat scale,
+                                                  MaepLoaderQuality quality,
+                                                  GError **error)
 {
   struct jpeg_decompress_struct cinfo;
   struct my_error_mgr jerr;
@@ -131,7 +143,7 @@ cairo_surface_t* maep_loader_jpeg_from_mem(const unsigned char *buffer,
   /* Step 2: specify data source (eg, a file) */
   jpeg_mem_src(&cinfo, (unsigned char *)buffer, len);
 
-  if (!img_loader_jpeg(&cinfo, &surf, error)) {
+  if (!img_loader_jpeg(&cinfo, scale, quality, &surf, error)) {
     jpeg_destroy_decompress(&cinfo);
     if (surf)
       cairo_surface_destroy(surf);
@@ -143,9 +155,217 @@ cairo_surface_t* maep_loader_jpeg_from_mem(const unsigned char *buffer,
 
   return surf;
 }
+#else
+cairo_surface_t* maep_loader_jpeg_from_mem_scaled(const unsigned char *buffer,
+                                                  size_t len, gfloat scale,
+                                                  MaepLoaderQuality quality,
+                                                  GError **error)
+{
+  (void)buffer;
+  (void)len;
+  (void)scale;
+  (void)quality;
+  g_set_error(error, MAEP_LOADER_ERROR, MAEP_LOADER_ERROR_UNSUPPORTED,
+              "JPEG load from memory not available");
+  return NULL;
+}
 #endif
 
+cairo_surface_t* maep_loader_jpeg_from_mem(const unsigned char *buffer,
+                                           size_t len, GError **error)
+{
+  return maep_loader_jpeg_from_mem_scaled(buffer, len, 1.f,
+                                          MAEP_LOADER_QUALITY_FULL, error);
+}
+
+static void _png_error(png_structp png, png_const_charp msg)
+{
+  GError **error = (GError**)png_get_error_ptr(png);
+
+  g_set_error(error, MAEP_LOADER_ERROR, MAEP_LOADER_ERROR_PNG, "%s", msg);
+  png_longjmp(png, 1);
+}
+
+static void _png_warning(png_structp png, png_const_charp msg)
+{
+  (void)png;
+  g_debug("%s", msg);
+}
+
+struct png_mem_src {
+  const unsigned char *buffer;
+  size_t len;
+};
+
+static void _png_read(png_structp png, png_bytep data, png_size_t length)
+{
+  struct png_mem_src *src = (struct png_mem_src*)png_get_io_ptr(png);
+
+  if (length > src->len)
+    png_error(png, "truncated PNG data");
+  memcpy(data, src->buffer, length);
+  src->buffer += length;
+  src->len -= length;
+}
+
+/* Premultiply one row of native endian ARGB32 pixels. */
+static void _png_premultiply(guint32 *row, guint width)
+{
+  guint i, a;
+  guint32 p, t;
+
+  for (i = 0; i < width; i++) {
+    p = row[i];
+    a = p >> 24;
+    if (a == 0xff)
+      continue;
+    if (a == 0) {
+      row[i] = 0;
+      continue;
+    }
+    /* Divide by 255 with rounding, for R and B, then for G. */
+    t = (p & 0x00ff00ff) * a + 0x00800080;
+    t = ((t + ((t >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+    p = (p & 0x0000ff00) * a + 0x00008000;
+    p = ((p + (p >> 8)) >> 8) & 0x0000ff00;
+    row[i] = (a << 24) | t | p;
+  }
+}
+
+/* Decode directly into the surface rows. Pixels are premultiplied
+   row by row, during the last interlace pass. */
+static cairo_surface_t* img_loader_png(png_structp png, png_infop info)
+{
+  cairo_surface_t * volatile surf = NULL;
+  png_uint_32 width, height, y;
+  int depth, color, interlace, pass, n_passes, stride;
+  gboolean alpha;
+  unsigned char *data;
+
+  if (setjmp(png_jmpbuf(png))) {
+    if (surf)
+      cairo_surface_destroy(surf);
+    return NULL;
+  }
+
+  png_read_info(png, info);
+  png_get_IHDR(png, info, &width, &height, &depth, &color, &interlace, NULL, NULL);
+
+  /* Everything is expanded to 8 bits RGBA, in cairo byte order. */
+  if (color == PNG_COLOR_TYPE_PALETTE)
+    png_set_palette_to_rgb(png);
+  if (color == PNG_COLOR_TYPE_GRAY && depth < 8)
+    png_set_expand_gray_1_2_4_to_8(png);
+  alpha = (color & PNG_COLOR_MASK_ALPHA) != 0;
+  if (png_get_valid(png, info, PNG_INFO_tRNS)) {
+    png_set_tRNS_to_alpha(png);
+    alpha = TRUE;
+  }
+  if (depth == 16)
+    png_set_strip_16(png);
+  if (color == PNG_COLOR_TYPE_GRAY || color == PNG_COLOR_TYPE_GRAY_ALPHA)
+    png_set_gray_to_rgb(png);
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+  png_set_bgr(png);
+  if (!alpha)
+    png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+#else
+  if (alpha)
+    png_set_swap_alpha(png);
+  else
+    png_set_filler(png, 0xff, PNG_FILLER_BEFORE);
+#endif
+  n_passes = png_set_interlace_handling(png);
+  png_read_update_info(png, info);
+
+  surf = cairo_image_surface_create(alpha ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24,
+                                    width, height);
+  if (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS)
+    png_error(png, cairo_status_to_string(cairo_surface_status(surf)));
+  stride = cairo_image_surface_get_stride(surf);
+
+  cairo_surface_flush(surf);
+  data = cairo_image_surface_get_data(surf);
+  for (pass = 0; pass < n_passes; pass++)
+    for (y = 0; y < height; y++) {
+      png_read_row(png, data + y * stride, NULL);
+      if (alpha && pass == n_passes - 1)
+        _png_premultiply((guint32*)(data + y * stride), width);
+    }
+  png_read_end(png, NULL);
+  cairo_surface_mark_dirty(surf);
+
+  return surf;
+}
+
+cairo_surface_t* maep_loader_png_from_mem(const unsigned char *buffer,
+                                          size_t len, GError **error)
+{
+  png_structp png;
+  png_infop info;
+  struct png_mem_src src;
+  cairo_surface_t *surf;
+
+  png = png_create_read_struct(PNG_LIBPNG_VER_STRING, error,
+                               _png_error, _png_warning);
+  if (!png || !(info = png_create_info_struct(png))) {
+    g_set_error(error, MAEP_LOADER_ERROR, MAEP_LOADER_ERROR_PNG,
+                "cannot allocate PNG decoder");
+    png_destroy_read_struct(&png, NULL, NULL);
+    return NULL;
+  }
+
+  src.buffer = buffer;
+  src.len = len;
+  png_set_read_fn(png, &src, _png_read);
+  surf = img_loader_png(png, info);
+
+  png_destroy_read_struct(&png, &info, NULL);
+
+  return surf;
+}
+
+cairo_surface_t* maep_loader_png_from_file(const char *filename, GError **error)
+{
+  FILE *infile;
+  png_structp png;
+  png_infop info;
+  cairo_surface_t *surf;
+
+  if ((infile = fopen(filename, "rb")) == NULL) {
+    g_set_error(error, MAEP_LOADER_ERROR, MAEP_LOADER_ERROR_FILE,
+                "can't open %s", filename);
+    return NULL;
+  }
+
+  png = png_create_read_struct(PNG_LIBPNG_VER_STRING, error,
+                               _png_error, _png_warning);
+  if (!png || !(info = png_create_info_struct(png))) {
+    g_set_error(error, MAEP_LOADER_ERROR, MAEP_LOADER_ERROR_PNG,
+                "cannot allocate PNG decoder");
+    png_destroy_read_struct(&png, NULL, NULL);
+    fclose(infile);
+    return NULL;
+  }
+
+  png_init_io(png, infile);
+  surf = img_loader_png(png, info);
+
+  png_destroy_read_struct(&png, &info, NULL);
+  fclose(infile);
+
+  return surf;
+}
+
 cairo_surface_t* maep_loader_jpeg_from_file(const char *filename, GError **error)
+{
+  return maep_loader_jpeg_from_file_scaled(filename, 1.f,
+                                           MAEP_LOADER_QUALITY_FULL, error);
+}
+
+cairo_surface_t* maep_loader_jpeg_from_file_scaled(const char *filename, gfloat scale,
+                                                   MaepLoaderQuality quality,
+                                                   GError **error)
 {
   FILE * infile;
   struct jpeg_decompress_struct cinfo;
@@ -182,7 +402,7 @@ cairo_surface_t* maep_loader_jpeg_from_file(const char *filename, GError **error
   /* Step 2: specify data source (eg, a file) */
   jpeg_stdio_src(&cinfo, infile);
 
-  if (!img_loader_jpeg(&cinfo, &surf, error)) {
+  if (!img_loader_jpeg(&cinfo, scale, quality, &surf, error)) {
     jpeg_destroy_decompress(&cinfo);
     if (surf)
       cairo_surface_destroy(surf);
@@ -10,16 +10,34 @@ enum {
   MAEP_LOADER_ERROR_JPEG_HEADER,
   MAEP_LOADER_ERROR_JPEG_DECOMPRESS,
   MAEP_LOADER_ERROR_JPEG_SCANLINES,
-  MAEP_LOADER_ERROR_FILE
+  MAEP_LOADER_ERROR_PNG,
+  MAEP_LOADER_ERROR_FILE,
+  MAEP_LOADER_ERROR_UNSUPPORTED
 };
 
 GQuark maep_img_loader_get_error();
 #define MAEP_LOADER_ERROR maep_img_loader_get_error()
 
+/* Previews are decoded faster, at the expense of quality. */
+typedef enum {
+  MAEP_LOADER_QUALITY_FULL,
+  MAEP_LOADER_QUALITY_PREVIEW
+} MaepLoaderQuality;
+
 cairo_surface_t* maep_loader_jpeg_from_file(const char *filename, GError **error);
-#if JPEG_LIB_VERSION >= 80
 cairo_surface_t* maep_loader_jpeg_from_mem(const unsigned char *buffer,
                                            size_t len, GError **error);
-#endif
+/* JPEG images can be decoded directly at a scale, from 1/8 to 2 by
+   eighths, the closest one is used. */
+cairo_surface_t* maep_loader_jpeg_from_file_scaled(const char *filename, gfloat scale,
+                                                   MaepLoaderQuality quality,
+                                                   GError **error);
+cairo_surface_t* maep_loader_jpeg_from_mem_scaled(const unsigned char *buffer,
+                                                  size_t len, gfloat scale,
+                                                  MaepLoaderQuality quality,
+                                                  GError **error);
+cairo_surface_t* maep_loader_png_from_file(const char *filename, GError **error);
+cairo_surface_t* maep_loader_png_from_mem(const unsigned char *buffer,
+                                          size_t len, GError **error);
 
 #endif
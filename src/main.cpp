@@ -1,4 +1,5 @@
 #include "osm-gps-map/sourcemodel.h"
+#include "osm-gps-map/regionmodel.h"
 #include "osm-gps-map/osm-gps-map-qt.h"
 #include "../qmlLibs/qquickfolderlistmodel.h"
 
@@ -104,6 +105,7 @@ Q_DECL_EXPORT int main(int argc, char *argv[])
   qmlRegisterType<Maep::GpsMapCover>("harbour.maep.qt", 1, 0, "GpsMapCover");
   qmlRegisterType<Maep::SourceModel>("harbour.maep.qt", 1, 0, "SourceModel");
   qmlRegisterType<Maep::SourceModelFilter>("harbour.maep.qt", 1, 0, "SourceModelFilter");
+  qmlRegisterType<Maep::RegionModel>("harbour.maep.qt", 1, 0, "RegionModel");
 
   QScopedPointer<QGuiApplication> app(Maep::createApplication(argc, argv));
   QTranslator translator;
@@ -114,5 +116,9 @@ Q_DECL_EXPORT int main(int argc, char *argv[])
   QScopedPointer<QQuickView> view(Maep::createView());
   Maep::showView(view.data());
     
-  return app->exec();
+  int ret = app->exec();
+  // After the models are gone, they may still use the sources.
+  view.reset();
+  maep_source_manager_sync(maep_source_manager_get_instance());
+  return ret;
 }
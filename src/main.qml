@@ -60,6 +60,9 @@ ApplicationWindow
                       SourceModel.SECTION_OVERLAY)
         }
     }
+    RegionModel {
+        id: regions
+    }
 
     Page {
         id: page
@@ -211,6 +214,19 @@ ApplicationWindow
                     text: qsTr("import track from device")
                     onClicked: page.importTrack()
                 }
+                MenuItem {
+                    // The shown area and two more detailed levels.
+                    text: regions.running
+                          ? qsTr("Downloading for offline use %1/%2")
+                                .arg(regions.doneCount).arg(regions.tileCount)
+                          : qsTr("Download shown area for offline use")
+                    enabled: !regions.running
+                    onClicked: {
+                        var area = map.getVisibleArea()
+                        regions.add(map.source, area.corner1, area.corner2,
+                                    area.zoom, area.zoom + 2)
+                    }
+                }
                 /*MenuItem {
                     text: "Next action"
                     onClicked: header.nextAction()
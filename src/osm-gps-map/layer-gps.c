@@ -393,3 +393,31 @@ gboolean maep_layer_gps_set_active(MaepLayerGps *gps, gboolean status)
   g_signal_emit(gps, _signals[DIRTY_SIGNAL], 0, NULL);
   return TRUE;
 }
+
+/* The area the layer draws to, in the coordinates of the map. */
+gboolean maep_layer_gps_get_extents(MaepLayerGps *gps, OsmGpsMap *map,
+                                    cairo_rectangle_int_t *area)
+{
+  int pixel_x, pixel_y, r;
+  double r2;
+
+  g_return_val_if_fail(MAEP_IS_LAYER_GPS(gps), FALSE);
+  g_return_val_if_fail(area, FALSE);
+
+  if (!gps->priv->gps_valid)
+    return FALSE;
+
+  osm_gps_map_from_co_ordinates(map, &gps->priv->gps, &pixel_x, &pixel_y);
+
+  /* Compass arrows go up to four times the ball radius. */
+  r = 4 * gps->priv->ui_gps_point_inner_radius + 2;
+  r2 = (double)gps->priv->ui_gps_point_outer_radius;
+  if (r2 > 0.)
+    r = MAX(r, (int)ceil(r2 / osm_gps_map_get_scale(map)) + 2);
+
+  area->x = pixel_x - r;
+  area->y = pixel_y - r;
+  area->width = 2 * r + 1;
+  area->height = 2 * r + 1;
+  return TRUE;
+}
@@ -24,6 +24,7 @@
 #define LAYER_GPS_H
 
 #include <glib-object.h>
+#include "osm-gps-map.h"
 
 G_BEGIN_DECLS
 
@@ -68,6 +69,8 @@ gboolean maep_layer_gps_set_coordinates(MaepLayerGps *gps, gfloat lat, gfloat lo
 gboolean maep_layer_gps_set_active(MaepLayerGps *gps, gboolean status);
 gboolean maep_layer_gps_set_azimuth(MaepLayerGps *gps, gfloat azimuth);
 gboolean maep_layer_gps_set_compass_mode(MaepLayerGps *gps, MaepLayerCompassMode mode);
+gboolean maep_layer_gps_get_extents(MaepLayerGps *gps, OsmGpsMap *map,
+                                    cairo_rectangle_int_t *area);
 
 G_END_DECLS
 
@@ -35,6 +35,7 @@
 #define MAEP_CONF_KEY_LATITUDE   "latitude"
 #define MAEP_CONF_KEY_LONGITUDE  "longitude"
 #define MAEP_CONF_KEY_DOUBLEPIX  "double-pixel"
+#define MAEP_CONF_KEY_IDLEDECODE "idle-decode"
 #define MAEP_CONF_KEY_WIKIPEDIA  "wikipedia"
 #define MAEP_CONF_KEY_TRACK_CAPTURE "track_capture_enabled"
 #define MAEP_CONF_KEY_TRACK_PATH "track_path"
@@ -186,12 +187,43 @@ void Maep::Track::highlightWayPoint(int iwpt)
 namespace Maep {
   struct GpsMapCClosures
   {
-    static void repaint_from_map(Maep::GpsMap *widget)
+    static void repaint_area(Maep::GpsMap *widget, const QRect &area)
     {
+      widget->mapUpdate(area);
+      widget->update(area);
+    }
+    static void repaint_from_map(Maep::GpsMap *widget, OsmGpsMap *map)
+    {
+      cairo_rectangle_int_t area;
+      bool dragged;
+
+      /* Only the damaged part of the map changed, unless it has been
+         dragged since the last redraw. */
+      dragged = widget->drag_map_dx || widget->drag_map_dy;
       widget->drag_map_dx = 0;
       widget->drag_map_dy = 0;
-      widget->mapUpdate();
-      widget->update();
+      if (dragged)
+        repaint_area(widget, QRect());
+      else if (osm_gps_map_get_damage(map, &area))
+        repaint_area(widget, QRect(area.x, area.y, area.width, area.height));
+    }
+    static void repaint_from_overlay(Maep::GpsMap *widget, OsmGpsMap *overlay)
+    {
+      cairo_rectangle_int_t area;
+
+      if (osm_gps_map_get_damage(overlay, &area))
+        repaint_area(widget, QRect(area.x + widget->drag_map_dx,
+                                   area.y + widget->drag_map_dy,
+                                   area.width, area.height));
+    }
+    static void repaint_gps(Maep::GpsMap *widget)
+    {
+      QRect area;
+
+      /* Only the previous and the new position of the GPS point. */
+      area = widget->gpsArea.united(widget->gpsExtents());
+      if (!area.isEmpty())
+        repaint_area(widget, area);
     }
     static void repaint(Maep::GpsMap *widget)
     {
@@ -202,6 +234,7 @@ namespace Maep {
 };
 static void osm_gps_map_qt_coordinate(Maep::GpsMap *widget, GParamSpec *pspec, OsmGpsMap *map);
 static void osm_gps_map_qt_double_pixel(Maep::GpsMap *widget, GParamSpec *pspec, OsmGpsMap *map);
+static void osm_gps_map_qt_idle_decode(Maep::GpsMap *widget, GParamSpec *pspec, OsmGpsMap *map);
 static void osm_gps_map_qt_auto_center(Maep::GpsMap *widget, GParamSpec *pspec, OsmGpsMap *map);
 static void osm_gps_map_qt_zoom(Maep::GpsMap *widget);
 static void osm_gps_map_qt_source(Maep::GpsMap *widget);
@@ -232,6 +265,7 @@ Maep::GpsMap::GpsMap(QQuickItem *parent)
   gfloat lat = maep_conf_get_float(MAEP_CONF_KEY_LATITUDE, 50.0);
   gfloat lon = maep_conf_get_float(MAEP_CONF_KEY_LONGITUDE, 21.0);
   gboolean dpix = maep_conf_get_bool(MAEP_CONF_KEY_DOUBLEPIX, FALSE);
+  gboolean idec = maep_conf_get_bool(MAEP_CONF_KEY_IDLEDECODE, FALSE);
   bool wikipedia = maep_conf_get_bool(MAEP_CONF_KEY_WIKIPEDIA, FALSE);
   bool track = maep_conf_get_bool(MAEP_CONF_KEY_TRACK_CAPTURE, FALSE);
   gint width = maep_conf_get_int(MAEP_CONF_KEY_TRACK_WIDTH, -1);
@@ -271,6 +305,7 @@ Maep::GpsMap::GpsMap(QQuickItem *parent)
                                  "gps-track-point-radius",   10,
                                  // proxy?"proxy-uri":NULL,     proxy,
                                  "double-pixel",             dpix,
+                                 "idle-decode",              idec,
                                  NULL));
 
   if (color[3] > 0.) {
@@ -297,6 +332,8 @@ Maep::GpsMap::GpsMap(QQuickItem *parent)
                            G_CALLBACK(osm_gps_map_qt_auto_center), this);
   g_signal_connect_swapped(G_OBJECT(map), "notify::double-pixel",
                            G_CALLBACK(osm_gps_map_qt_double_pixel), this);
+  g_signal_connect_swapped(G_OBJECT(map), "notify::idle-decode",
+                           G_CALLBACK(osm_gps_map_qt_idle_decode), this);
   g_signal_connect_swapped(G_OBJECT(map), "notify::map-source",
                            G_CALLBACK(osm_gps_map_qt_source), this);
   g_signal_connect_swapped(G_OBJECT(map), "notify::gps-track-width",
@@ -359,7 +396,7 @@ Maep::GpsMap::GpsMap(QQuickItem *parent)
   lastGps = QGeoPositionInfo();
   lgps = maep_layer_gps_new();
   g_signal_connect_swapped(G_OBJECT(lgps), "dirty",
-                           G_CALLBACK(Maep::GpsMapCClosures::repaint), this);
+                           G_CALLBACK(Maep::GpsMapCClosures::repaint_gps), this);
 
   maep_layer_gps_set_azimuth(lgps, NAN);
   connect(&compass, SIGNAL(readingChanged()), this, SLOT(compassReadingChanged()));
@@ -372,7 +409,7 @@ Maep::GpsMap::~GpsMap()
 {
   gint zoom, sourceId, overlaySourceId, width;
   gfloat lat, lon;
-  gboolean dpix;
+  gboolean dpix, idec;
   OsmColor_t *color;
   gdouble track_color[4];
   MaepSource *source;
@@ -397,6 +434,7 @@ Maep::GpsMap::~GpsMap()
 	       "map-source", &source, 
 	       "latitude", &lat, "longitude", &lon,
 	       "double-pixel", &dpix,
+	       "idle-decode", &idec,
                "gps-track-color", &color, "gps-track-width", &width,
 	       NULL);
   sourceId = source ? maep_source_get_id(source) : int(MAEP_SOURCE_NULL);
@@ -438,6 +476,7 @@ Maep::GpsMap::~GpsMap()
   maep_conf_set_float(MAEP_CONF_KEY_LATITUDE, lat);
   maep_conf_set_float(MAEP_CONF_KEY_LONGITUDE, lon);
   maep_conf_set_bool(MAEP_CONF_KEY_DOUBLEPIX, dpix);
+  maep_conf_set_bool(MAEP_CONF_KEY_IDLEDECODE, idec);
 
   maep_conf_set_bool(MAEP_CONF_KEY_WIKIPEDIA, wiki_enabled);
 
@@ -495,7 +534,7 @@ void Maep::GpsMap::ensureOverlay(const MaepSource *source)
   onLatLon(G_OBJECT(map), NULL, overlay);
 
   g_signal_connect_swapped(G_OBJECT(overlay), "dirty",
-                           G_CALLBACK(Maep::GpsMapCClosures::repaint), this);
+                           G_CALLBACK(Maep::GpsMapCClosures::repaint_from_overlay), this);
   g_signal_connect_swapped(G_OBJECT(overlay), "notify::map-source",
                            G_CALLBACK(osm_gps_map_qt_overlay_source), this);
 }
@@ -533,11 +572,29 @@ bool Maep::GpsMap::mapSized()
   return false;
 }
 
-void Maep::GpsMap::mapUpdate()
+QRect Maep::GpsMap::gpsExtents()
+{
+  cairo_rectangle_int_t area;
+
+  if (!maep_layer_gps_get_extents(lgps, map, &area))
+    return QRect();
+  return QRect(area.x + drag_mouse_dx, area.y + drag_mouse_dy,
+               area.width, area.height);
+}
+
+/* Composite the maps and the layers again, only in area if given. */
+void Maep::GpsMap::mapUpdate(const QRect &area)
 {
   if (!cr)
     return;
 
+  cairo_save(cr);
+  if (!area.isNull())
+    {
+      cairo_rectangle(cr, area.x(), area.y(), area.width(), area.height());
+      cairo_clip(cr);
+    }
+
   cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
   cairo_paint(cr);
 
@@ -561,6 +618,9 @@ void Maep::GpsMap::mapUpdate()
     osd->draw(osd, cr);
 #endif
 
+  cairo_restore(cr);
+  gpsArea = gpsExtents();
+
   // w = cairo_image_surface_get_width(surf);
   //h = cairo_image_surface_get_height(surf);
 
@@ -803,6 +863,8 @@ void Maep::GpsMap::touchEvent(QTouchEvent *touchEvent)
                                              touchPoints.first().pos().x(),
                                              touchPoints.first().pos().y(), TRUE)));
       factor0 = 0.f;
+      // Stop prefetching around the view until the map is left idle.
+      osm_gps_map_set_interacting(map, TRUE);
       // g_message("touch begin %d", dragging);
       return;
     }
@@ -846,6 +908,7 @@ void Maep::GpsMap::touchEvent(QTouchEvent *touchEvent)
     {
       QList<QTouchEvent::TouchPoint> touchPoints = touchEvent->touchPoints();
       // g_message("touch end %d", dragging);
+      osm_gps_map_set_interacting(map, FALSE);
       if (dragging)
         {
           dragging = FALSE;
@@ -936,6 +999,21 @@ void Maep::GpsMap::setDoublePixel(bool status)
 
   g_object_set(map, "double-pixel", status, NULL);
 }
+static void osm_gps_map_qt_idle_decode(Maep::GpsMap *widget,
+                                       GParamSpec *pspec, OsmGpsMap *map)
+{
+  Q_UNUSED(pspec);
+  Q_UNUSED(map);
+
+  widget->idleDecodeChanged(widget->idleDecode());
+}
+void Maep::GpsMap::setIdleDecode(bool status)
+{
+  if (idleDecode() == status)
+    return;
+
+  g_object_set(map, "idle-decode", status, NULL);
+}
 static void osm_gps_map_qt_auto_center(Maep::GpsMap *widget,
                                        GParamSpec *pspec, OsmGpsMap *map)
 {
@@ -1089,7 +1167,7 @@ static void osm_gps_map_qt_zoom(Maep::GpsMap *widget)
 
 void Maep::GpsMap::positionUpdate(const QGeoPositionInfo &info)
 {
-  float track, hprec;
+  float track, hprec, speed;
 
   // g_message("position is %f %f, heading %g, h_acc %g", info.coordinate().latitude(),
   //           info.coordinate().longitude(), track,
@@ -1111,6 +1189,15 @@ void Maep::GpsMap::positionUpdate(const QGeoPositionInfo &info)
   // To generate auto-center if necessary.
   osm_gps_map_auto_center_at(map, info.coordinate().latitude(),
                       info.coordinate().longitude());
+  // Download the tiles ahead, before they enter the view.
+  speed = OSM_GPS_MAP_INVALID;
+  if (info.hasAttribute(QGeoPositionInfo::GroundSpeed))
+    speed = info.attribute(QGeoPositionInfo::GroundSpeed);
+  else if (lastGps.isValid() && lastGps.timestamp() < info.timestamp())
+    speed = lastGps.coordinate().distanceTo(info.coordinate()) * 1000.f /
+      lastGps.timestamp().msecsTo(info.timestamp());
+  osm_gps_map_prefetch_ahead(map, info.coordinate().latitude(),
+                             info.coordinate().longitude(), track, speed);
 
   lastGps = info;
   emit gpsCoordinateChanged();
@@ -1363,6 +1450,24 @@ QString Maep::GpsMap::getCenteredTile(int source) const
   return out;
 }
 
+// The corners of the area shown and its zoom level, to download it
+// for offline use.
+QVariantMap Maep::GpsMap::getVisibleArea() const
+{
+  coord_t pt1, pt2;
+  int zoom;
+  QVariantMap area;
+
+  osm_gps_map_get_bbox(map, &pt1, &pt2);
+  g_object_get(map, "zoom", &zoom, NULL);
+  area.insert("corner1", QVariant::fromValue(QGeoCoordinate(rad2deg(pt1.rlat),
+                                                            rad2deg(pt1.rlon))));
+  area.insert("corner2", QVariant::fromValue(QGeoCoordinate(rad2deg(pt2.rlat),
+                                                            rad2deg(pt2.rlon))));
+  area.insert("zoom", zoom);
+  return area;
+}
+
 
 /****************/
 /* GpsMapCover. */
@@ -22,6 +22,7 @@
 #include <QFile>
 #include <QImage>
 #include <QString>
+#include <QVariantMap>
 #include <QQmlListProperty>
 #include <QGeoCoordinate>
 #include <QGeoPositionInfoSource>
@@ -297,6 +298,7 @@ class GpsMap : public QQuickPaintedItem
   Q_PROPERTY(QString sourceLabel READ sourceLabel NOTIFY sourceChanged)
   Q_PROPERTY(int overlaySource READ overlaySource WRITE setOverlaySource NOTIFY overlaySourceChanged)
   Q_PROPERTY(bool double_pixel READ doublePixel WRITE setDoublePixel NOTIFY doublePixelChanged)
+  Q_PROPERTY(bool idle_decode READ idleDecode WRITE setIdleDecode NOTIFY idleDecodeChanged)
 
   Q_PROPERTY(QGeoCoordinate coordinate READ getCoord WRITE setLookAt NOTIFY coordinateChanged)
   Q_PROPERTY(QGeoCoordinate gps_coordinate READ getGpsCoord NOTIFY gpsCoordinateChanged)
@@ -437,7 +439,13 @@ class GpsMap : public QQuickPaintedItem
     g_object_get(map, "double-pixel", &status, NULL);
     return status;
   }
+  inline bool idleDecode() const {
+    gboolean status;
+    g_object_get(map, "idle-decode", &status, NULL);
+    return status;
+  }
   Q_INVOKABLE QString getCenteredTile(int source) const;
+  Q_INVOKABLE QVariantMap getVisibleArea() const;
   inline unsigned int gpsRefreshRate() const {
     return gpsRefreshRate_;
   }
@@ -455,6 +463,7 @@ class GpsMap : public QQuickPaintedItem
   void sourceChanged(int source);
   void overlaySourceChanged(int source);
   void doublePixelChanged(bool status);
+  void idleDecodeChanged(bool status);
   void coordinateChanged();
   void gpsCoordinateChanged();
   void canZoomInChanged();
@@ -476,6 +485,7 @@ class GpsMap : public QQuickPaintedItem
   void setSource(int source);
   void setOverlaySource(int source);
   void setDoublePixel(bool status);
+  void setIdleDecode(bool status);
   void setAutoCenter(bool status);
   void setScreenRotation(bool status);
   void setCoordinate(float lat, float lon);
@@ -557,6 +567,7 @@ class GpsMap : public QQuickPaintedItem
   QGeoPositionInfoSource *gps;
   QGeoPositionInfo lastGps;
   MaepLayerGps *lgps;
+  QRect gpsArea;
 
   /* Tracks */
   bool track_capture;
@@ -564,7 +575,8 @@ class GpsMap : public QQuickPaintedItem
 
   friend struct GpsMapCClosures;
 
-  void mapUpdate();
+  void mapUpdate(const QRect &area = QRect());
+  QRect gpsExtents();
 };
 
 class GpsMapCover : public QQuickPaintedItem
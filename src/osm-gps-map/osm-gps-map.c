@@ -23,7 +23,6 @@
  */
 
 #include "../config.h"
-#include "../img_loader.h"
 #include "../converter.h"
 
 #include <fcntl.h>
@@ -42,18 +41,52 @@
 #include "osm-gps-map.h"
 
 #include "source.h"
+#include "tile-cache.h"
 
 #define ENABLE_DEBUG                (0)
 
+/* Look-ahead of the GPS prefetcher: seconds of travel at the current
+   speed, within bounds in metres, over a cone of the given half
+   angle in degrees. */
+#define PREFETCH_HORIZON            (60.f)
+#define PREFETCH_MIN_DISTANCE       (250.f)
+#define PREFETCH_MAX_DISTANCE       (5000.f)
+#define PREFETCH_MIN_SPEED          (1.f)
+#define PREFETCH_ANGLE              (30.f)
+#define PREFETCH_MAX_TILES          (96)
+/* Tiles looked up on disk for one position. */
+#define PREFETCH_MAX_CHECKS         (4 * PREFETCH_MAX_TILES)
+
+/* Idle prefetch of the zoom levels around the view: delay without
+   interaction in milliseconds, then downloads and decodings per view. */
+#define PREFETCH_IDLE_DELAY         (2000)
+#define PREFETCH_IDLE_DOWNLOADS     (64)
+#define PREFETCH_IDLE_DECODES       (32)
+
 struct _OsmGpsMapPrivate
 {
-    GHashTable *tile_cache;
+    /* Tiles of the last redraw, with a ring of one tile around,
+       borrowed from the source manager so they stay in memory. */
+    GPtrArray *tiles;
+    /* Tiles not in memory are decoded in the background. */
+    MaepTileRequest request;
+    /* Tiles ahead of the GPS position, downloaded in the background. */
+    MaepTileRequest prefetch;
+    /* Tiles of the zoom levels around the view, downloaded and
+       decoded when the map is idle. */
+    MaepTileRequest idle;
+    guint idle_prefetch;
+    int view_zoom, view_x0, view_y0, view_x1, view_y1;
 
     guint viewport_width;
     guint viewport_height;
 
     /* Dirty region. */
     cairo_region_t *dirty;
+    /* Where tracks, images and the GPS point were drawn last time. */
+    cairo_region_t *drawn_dirty;
+    /* What changed in cr_surf at the last redraw. */
+    cairo_region_t *damage;
 
     gfloat map_factor;
     int map_zoom;
@@ -68,9 +101,6 @@ struct _OsmGpsMapPrivate
     gfloat center_rlat;
     gfloat center_rlon;
 
-    guint max_tile_cache_size;
-    /* Incremented at each redraw */
-    guint redraw_cycle;
     /* ID of the idle redraw operation */
     GMutex mutex;
     gulong idle_map_redraw;
@@ -94,6 +124,16 @@ struct _OsmGpsMapPrivate
     cairo_surface_t *cr_surf;
     cairo_t *cr;
 
+    /* The tiles alone, kept from one redraw to the next: on a pan,
+       they are shifted and only the exposed ones are drawn, before
+       the other layers are drawn on top in cr_surf. */
+    cairo_surface_t *tiles_surf;
+    cairo_t *tiles_cr;
+    int drawn_zoom, drawn_x0, drawn_y0, drawn_x1, drawn_y1;
+    int drawn_ox, drawn_oy;
+    /* Drawn tiles loaded since, in tile coordinates. */
+    cairo_region_t *stale;
+
     //The tile painted when one cannot be found
     cairo_surface_t *null_tile;
 
@@ -109,19 +149,14 @@ struct _OsmGpsMapPrivate
     guint fullscreen : 1;
     guint is_disposed : 1;
     guint double_pixel : 1;
+    guint interacting : 1;
+    guint idle_decode : 1;
+    guint idle_done : 1;
 };
 
 #define OSM_GPS_MAP_PRIVATE(o)  (OSM_GPS_MAP (o)->priv)
 static OsmColor_t _default_track_color = {0.9155413138, 0.0, 0.0, 0.6};
 
-typedef struct
-{
-    cairo_surface_t *cr_surf;
-    /* We keep track of the number of the redraw cycle this tile was last used,
-     * so that osm_gps_map_purge_cache() can remove the older ones */
-    guint redraw_cycle;
-} OsmCachedTile;
-
 typedef struct
 {
     MaepGeodata *track;
@@ -152,6 +187,7 @@ enum
     PROP_MAP_SOURCE,
     PROP_VIEWPORT_WIDTH,
     PROP_VIEWPORT_HEIGHT,
+    PROP_IDLE_DECODE,
 
     PROP_LAST
 };
@@ -165,9 +201,10 @@ G_DEFINE_TYPE (OsmGpsMap, osm_gps_map, G_TYPE_OBJECT);
  */
 static void     osm_gps_map_print_images (OsmGpsMap *map);
 static void     osm_gps_map_draw_gps_point (OsmGpsMap *map);
-static void     osm_gps_map_load_tile (OsmGpsMap *map, int zoom, int x, int y, int offset_x, int offset_y);
+static void     osm_gps_map_load_tile (OsmGpsMap *map, int zoom, int x, int y, int offset_x, int offset_y, gboolean drawn);
 static void     osm_gps_map_fill_tiles_pixel (OsmGpsMap *map);
 static gboolean osm_gps_map_idle_redraw(OsmGpsMap *map);
+static void     osm_gps_map_schedule_idle_prefetch (OsmGpsMap *map);
 
 #define IDLE_REDRAW(M) {if (!M->priv->idle_map_redraw)                  \
             {                                                           \
@@ -177,14 +214,6 @@ static gboolean osm_gps_map_idle_redraw(OsmGpsMap *map);
                 g_mutex_unlock(&M->priv->mutex);                        \
             }}
 
-static void
-cached_tile_free (OsmCachedTile *tile)
-{
-    /* g_message("destroying cached tile."); */
-    cairo_surface_destroy (tile->cr_surf);
-    g_slice_free (OsmCachedTile, tile);
-}
-
 static void
 track_ref_free (OsmTrackRef *st)
 {
@@ -308,7 +337,6 @@ osm_gps_map_print_images (OsmGpsMap *map)
 {
     GSList *list;
     int x,y,pixel_x,pixel_y;
-    int min_x = 0,min_y = 0,max_x = 0,max_y = 0;
     int map_x0, map_y0;
     cairo_rectangle_int_t rect;
     OsmGpsMapPrivate *priv = map->priv;
@@ -334,17 +362,12 @@ osm_gps_map_print_images (OsmGpsMap *map)
         cairo_set_source_surface(priv->cr, im->image, x-im->xoffset,y-im->yoffset);
         cairo_paint(priv->cr);
 
-        max_x = MAX(x+im->w,max_x);
-        min_x = MIN(x-im->w,min_x);
-        max_y = MAX(y+im->h,max_y);
-        min_y = MIN(y-im->h,min_y);
+        rect.x = x - im->xoffset;
+        rect.y = y - im->yoffset;
+        rect.width = im->w;
+        rect.height = im->h;
+        cairo_region_union_rectangle(priv->dirty, &rect);
     }
-    rect.x = min_x + EXTRA_BORDER;
-    rect.y = min_y + EXTRA_BORDER;
-    rect.width = max_x - min_x;
-    rect.height = max_y - min_y;
-    g_debug("dirty is %p", priv->dirty);
-    cairo_region_union_rectangle(priv->dirty, &rect);
 }
 
 static void
@@ -428,147 +451,75 @@ osm_gps_map_blit_surface(OsmGpsMap *map, cairo_surface_t *cr_surf,
 {
     OsmGpsMapPrivate *priv = map->priv;
 
+    cairo_rectangle_int_t rect;
+
     g_debug("Queing redraw @ %d,%d (w:%d h:%d)", offset_x,offset_y, TILESIZE,TILESIZE);
-    if (priv->double_pixel) {
+    rect.x = offset_x;
+    rect.y = offset_y;
+    rect.width = (priv->double_pixel)?TILESIZE * 2: TILESIZE;
+    rect.height = rect.width;
+    cairo_region_union_rectangle(priv->damage, &rect);
+    if (priv->double_pixel)
         modulo *= 2;
-        cairo_rectangle(priv->cr, offset_x, offset_y, TILESIZE * 2, TILESIZE * 2);
-    }
-    else
-        cairo_rectangle(priv->cr, offset_x, offset_y, TILESIZE, TILESIZE);
-    cairo_save(priv->cr);
-    cairo_translate(priv->cr, offset_x - area_x * modulo, offset_y - area_y * modulo);
-    cairo_scale(priv->cr, modulo, modulo);
-    cairo_set_source_surface(priv->cr, cr_surf, 0, 0);
-    cairo_pattern_set_filter(cairo_get_source(priv->cr), CAIRO_FILTER_NEAREST);
-    /* cairo_fill_preserve(priv->cr); */
-    cairo_fill(priv->cr);
-    /* cairo_set_source_rgb(priv->cr, 1., 1., 0.); */
-    /* cairo_stroke(priv->cr); */
+    cairo_rectangle(priv->tiles_cr, rect.x, rect.y, rect.width, rect.height);
+    cairo_save(priv->tiles_cr);
+    cairo_translate(priv->tiles_cr, offset_x - area_x * modulo, offset_y - area_y * modulo);
+    cairo_scale(priv->tiles_cr, modulo, modulo);
+    cairo_set_source_surface(priv->tiles_cr, cr_surf, 0, 0);
+    cairo_pattern_set_filter(cairo_get_source(priv->tiles_cr), CAIRO_FILTER_NEAREST);
+    /* cairo_fill_preserve(priv->tiles_cr); */
+    cairo_fill(priv->tiles_cr);
+    /* cairo_set_source_rgb(priv->tiles_cr, 1., 1., 0.); */
+    /* cairo_stroke(priv->tiles_cr); */
     /* g_message("Blit surface %p(%p) at %dx%d x%d %dx%d.", */
     /*         (gpointer)cr_surf, (gpointer)priv->null_tile, offset_x, offset_y, */
     /*         modulo, area_x, area_y); */
-    cairo_restore(priv->cr);
-}
-
-static cairo_surface_t* osm_gps_map_from_file(const char *filename)
-{
-    cairo_surface_t *surf;
-    GError *error;
-
-    if (g_str_has_suffix(filename, "png")) {
-        surf = cairo_image_surface_create_from_png(filename);
-    } else {
-        error = NULL;
-        surf = maep_loader_jpeg_from_file(filename, &error);
-        if (error) {
-            g_warning("%s", error->message);
-            g_error_free(error);
-        }
-    }
-
-    return surf;
+    cairo_restore(priv->tiles_cr);
 }
 
 static void
-osm_gps_map_tile_saved(OsmGpsMap *map, const gchar *filename)
+osm_gps_map_tile_loaded(OsmGpsMap *map, guint64 key)
 {
-    cairo_surface_t *cr_surf;
-
-    cr_surf = osm_gps_map_from_file(filename);
-    if (cr_surf && cairo_surface_status(cr_surf) == CAIRO_STATUS_SUCCESS) {
-        OsmCachedTile *tile = g_slice_new (OsmCachedTile);
-        tile->cr_surf = cr_surf;
-        tile->redraw_cycle = map->priv->redraw_cycle;
-        /* if the tile is already in the cache (it could be one
-         * rendered from another zoom level), it will be
-         * overwritten */
-        g_hash_table_insert (map->priv->tile_cache, g_strdup(filename), tile);
-        IDLE_REDRAW(map);
-    }
-}
-
-static cairo_surface_t* osm_gps_map_from_mem(const unsigned char *buffer,
-                                             size_t len, const char *ext)
-{
-    cairo_surface_t *surf = NULL;
-
-    (void)buffer;
-    (void)len;
-
-    if (!strcmp(ext, "png")) {
-        g_warning("PNG load from memory not implemented!");
-    } else {
-#if JPEG_LIB_VERSION >= 80
-    GError *error;
-        error = NULL;
-        surf = maep_loader_jpeg_from_mem(buffer, len, &error);
-        if (error) {
-            g_warning("%s", error->message);
-            g_error_free(error);
-        }
-#else
-        g_warning("JPEG load from memory not available!");
-#endif
-    }
+    OsmGpsMapPrivate *priv = map->priv;
+    cairo_rectangle_int_t rect;
 
-    return surf;
-}
-static void
-osm_gps_map_tile_received(OsmGpsMap *map, const gchar *filename, const unsigned char*data, size_t len)
-{
-    cairo_surface_t *cr_surf;
+    /* The tile has been decoded by the manager already. Tiles of
+       deeper zoom levels are only prefetched, not drawn. */
+    if (!priv->source ||
+        MAEP_TILE_KEY_SOURCE(key) != maep_source_get_id(priv->source) ||
+        MAEP_TILE_KEY_ZOOM(key) > priv->map_zoom)
+        return;
 
-    cr_surf = osm_gps_map_from_mem(data, len, maep_source_get_image_suffix(map->priv->source));
-    if (cr_surf && cairo_surface_status(cr_surf) == CAIRO_STATUS_SUCCESS) {
-        OsmCachedTile *tile = g_slice_new (OsmCachedTile);
-        tile->cr_surf = cr_surf;
-        tile->redraw_cycle = map->priv->redraw_cycle;
-        /* if the tile is already in the cache (it could be one
-         * rendered from another zoom level), it will be
-         * overwritten */
-        g_hash_table_insert (map->priv->tile_cache, g_strdup(filename), tile);
-        IDLE_REDRAW(map);
+    /* What has been drawn in place was a fallback, or outdated. */
+    if (MAEP_TILE_KEY_ZOOM(key) == priv->drawn_zoom) {
+        rect.x = MAEP_TILE_KEY_X(key);
+        rect.y = MAEP_TILE_KEY_Y(key);
+        rect.width = 1;
+        rect.height = 1;
+        cairo_region_union_rectangle(priv->stale, &rect);
     }
+    IDLE_REDRAW(map);
 }
 
-
-static OsmCachedTile *
-osm_gps_map_load_cached_tile (OsmGpsMap *map, const gchar *filename)
+/* Keep a reference on the tile until the next redraw. */
+static MaepTile *
+osm_gps_map_hold_tile (OsmGpsMap *map, MaepTile *tile)
 {
-    OsmGpsMapPrivate *priv = map->priv;
-    OsmCachedTile *tile;
-    cairo_surface_t *cr_surf;
-    gchar *key;
-
-    tile = g_hash_table_lookup (priv->tile_cache, filename);
-    if (!tile)
-    {
-        cr_surf = osm_gps_map_from_file(filename);
-        if (cr_surf && cairo_surface_status(cr_surf) == CAIRO_STATUS_SUCCESS)
-        {
-            tile = g_slice_new (OsmCachedTile);
-            tile->cr_surf = cr_surf;
-            key = g_strdup(filename);
-            g_hash_table_insert (priv->tile_cache, key, tile);
-            /* g_message("caching %s %p.", filename, (gpointer)cr_surf); */
-        }
-    }
-    
-    /* set/update the redraw_cycle timestamp on the tile */
     if (tile)
-    {
-        tile->redraw_cycle = priv->redraw_cycle;
-    }
-
+        g_ptr_array_add (map->priv->tiles, tile);
     return tile;
 }
 
-static OsmCachedTile *
+/* Only the closest parent available on disk is requested, further
+   ones are used if they are in memory already. Synthetic parents are
+   skipped, so the rank of a tile upscaled from the parent found is
+   its zoom difference. */
+static MaepTile *
 osm_gps_map_find_bigger_tile (OsmGpsMap *map, int zoom, int x, int y,
-                              int *zoom_found)
+                              int *zoom_found, gboolean request)
 {
-    OsmCachedTile *tile;
-    gchar *filename;
+    OsmGpsMapPrivate *priv = map->priv;
+    MaepTile *tile;
     int next_zoom, next_x, next_y;
 
     if (zoom == 0) return NULL;
@@ -576,63 +527,117 @@ osm_gps_map_find_bigger_tile (OsmGpsMap *map, int zoom, int x, int y,
     next_x = x / 2;
     next_y = y / 2;
 
-    filename = maep_source_manager_get_cached_tile(map->priv->manager,
-                                                   map->priv->source,
-                                                   next_zoom, next_x, next_y);
-    if (!filename)
-        return osm_gps_map_find_bigger_tile (map, next_zoom, next_x, next_y,
-                                             zoom_found);
-
-    tile = osm_gps_map_load_cached_tile (map, filename);
-    g_free(filename);
+    tile = maep_source_manager_peek_tile(priv->manager, priv->source,
+                                         next_zoom, next_x, next_y);
+    if (tile && tile->synthetic) {
+        maep_tile_unref(tile);
+        tile = NULL;
+    }
+    osm_gps_map_hold_tile (map, tile);
+    if (!tile && request) {
+        if (maep_source_manager_has_cached_tile(priv->manager, priv->source,
+                                                next_zoom, next_x, next_y)) {
+            tile = osm_gps_map_hold_tile
+                (map, maep_source_manager_load_cached_tile(priv->manager, priv->source,
+                                                           next_zoom, next_x, next_y,
+                                                           &priv->request));
+            request = FALSE;
+        }
+    }
     if (tile)
         *zoom_found = next_zoom;
     else
         tile = osm_gps_map_find_bigger_tile (map, next_zoom, next_x, next_y,
-                                             zoom_found);
+                                             zoom_found, request);
     return tile;
 }
 
-static OsmCachedTile *
+/* The crop of the parent is scaled once with a smooth filter and
+   kept in the tile cache until the real tile is loaded. */
+static MaepTile *
 osm_gps_map_render_missing_tile_upscaled (OsmGpsMap *map, int zoom,
                                           int x, int y,
-                                          int *modulo, int *area_x, int *area_y)
+                                          MaepTile *big, int zoom_big)
 {
-    OsmCachedTile *big;
-    int zoom_big, zoom_diff, area_size;
-
-    big = osm_gps_map_find_bigger_tile (map, zoom, x, y, &zoom_big);
-    if (!big) return NULL;
+    OsmGpsMapPrivate *priv = map->priv;
+    cairo_surface_t *surf;
+    cairo_t *cr;
+    int zoom_diff, area_size, modulo;
 
     g_debug ("Found bigger tile (zoom = %d, wanted = %d)", zoom_big, zoom);
 
-    /* get a Pixbuf for the area to magnify */
+    /* get the area to magnify */
     zoom_diff = zoom - zoom_big;
     area_size = TILESIZE >> zoom_diff;
-    *modulo = 1 << zoom_diff;
-    *area_x = (x % (*modulo)) * area_size;
-    *area_y = (y % (*modulo)) * area_size;
+    modulo = 1 << zoom_diff;
+
+    surf = cairo_image_surface_create(cairo_image_surface_get_format(big->surf),
+                                      TILESIZE, TILESIZE);
+    cr = cairo_create(surf);
+    cairo_scale(cr, modulo, modulo);
+    cairo_set_source_surface(cr, big->surf, - (x % modulo) * area_size,
+                             - (y % modulo) * area_size);
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_BILINEAR);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+
+    return osm_gps_map_hold_tile
+        (map, maep_source_manager_add_synthetic_tile(priv->manager, priv->source,
+                                                     zoom, x, y, surf,
+                                                     zoom_diff));
+}
+
+static MaepTile *
+osm_gps_map_render_missing_tile_downscaled (OsmGpsMap *map, int zoom,
+                                            int x, int y)
+{
+    OsmGpsMapPrivate *priv = map->priv;
 
-    return big;
+    return osm_gps_map_hold_tile
+        (map, maep_source_manager_get_tile_from_children(priv->manager, priv->source,
+                                                         zoom, x, y, &priv->request));
 }
 
-static OsmCachedTile *
-osm_gps_map_render_missing_tile (OsmGpsMap *map, int zoom, int x, int y,
-                                 int *modulo, int *area_x, int *area_y)
+static MaepTile *
+osm_gps_map_render_missing_tile (OsmGpsMap *map, int zoom, int x, int y)
 {
-    /* maybe TODO: render from downscaled tiles, if the following fails */
-    /* g_message("look for upscaled at %dx%d.", x, y); */
-    return osm_gps_map_render_missing_tile_upscaled (map, zoom, x, y,
-                                                     modulo, area_x, area_y);
+    OsmGpsMapPrivate *priv = map->priv;
+    MaepTile *tile, *big, *small;
+    int zoom_big;
+
+    /* A provisional tile from the closest levels is as good as it
+       gets until the real one is loaded. */
+    tile = osm_gps_map_hold_tile
+        (map, maep_source_manager_peek_tile(priv->manager, priv->source, zoom, x, y));
+    if (tile && tile->synthetic <= 1)
+        return tile;
+
+    big = osm_gps_map_find_bigger_tile (map, zoom, x, y, &zoom_big, TRUE);
+    if (big && zoom - zoom_big == 1)
+        return osm_gps_map_render_missing_tile_upscaled (map, zoom, x, y,
+                                                         big, zoom_big);
+
+    /* Parents further up are blurry or missing when zooming out of
+       an area browsed in details, use the children instead. */
+    small = osm_gps_map_render_missing_tile_downscaled (map, zoom, x, y);
+    if (small)
+        return small;
+
+    if (big && (!tile || zoom - zoom_big < (int)tile->synthetic))
+        return osm_gps_map_render_missing_tile_upscaled (map, zoom, x, y,
+                                                         big, zoom_big);
+    return tile;
 }
 
+/* Tiles already drawn are only borrowed again, to keep them in
+   memory and their refresh requested. */
 static void
-osm_gps_map_load_tile (OsmGpsMap *map, int zoom, int x, int y, int offset_x, int offset_y)
+osm_gps_map_load_tile (OsmGpsMap *map, int zoom, int x, int y, int offset_x, int offset_y,
+                       gboolean drawn)
 {
     OsmGpsMapPrivate *priv = map->priv;
-    gchar *filename;
-    OsmCachedTile *tile = NULL;
-    int modulo, area_x, area_y;
+    MaepTile *tile = NULL;
+    cairo_rectangle_int_t rect;
 
     g_debug("Load tile %d,%d (%d,%d) z:%d", x, y, offset_x, offset_y, zoom);
 
@@ -641,28 +646,66 @@ osm_gps_map_load_tile (OsmGpsMap *map, int zoom, int x, int y, int offset_x, int
         return;
     }
 
-    filename = maep_source_manager_get_tile_async(priv->manager, priv->source,
-                                                  zoom, x, y);
-    if (filename) {
-        tile = osm_gps_map_load_cached_tile(map, filename);
-        if (!tile) g_warning("cannot load %s from cache.", filename);
-        g_free(filename);
-    }
-
-    if (tile)
-        osm_gps_map_blit_surface(map, tile->cr_surf, offset_x,offset_y,
-                                 1, 0, 0);
-    else if (maep_source_get_cache_policy(priv->source)) {
+    tile = osm_gps_map_hold_tile
+        (map, maep_source_manager_get_tile(priv->manager, priv->source,
+                                           zoom, x, y, &priv->request));
+    if (tile) {
+        if (!drawn)
+            osm_gps_map_blit_surface(map, tile->surf, offset_x,offset_y,
+                                     1, 0, 0);
+    } else {
         /* try to render the tile by scaling cached tiles from other zoom
-         * levels */
-        tile = osm_gps_map_render_missing_tile (map, zoom, x, y,
-                                                &modulo, &area_x, &area_y);
+         * levels, while it is downloaded or decoded. Outdated parents
+         * are only found if the cache policy of the source allows it. */
+        tile = osm_gps_map_render_missing_tile (map, zoom, x, y);
         if (tile)
-            osm_gps_map_blit_surface (map, tile->cr_surf, offset_x,offset_y,
-                                      modulo, area_x, area_y);
+            osm_gps_map_blit_surface (map, tile->surf, offset_x,offset_y,
+                                      1, 0, 0);
+        else {
+            /* Don't leave pixels shifted from another tile. */
+            rect.x = offset_x;
+            rect.y = offset_y;
+            rect.width = (priv->double_pixel)?TILESIZE * 2: TILESIZE;
+            rect.height = rect.width;
+            cairo_region_union_rectangle(priv->damage, &rect);
+            cairo_save(priv->tiles_cr);
+            cairo_set_operator(priv->tiles_cr, CAIRO_OPERATOR_CLEAR);
+            cairo_rectangle(priv->tiles_cr, rect.x, rect.y, rect.width, rect.height);
+            cairo_fill(priv->tiles_cr);
+            cairo_restore(priv->tiles_cr);
+        }
     }
 }
 
+/* Move the content of an image surface by dx,dy pixels, what is
+   moved out is lost, what is exposed is left as is. */
+static void
+osm_gps_map_shift_surface (cairo_surface_t *surf, int dx, int dy)
+{
+    unsigned char *data;
+    int stride, width, height, row, len;
+
+    cairo_surface_flush(surf);
+    data = cairo_image_surface_get_data(surf);
+    stride = cairo_image_surface_get_stride(surf);
+    width = cairo_image_surface_get_width(surf);
+    height = cairo_image_surface_get_height(surf);
+
+    len = (width - ABS(dx)) * 4;
+    if (len <= 0 || ABS(dy) >= height)
+        return;
+
+    if (dy > 0)
+        for (row = height - 1; row >= dy; row--)
+            memmove(data + row * stride + MAX(dx, 0) * 4,
+                    data + (row - dy) * stride + MAX(-dx, 0) * 4, len);
+    else
+        for (row = 0; row < height + dy; row++)
+            memmove(data + row * stride + MAX(dx, 0) * 4,
+                    data + (row - dy) * stride + MAX(-dx, 0) * 4, len);
+    cairo_surface_mark_dirty(surf);
+}
+
 static void
 osm_gps_map_fill_tiles_pixel (OsmGpsMap *map)
 {
@@ -672,7 +715,11 @@ osm_gps_map_fill_tiles_pixel (OsmGpsMap *map)
     int offset_yn = 0;
     int offset_x;
     int offset_y;
-    int tilesize, zoom;
+    int tilesize, zoom, dx, dy;
+    int width, height, ox, oy, sx, sy, x0, x1, y0, y1;
+    gboolean shifted, drawn;
+    cairo_rectangle_int_t rect;
+    GPtrArray *old_tiles;
 
     g_debug("Fill tiles: %d,%d z:%d", priv->map_x, priv->map_y, priv->map_zoom);
     tilesize = (priv->double_pixel)?TILESIZE * 2: TILESIZE;
@@ -693,22 +740,248 @@ osm_gps_map_fill_tiles_pixel (OsmGpsMap *map)
 
     tile_x0 =  floor((float)fmap_x / (float)tilesize);
     tile_y0 =  floor((float)fmap_y / (float)tilesize);
+
+    /* When only panned, the tiles of the previous redraw are moved
+       to follow the position of the tile 0,0 on the surface. */
+    width = cairo_image_surface_get_width(priv->tiles_surf);
+    height = cairo_image_surface_get_height(priv->tiles_surf);
+    ox = offset_xn - tile_x0 * tilesize;
+    oy = offset_yn - tile_y0 * tilesize;
+    sx = ox - priv->drawn_ox;
+    sy = oy - priv->drawn_oy;
+    shifted = (zoom == priv->drawn_zoom && ABS(sx) < width && ABS(sy) < height);
+    if (!shifted || sx || sy) {
+        rect.x = 0;
+        rect.y = 0;
+        rect.width = width;
+        rect.height = height;
+        cairo_region_union_rectangle(priv->damage, &rect);
+    }
+    if (shifted)
+        osm_gps_map_shift_surface(priv->tiles_surf, sx, sy);
+    else {
+        cairo_save (priv->tiles_cr);
+        cairo_set_operator (priv->tiles_cr, CAIRO_OPERATOR_CLEAR);
+        cairo_paint (priv->tiles_cr);
+        cairo_restore (priv->tiles_cr);
+    }
+
+    /* Tiles of the previous redraw are released only after the new
+       ones are borrowed. */
+    old_tiles = priv->tiles;
+    priv->tiles = g_ptr_array_new_with_free_func((GDestroyNotify)maep_tile_unref);
+    priv->request.serial += 1;
+
+    /* Let packed tiles of the view be read ahead all together. */
+    if (priv->source)
+        maep_source_manager_advise_tiles(priv->manager, priv->source, zoom,
+                                         MAX(tile_x0, 0), MAX(tile_y0, 0),
+                                         tile_x0 + tiles_nx - 1, tile_y0 + tiles_ny - 1);
+
     //TODO: implement wrap around
     for (i=tile_x0; i<(tile_x0+tiles_nx);i++) {
         for (j=tile_y0;  j<(tile_y0+tiles_ny); j++) {
+            /* A tile is kept if all of it on the surface has been
+               moved from the surface. */
+            x0 = MAX(offset_xn, 0) - sx;
+            x1 = MIN(offset_xn + tilesize, width) - sx;
+            y0 = MAX(offset_yn, 0) - sy;
+            y1 = MIN(offset_yn + tilesize, height) - sy;
+            drawn = shifted &&
+                i >= priv->drawn_x0 && i <= priv->drawn_x1 &&
+                j >= priv->drawn_y0 && j <= priv->drawn_y1 &&
+                x0 >= 0 && x1 <= width && y0 >= 0 && y1 <= height &&
+                !cairo_region_contains_point(priv->stale, i, j);
             if( j<0 || i<0 ||
                 i>=exp(priv->map_zoom * M_LN2) || j>=exp(priv->map_zoom * M_LN2)) {
-                cairo_rectangle(priv->cr, offset_xn, offset_yn,
-                                tilesize, tilesize);
-                cairo_set_source_rgb(priv->cr, 1., 1., 1.);
-                cairo_fill(priv->cr);
-            } else
-                osm_gps_map_load_tile(map, zoom, i,j, offset_xn, offset_yn);
+                if (!drawn) {
+                    rect.x = offset_xn;
+                    rect.y = offset_yn;
+                    rect.width = tilesize;
+                    rect.height = tilesize;
+                    cairo_region_union_rectangle(priv->damage, &rect);
+                    cairo_rectangle(priv->tiles_cr, offset_xn, offset_yn,
+                                    tilesize, tilesize);
+                    cairo_set_source_rgb(priv->tiles_cr, 1., 1., 1.);
+                    cairo_fill(priv->tiles_cr);
+                }
+            } else {
+                /* Decode the tiles closest to the centre first. */
+                dx = 2 * i + 1 - (2 * tile_x0 + tiles_nx);
+                dy = 2 * j + 1 - (2 * tile_y0 + tiles_ny);
+                priv->request.priority = dx * dx + dy * dy;
+                osm_gps_map_load_tile(map, zoom, i,j, offset_xn, offset_yn, drawn);
+            }
             offset_yn += tilesize;
         }
         offset_xn += tilesize;
         offset_yn = offset_y + 0.5 * priv->viewport_height * (1.5 - 1. / priv->map_factor);
     }
+
+    /* Keep the neighbouring tiles still in memory for panning. */
+    for (i = tile_x0 - 1; i <= tile_x0 + tiles_nx; i++)
+        for (j = tile_y0 - 1; j <= tile_y0 + tiles_ny; j++)
+            if (i < 0 || j < 0 ||
+                (i >= tile_x0 && i < tile_x0 + tiles_nx &&
+                 j >= tile_y0 && j < tile_y0 + tiles_ny))
+                continue;
+            else
+                osm_gps_map_hold_tile(map, maep_source_manager_peek_tile
+                                      (priv->manager, priv->source, zoom, i, j));
+
+    g_ptr_array_unref(old_tiles);
+
+    priv->drawn_zoom = zoom;
+    priv->drawn_x0 = tile_x0;
+    priv->drawn_y0 = tile_y0;
+    priv->drawn_x1 = tile_x0 + tiles_nx - 1;
+    priv->drawn_y1 = tile_y0 + tiles_ny - 1;
+    priv->drawn_ox = ox;
+    priv->drawn_oy = oy;
+    cairo_region_destroy(priv->stale);
+    priv->stale = cairo_region_create();
+
+    /* Tiles scrolled away are not decoded any more. */
+    maep_source_manager_cancel_requests(priv->manager, &priv->request);
+
+    /* The levels around a new view are prefetched once idle. */
+    if (zoom != priv->view_zoom ||
+        MAX(tile_x0, 0) != priv->view_x0 || MAX(tile_y0, 0) != priv->view_y0 ||
+        tile_x0 + tiles_nx - 1 != priv->view_x1 ||
+        tile_y0 + tiles_ny - 1 != priv->view_y1) {
+        priv->view_zoom = zoom;
+        priv->view_x0 = MAX(tile_x0, 0);
+        priv->view_y0 = MAX(tile_y0, 0);
+        priv->view_x1 = tile_x0 + tiles_nx - 1;
+        priv->view_y1 = tile_y0 + tiles_ny - 1;
+        priv->idle.serial += 1;
+        maep_source_manager_cancel_requests(priv->manager, &priv->idle);
+        priv->idle_done = FALSE;
+        osm_gps_map_schedule_idle_prefetch(map);
+    }
+}
+
+/* Download, and decode if asked, the tiles of the levels just above
+   and below the view, with a border of one tile, so zooming lands on
+   real tiles. Returns the number of downloads queued. */
+static guint
+osm_gps_map_prefetch_level (OsmGpsMap *map, int zoom,
+                            int x0, int y0, int x1, int y1,
+                            guint *downloads, guint *decodes)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    MaepTile *tile;
+    int i, j, max;
+    guint n;
+
+    max = (1 << zoom) - 1;
+    x0 = MAX(x0 - 1, 0);
+    y0 = MAX(y0 - 1, 0);
+    x1 = MIN(x1 + 1, max);
+    y1 = MIN(y1 + 1, max);
+
+    n = 0;
+    for (i = x0; i <= x1; i++)
+        for (j = y0; j <= y1; j++) {
+            if (*downloads && maep_source_manager_download_tile
+                (priv->manager, priv->source, zoom, i, j, &priv->idle)) {
+                *downloads -= 1;
+                n += 1;
+            } else if (*decodes && priv->idle_decode) {
+                tile = maep_source_manager_load_cached_tile
+                    (priv->manager, priv->source, zoom, i, j, &priv->idle);
+                if (tile)
+                    maep_tile_unref(tile);
+                else
+                    *decodes -= 1;
+            }
+        }
+    return n;
+}
+
+static gboolean
+osm_gps_map_idle_prefetch (OsmGpsMap *map)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    guint queued, in_flight, downloads, decodes, n;
+    int zoom;
+
+    g_object_get(priv->manager, "tiles-queued", &queued,
+                 "tiles-in-flight", &in_flight, NULL);
+    /* Wait for the tiles of the view first. */
+    if (queued || in_flight)
+        return TRUE;
+
+    priv->idle_prefetch = 0;
+    zoom = priv->view_zoom;
+    if (!priv->source || priv->interacting || zoom < 0)
+        return FALSE;
+
+    /* The tiles downloaded by the former round are decoded by this
+       one, until there is nothing more to download. */
+    downloads = PREFETCH_IDLE_DOWNLOADS;
+    decodes = PREFETCH_IDLE_DECODES;
+    n = 0;
+    priv->idle.serial += 1;
+    if (zoom < priv->max_zoom)
+        n += osm_gps_map_prefetch_level(map, zoom + 1,
+                                        2 * priv->view_x0, 2 * priv->view_y0,
+                                        2 * priv->view_x1 + 1, 2 * priv->view_y1 + 1,
+                                        &downloads, &decodes);
+    if (zoom > priv->min_zoom)
+        n += osm_gps_map_prefetch_level(map, zoom - 1,
+                                        priv->view_x0 / 2, priv->view_y0 / 2,
+                                        priv->view_x1 / 2, priv->view_y1 / 2,
+                                        &downloads, &decodes);
+    maep_source_manager_cancel_requests(priv->manager, &priv->idle);
+    g_debug("Idle prefetch of %d tiles around zoom %d.", n, zoom);
+
+    priv->idle_done = (n == 0);
+    if (!priv->idle_done)
+        osm_gps_map_schedule_idle_prefetch(map);
+    return FALSE;
+}
+
+static void
+osm_gps_map_schedule_idle_prefetch (OsmGpsMap *map)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+
+    if (priv->idle_prefetch)
+        g_source_remove(priv->idle_prefetch);
+    priv->idle_prefetch = 0;
+    if (priv->interacting || priv->idle_done || !priv->map_auto_download)
+        return;
+    priv->idle_prefetch = g_timeout_add(PREFETCH_IDLE_DELAY,
+                                        (GSourceFunc)osm_gps_map_idle_prefetch, map);
+}
+
+/**
+ * osm_gps_map_set_interacting:
+ * @map: a #OsmGpsMap object.
+ * @status: TRUE when the user starts touching the map.
+ *
+ * Tell the map about user interaction. Tiles of the levels around the
+ * view are prefetched only once the map has been left idle, and the
+ * ones not started are dropped as soon as interaction resumes.
+ */
+void
+osm_gps_map_set_interacting (OsmGpsMap *map, gboolean status)
+{
+    OsmGpsMapPrivate *priv;
+
+    g_return_if_fail(OSM_IS_GPS_MAP(map));
+    priv = map->priv;
+
+    if (priv->interacting == (status != FALSE))
+        return;
+    priv->interacting = (status != FALSE);
+
+    if (priv->interacting) {
+        priv->idle.serial += 1;
+        maep_source_manager_cancel_requests(priv->manager, &priv->idle);
+    }
+    osm_gps_map_schedule_idle_prefetch(map);
 }
 
 void osm_gps_map_get_tile_xy_at(OsmGpsMap *map, float lat, float lon,
@@ -797,6 +1070,11 @@ osm_gps_map_print_track (OsmGpsMapPrivate *priv, MaepGeodata *track, int lw,
             cairo_fill_preserve (priv->cr);
             cairo_set_source_rgba (priv->cr, 0.0, 0.0, 0.0, 0.6);
             cairo_stroke (priv->cr);
+
+            *max_x = MAX(x + s + 1, *max_x);
+            *min_x = MIN(x - s - 1, *min_x);
+            *max_y = MAX(y + 1, *max_y);
+            *min_y = MIN(y - 2.5 * s - 1, *min_y);
         }
 }
 
@@ -824,36 +1102,18 @@ osm_gps_map_print_tracks (OsmGpsMap *map)
             tmp = g_slist_next(tmp);
         }
 
+        /* Segment ends are drawn three times wider. */
         if (max_x > 0 && max_y > 0)
             {
-                rect.x = min_x - lw;
-                rect.y = min_y - lw;
-                rect.width = max_x - min_x + 2 * lw;
-                rect.height = max_y - min_y + 2 * lw;
+                rect.x = min_x - 2 * lw;
+                rect.y = min_y - 2 * lw;
+                rect.width = max_x - min_x + 4 * lw;
+                rect.height = max_y - min_y + 4 * lw;
                 cairo_region_union_rectangle(priv->dirty, &rect);
             }
     }
 }
 
-static gboolean
-osm_gps_map_purge_cache_check(G_GNUC_UNUSED gpointer key, gpointer value, gpointer user)
-{
-   return (((OsmCachedTile*)value)->redraw_cycle != ((OsmGpsMapPrivate*)user)->redraw_cycle);
-}
-
-static void
-osm_gps_map_purge_cache (OsmGpsMap *map)
-{
-   OsmGpsMapPrivate *priv = map->priv;
-
-   if (g_hash_table_size (priv->tile_cache) < priv->max_tile_cache_size)
-       return;
-
-   /* run through the cache, and remove the tiles which have not been used
-    * during the last redraw operation */
-   g_hash_table_foreach_remove(priv->tile_cache, osm_gps_map_purge_cache_check, priv);
-}
-
 void osm_gps_map_blit(OsmGpsMap *map, cairo_t *cr, cairo_operator_t op)
 {
     OsmGpsMapPrivate *priv;
@@ -876,10 +1136,53 @@ void osm_gps_map_blit(OsmGpsMap *map, cairo_t *cr, cairo_operator_t op)
     cairo_restore(cr);
 }
 
+/* Put the tiles back in area, and draw the tracks, the images and
+   the layers over them, clipped to area. With an empty area, nothing
+   is drawn but where the tracks, the images and the GPS point go is
+   still added to dirty. */
+static void
+osm_gps_map_draw_area (OsmGpsMap *map, const cairo_region_t *area)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    cairo_rectangle_int_t rect;
+    GSList *list;
+    int i;
+
+    if (cairo_region_is_empty(area) &&
+        !priv->tracks && !(priv->show_trip_history && priv->trip_history) &&
+        !priv->images && !priv->gps_valid)
+        return;
+
+    cairo_save (priv->cr);
+    for (i = 0; i < cairo_region_num_rectangles(area); i++) {
+        cairo_region_get_rectangle(area, i, &rect);
+        cairo_rectangle(priv->cr, rect.x, rect.y, rect.width, rect.height);
+    }
+    cairo_clip (priv->cr);
+
+    /* the tiles replace the previous pixmap, other layers go on top */
+    cairo_save (priv->cr);
+    cairo_set_operator (priv->cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface (priv->cr, priv->tiles_surf, 0, 0);
+    cairo_paint (priv->cr);
+    cairo_restore (priv->cr);
+
+    osm_gps_map_print_tracks(map);
+    osm_gps_map_draw_gps_point(map);
+    osm_gps_map_print_images(map);
+
+    for(list = priv->layers; list != NULL; list = list->next)
+        osm_gps_map_layer_draw(OSM_GPS_MAP_LAYER(list->data), priv->cr, map);
+
+    cairo_restore (priv->cr);
+}
+
 static gboolean
 osm_gps_map_redraw (OsmGpsMap *map)
 {
     OsmGpsMapPrivate *priv = map->priv;
+    cairo_region_t *outside;
+    cairo_rectangle_int_t rect;
     GSList *list;
 
     /* Don't draw anything for a NULL source.
@@ -918,33 +1221,81 @@ osm_gps_map_redraw (OsmGpsMap *map)
 /*         return FALSE; */
 /* #endif */
 
-    priv->redraw_cycle++;
-
-    /* draw transparent background to initialise pixmap */
-    cairo_save (priv->cr);
-    cairo_set_operator (priv->cr, CAIRO_OPERATOR_CLEAR);
-    cairo_paint (priv->cr);
-    cairo_restore (priv->cr);
-
+    cairo_region_destroy(priv->damage);
+    priv->damage = cairo_region_create();
     osm_gps_map_fill_tiles_pixel(map);
 
+    /* What was drawn over the tiles last time is erased with them,
+       layers don't tell where they draw. */
+    cairo_region_union(priv->damage, priv->drawn_dirty);
+    if (priv->layers) {
+        rect.x = 0;
+        rect.y = 0;
+        rect.width = cairo_image_surface_get_width(priv->cr_surf);
+        rect.height = cairo_image_surface_get_height(priv->cr_surf);
+        cairo_region_union_rectangle(priv->damage, &rect);
+    }
     g_debug("dirty is %p.", (gpointer)priv->dirty);
-    osm_gps_map_print_tracks(map);
-    osm_gps_map_draw_gps_point(map);
-    osm_gps_map_print_images(map);
-
-    for(list = priv->layers; list != NULL; list = list->next)
-        osm_gps_map_layer_draw(OSM_GPS_MAP_LAYER(list->data), priv->cr, map);
-
-    osm_gps_map_purge_cache(map);
+    osm_gps_map_draw_area(map, priv->damage);
+
+    /* Tracks or images may now be drawn out of the erased area, like
+       new ones on a map that did not move, draw them there too, over
+       the tiles that have been left as is. */
+    outside = cairo_region_copy(priv->dirty);
+    cairo_region_subtract(outside, priv->damage);
+    if (!cairo_region_is_empty(outside)) {
+        cairo_region_destroy(priv->dirty);
+        priv->dirty = cairo_region_create();
+        osm_gps_map_draw_area(map, outside);
+        cairo_region_union(priv->damage, outside);
+    }
+    cairo_region_destroy(outside);
 
     g_signal_emit_by_name(G_OBJECT(map), "dirty");
-    cairo_region_destroy(priv->dirty);
+    cairo_region_destroy(priv->drawn_dirty);
+    priv->drawn_dirty = priv->dirty;
     priv->dirty = cairo_region_create();
     
     return TRUE;
 }
 
+/**
+ * osm_gps_map_get_damage:
+ * @map: a #OsmGpsMap.
+ * @area: (out): location for the changed area.
+ *
+ * Get the bounds of what changed at the last redraw, in the
+ * coordinates osm_gps_map_blit() paints to, so that handlers of the
+ * "dirty" signal can update only this area.
+ *
+ * Returns: FALSE if nothing changed.
+ */
+gboolean
+osm_gps_map_get_damage (OsmGpsMap *map, cairo_rectangle_int_t *area)
+{
+    OsmGpsMapPrivate *priv;
+    cairo_rectangle_int_t ext;
+    double dx, dy;
+
+    g_return_val_if_fail (OSM_IS_GPS_MAP (map), FALSE);
+    g_return_val_if_fail (area, FALSE);
+    priv = map->priv;
+
+    if (cairo_region_is_empty(priv->damage))
+        return FALSE;
+
+    /* Same transformation as osm_gps_map_blit(), with a pixel of
+       margin for the filtering when scaled. */
+    cairo_region_get_extents(priv->damage, &ext);
+    dx = (1.5 * priv->map_factor - 1.) * priv->viewport_width * 0.5f;
+    dy = (1.5 * priv->map_factor - 1.) * priv->viewport_height * 0.5f;
+    area->x = floor(ext.x * priv->map_factor - dx) - 1;
+    area->y = floor(ext.y * priv->map_factor - dy) - 1;
+    area->width = ceil((ext.x + ext.width) * priv->map_factor - dx) + 1 - area->x;
+    area->height = ceil((ext.y + ext.height) * priv->map_factor - dy) + 1 - area->y;
+    return TRUE;
+}
+
 static gboolean
 osm_gps_map_idle_redraw(OsmGpsMap *map)
 {
@@ -983,6 +1334,10 @@ osm_gps_map_init (OsmGpsMap *object)
 
     priv->cr_surf = NULL;
     priv->cr = NULL;
+    priv->tiles_surf = NULL;
+    priv->tiles_cr = NULL;
+    priv->drawn_zoom = -1;
+    priv->stale = cairo_region_create();
 
     priv->map_factor = 1.;
 
@@ -1000,22 +1355,32 @@ osm_gps_map_init (OsmGpsMap *object)
     priv->center_rlat = G_MAXFLOAT;
     priv->center_rlon = G_MAXFLOAT;
     priv->dirty = cairo_region_create();
+    priv->drawn_dirty = cairo_region_create();
+    priv->damage = cairo_region_create();
 
     priv->manager = maep_source_manager_get_instance();
-    g_signal_connect_object(priv->manager, "tile-saved",
-                            G_CALLBACK(osm_gps_map_tile_saved), object, G_CONNECT_SWAPPED);
-    g_signal_connect_object(priv->manager, "tile-received",
-                            G_CALLBACK(osm_gps_map_tile_received), object, G_CONNECT_SWAPPED);
+    g_signal_connect_object(priv->manager, "tile-loaded",
+                            G_CALLBACK(osm_gps_map_tile_loaded), object, G_CONNECT_SWAPPED);
     priv->source = NULL;
 
     g_mutex_init(&priv->mutex);
     priv->idle_map_redraw = 0;
 
 
-    /* memory cache for most recently used tiles */
-    priv->tile_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                              g_free, (GDestroyNotify)cached_tile_free);
-    priv->max_tile_cache_size = 20;
+    /* decoded tiles are shared by the source manager, we only
+       reference the ones we are drawing */
+    priv->tiles = g_ptr_array_new_with_free_func ((GDestroyNotify)maep_tile_unref);
+    priv->request.owner = object;
+    priv->request.serial = 0;
+    priv->request.priority = 0;
+    priv->prefetch.owner = &priv->prefetch;
+    priv->prefetch.serial = 0;
+    priv->prefetch.priority = MAEP_TILE_PRIORITY_BACKGROUND;
+    priv->idle.owner = &priv->idle;
+    priv->idle.serial = 0;
+    priv->idle.priority = MAEP_TILE_PRIORITY_BACKGROUND;
+    priv->idle_prefetch = 0;
+    priv->view_zoom = -1;
 }
 
 /* strcmp0 was introduced with glib 2.16 */
@@ -1076,18 +1441,35 @@ osm_gps_map_dispose (GObject *object)
     g_message("disposing map.");
     priv->is_disposed = TRUE;
 
-    g_hash_table_destroy(priv->tile_cache);
+    /* Our pending decodings are not needed any more. */
+    priv->request.serial += 1;
+    maep_source_manager_cancel_requests(priv->manager, &priv->request);
+    priv->prefetch.serial += 1;
+    maep_source_manager_cancel_requests(priv->manager, &priv->prefetch);
+    priv->idle.serial += 1;
+    maep_source_manager_cancel_requests(priv->manager, &priv->idle);
+    if (priv->idle_prefetch)
+        g_source_remove(priv->idle_prefetch);
+    priv->idle_prefetch = 0;
+    g_ptr_array_unref(priv->tiles);
 
     /* images and layers contain GObjects which need unreffing, so free here */
     osm_gps_map_free_images(map);
     osm_gps_map_free_layers(map);
 
     cairo_region_destroy(priv->dirty);
+    cairo_region_destroy(priv->drawn_dirty);
+    cairo_region_destroy(priv->damage);
 
     if (priv->cr)
         cairo_destroy (priv->cr);
     if (priv->cr_surf)
         cairo_surface_destroy (priv->cr_surf);
+    if (priv->tiles_cr)
+        cairo_destroy (priv->tiles_cr);
+    if (priv->tiles_surf)
+        cairo_surface_destroy (priv->tiles_surf);
+    cairo_region_destroy(priv->stale);
     
     if (priv->null_tile)
         cairo_surface_destroy (priv->null_tile);
@@ -1130,6 +1512,7 @@ osm_gps_map_set_property (GObject *object, guint prop_id, const GValue *value, G
             break;
         case PROP_DOUBLE_PIXEL:
             priv->double_pixel = g_value_get_boolean (value);
+            priv->drawn_zoom = -1;
             IDLE_REDRAW(map);
             break;
         case PROP_RECORD_TRIP_HISTORY:
@@ -1141,6 +1524,9 @@ osm_gps_map_set_property (GObject *object, guint prop_id, const GValue *value, G
         case PROP_AUTO_DOWNLOAD:
             priv->map_auto_download = g_value_get_boolean (value);
             break;
+        case PROP_IDLE_DECODE:
+            priv->idle_decode = g_value_get_boolean (value);
+            break;
         case PROP_ZOOM:
             osm_gps_map_set_zoom(map, g_value_get_int (value));
             break;
@@ -1192,7 +1578,10 @@ osm_gps_map_set_property (GObject *object, guint prop_id, const GValue *value, G
                 /* we now have to switch the entire map */
 
                 /* flush the ram cache */
-                g_hash_table_remove_all(priv->tile_cache);
+                g_ptr_array_set_size(priv->tiles, 0);
+                priv->drawn_zoom = -1;
+                /* and prefetch around the view again */
+                priv->view_zoom = -1;
 
                 osm_gps_map_setup(priv);
 
@@ -1212,6 +1601,7 @@ osm_gps_map_set_property (GObject *object, guint prop_id, const GValue *value, G
         case PROP_VIEWPORT_HEIGHT:
             osm_gps_map_set_viewport(map, priv->viewport_width, g_value_get_uint (value));
             break;
+
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
             break;
@@ -1242,6 +1632,9 @@ osm_gps_map_get_property (GObject *object, guint prop_id, GValue *value, GParamS
         case PROP_AUTO_DOWNLOAD:
             g_value_set_boolean(value, priv->map_auto_download);
             break;
+        case PROP_IDLE_DECODE:
+            g_value_set_boolean(value, priv->idle_decode);
+            break;
         case PROP_ZOOM:
             g_value_set_int(value, priv->map_zoom);
             break;
@@ -1322,6 +1715,18 @@ osm_gps_map_set_viewport (OsmGpsMap *map, guint width, guint height)
     if (priv->cr)
         cairo_destroy (priv->cr);
     priv->cr = cairo_create (priv->cr_surf);
+    if (priv->tiles_surf)
+        cairo_surface_destroy(priv->tiles_surf);
+    priv->tiles_surf = cairo_image_surface_create
+        (CAIRO_FORMAT_ARGB32,
+         cairo_image_surface_get_width(priv->cr_surf),
+         cairo_image_surface_get_height(priv->cr_surf));
+    if (priv->tiles_cr)
+        cairo_destroy (priv->tiles_cr);
+    priv->tiles_cr = cairo_create (priv->tiles_surf);
+    priv->drawn_zoom = -1;
+    cairo_region_destroy(priv->drawn_dirty);
+    priv->drawn_dirty = cairo_region_create();
 
     // pixel_x,y, offsets
     gint pixel_x = lon2pixel(priv->map_zoom, priv->center_rlon);
@@ -1392,6 +1797,14 @@ osm_gps_map_class_init (OsmGpsMapClass *klass)
                                                            TRUE,
                                                            G_PARAM_READABLE | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT));
 
+    g_object_class_install_property (object_class,
+                                     PROP_IDLE_DECODE,
+                                     g_param_spec_boolean ("idle-decode",
+                                                           "idle decode",
+                                                           "decode the tiles around the view when idle",
+                                                           FALSE,
+                                                           G_PARAM_READABLE | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT));
+
      properties[PROP_ZOOM] = g_param_spec_int ("zoom",
                                                "zoom",
                                                "initial zoom level",
@@ -1553,56 +1966,6 @@ osm_gps_map_class_init (OsmGpsMapClass *klass)
                   g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
 }
 
-void
-osm_gps_map_download_maps (OsmGpsMap *map, coord_t *pt1, coord_t *pt2, int zoom_start, int zoom_end)
-{
-    int i,j,zoom,num_tiles;
-    OsmGpsMapPrivate *priv = map->priv;
-
-    if (pt1 && pt2)
-    {
-        gchar *filename;
-        num_tiles = 0;
-        zoom_end = CLAMP(zoom_end, priv->min_zoom, priv->max_zoom);
-        g_debug("Download maps: z:%d->%d",zoom_start, zoom_end);
-
-        for(zoom=zoom_start; zoom<=zoom_end; zoom++)
-        {
-            int x1,y1,x2,y2;
-
-            x1 = (int)floor((float)lon2pixel(zoom, pt1->rlon) / (float)TILESIZE);
-            y1 = (int)floor((float)lat2pixel(zoom, pt1->rlat) / (float)TILESIZE);
-
-            x2 = (int)floor((float)lon2pixel(zoom, pt2->rlon) / (float)TILESIZE);
-            y2 = (int)floor((float)lat2pixel(zoom, pt2->rlat) / (float)TILESIZE);
-
-            // loop x1-x2
-            for(i=x1; i<=x2; i++)
-            {
-                // loop y1 - y2
-                for(j=y1; j<=y2; j++)
-                {
-                    // x = i, y = j
-                    filename = maep_source_manager_get_tile_async
-                        (priv->manager, priv->source, zoom, i, j);
-
-                    /* if ((!g_file_test(filename, G_FILE_TEST_EXISTS)) || */
-                    /*     osm_gps_map_tile_age_exceeded */
-                    /*     (filename, maep_source_get_cache_period(priv->source))) */
-                    /* { */
-                    /*     maep_source_manager_download_tile(priv->manager, priv->source, */
-                    /*                                       zoom, i, j); */
-                    /*     num_tiles++; */
-                    /* }  */
-
-                    g_free(filename);
-                }
-            }
-            g_debug("DL @Z:%d = %d tiles",zoom,num_tiles);
-        }
-    }
-}
-
 void
 osm_gps_map_get_bbox (OsmGpsMap *map, coord_t *pt1, coord_t *pt2)
 {
@@ -1804,6 +2167,105 @@ osm_gps_map_auto_center_at(OsmGpsMap *map, float latitude, float longitude)
     }
 }
 
+/* Queue the tiles of the cone ahead at zoom, nearest first, within
+   the budget. Tiles already queued by a former position are renewed. */
+static guint
+_prefetch_cone (OsmGpsMap *map, GHashTable *done, int zoom,
+                coord_t *pos, float heading, float distance, guint budget)
+{
+    OsmGpsMapPrivate *priv = map->priv;
+    float px, py, ux, uy, length, d, w, t, step, scale;
+    int x, y, max, side;
+    MaepTileKey key, *stored;
+    guint n;
+
+    max = (1 << zoom) - 1;
+    scale = osm_gps_map_get_scale_at_lat(zoom, 1.f, pos->rlat);
+    length = distance / scale;
+    px = lon2pixel(zoom, pos->rlon);
+    py = lat2pixel(zoom, pos->rlat);
+    /* Heading is clockwise from north, y goes south. */
+    ux = sin(deg2rad(heading));
+    uy = -cos(deg2rad(heading));
+    step = TILESIZE / 2;
+
+    n = 0;
+    for (d = 0.f; d <= length && n < budget; d += step) {
+        w = d * tan(deg2rad(PREFETCH_ANGLE));
+        for (t = 0.f; t <= w && n < budget; t += step) {
+            /* Both sides of the axis, outwards. */
+            for (side = -1; side <= 1 && n < budget; side += 2) {
+                if (side < 0 && t == 0.f)
+                    continue;
+                x = floor((px + ux * d - uy * t * side) / TILESIZE);
+                y = floor((py + uy * d + ux * t * side) / TILESIZE);
+                if (x < 0 || y < 0 || x > max || y > max)
+                    continue;
+                key = MAEP_TILE_KEY(0, zoom, x, y);
+                if (g_hash_table_contains(done, &key))
+                    continue;
+                if (g_hash_table_size(done) >= PREFETCH_MAX_CHECKS)
+                    return n;
+                stored = g_new(MaepTileKey, 1);
+                *stored = key;
+                g_hash_table_add(done, stored);
+                if (maep_source_manager_download_tile(priv->manager, priv->source,
+                                                      zoom, x, y, &priv->prefetch))
+                    n += 1;
+            }
+        }
+    }
+    return n;
+}
+
+/**
+ * osm_gps_map_prefetch_ahead:
+ * @map: a #OsmGpsMap object.
+ * @latitude: the GPS latitude, in degrees.
+ * @longitude: the GPS longitude, in degrees.
+ * @heading: the direction of travel, in degrees clockwise from
+ * north, or OSM_GPS_MAP_INVALID.
+ * @speed: the ground speed in m/s, or OSM_GPS_MAP_INVALID.
+ *
+ * When the map follows the GPS, download in the background the tiles
+ * ahead of the position, at the current zoom and one level out, so
+ * they are on disk before they enter the view. The cone gets longer
+ * with speed. Tiles of former cones not downloaded yet are dropped.
+ */
+void
+osm_gps_map_prefetch_ahead (OsmGpsMap *map, float latitude, float longitude,
+                            float heading, float speed)
+{
+    OsmGpsMapPrivate *priv;
+    GHashTable *done;
+    coord_t pos;
+    float distance;
+    guint n;
+
+    g_return_if_fail(OSM_IS_GPS_MAP(map));
+    priv = map->priv;
+
+    priv->prefetch.serial += 1;
+    if (priv->source && priv->map_auto_center && priv->map_auto_download &&
+        !isnan(heading) && !isnan(speed) && speed >= PREFETCH_MIN_SPEED) {
+        pos.rlat = deg2rad(latitude);
+        pos.rlon = deg2rad(longitude);
+        distance = CLAMP(speed * PREFETCH_HORIZON,
+                         PREFETCH_MIN_DISTANCE, PREFETCH_MAX_DISTANCE);
+
+        done = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+        n = _prefetch_cone(map, done, priv->map_zoom, &pos, heading,
+                           distance, PREFETCH_MAX_TILES);
+        /* One level out, the same tiles cover twice the distance. */
+        if (priv->map_zoom > priv->min_zoom)
+            n += _prefetch_cone(map, done, priv->map_zoom - 1, &pos, heading,
+                                2.f * distance, PREFETCH_MAX_TILES - n);
+        g_hash_table_destroy(done);
+        g_debug("Prefetch %d tiles ahead.", n);
+    }
+    maep_source_manager_cancel_requests(priv->manager, &priv->prefetch);
+}
+
 static void
 _on_track_changed (G_GNUC_UNUSED MaepGeodata *track_state,
                    G_GNUC_UNUSED GParamSpec *pspec, OsmGpsMap *map)
@@ -80,7 +80,6 @@ GType       osm_gps_map_get_type                    (void) G_GNUC_CONST;
 
 OsmGpsMap*  osm_gps_map_new                         (void);
 
-void        osm_gps_map_download_maps               (OsmGpsMap *map, coord_t *pt1, coord_t *pt2, int zoom_start, int zoom_end);
 void        osm_gps_map_get_bbox                    (OsmGpsMap *map, coord_t *pt1, coord_t *pt2);
 void        osm_gps_map_set_mapcenter               (OsmGpsMap *map, float latitude, float longitude, int zoom);
 void        osm_gps_map_set_center                  (OsmGpsMap *map, float latitude, float longitude);
@@ -91,6 +90,10 @@ void        osm_gps_map_set_factor                  (OsmGpsMap *map, gfloat fact
 gfloat      osm_gps_map_get_factor                  (OsmGpsMap *map);
 void        osm_gps_map_auto_center_at              (OsmGpsMap *map,
                                                      float latitude, float longitude);
+void        osm_gps_map_set_interacting             (OsmGpsMap *map, gboolean status);
+void        osm_gps_map_prefetch_ahead              (OsmGpsMap *map,
+                                                     float latitude, float longitude,
+                                                     float heading, float speed);
 
 void        osm_gps_map_adjust_to                   (OsmGpsMap *map, coord_t *top_left, coord_t *bottom_right);
 void        osm_gps_map_get_tile_xy_at              (OsmGpsMap *map,
@@ -118,6 +121,8 @@ cairo_surface_t* osm_gps_map_get_surface            (OsmGpsMap *map);
 void        osm_gps_map_set_viewport                (OsmGpsMap *map, guint width, guint height);
 void        osm_gps_map_blit                        (OsmGpsMap *map, cairo_t *cr,
                                                      cairo_operator_t op);
+gboolean    osm_gps_map_get_damage                  (OsmGpsMap *map,
+                                                     cairo_rectangle_int_t *area);
 
 #ifdef ENABLE_OSD
 coord_t *osm_gps_map_get_gps (OsmGpsMap *map);
@@ -0,0 +1,961 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * Copyright (C) 2017 Damien Caliste <dcaliste@free.fr>
+ *
+ * This file is part of Maep.
+ *
+ * Maep is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Maep is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Maep.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "region.h"
+
+#include "../converter.h"
+#include "osm-gps-map.h"
+
+#include <string.h>
+#include <math.h>
+#include <libsoup/soup.h>
+#include <glib/gstdio.h>
+
+/* Default throttling, tiles at once and tiles per second, to stay
+   within the usage policies of the tile servers. */
+#define REGION_CONCURRENCY  2
+#define REGION_RATE         2.f
+/* Size of a tile, until some have been downloaded. */
+#define REGION_TILE_BYTES   (16 * 1024)
+/* Tiles already on disk checked in one go. */
+#define REGION_CHECKS       64
+/* Progress is saved every this amount of tiles. */
+#define REGION_SAVE_PERIOD  64
+#define REGION_MAX_TILES    (1 << 24)
+/* Radius of the sphere of the web mercator projection, in metres. */
+#define REGION_EARTH_RADIUS 6378137.
+/* Distance between two samples of a track, in pixels. */
+#define REGION_TRACK_STEP   (TILESIZE / 4)
+#define REGION_GROUP        "Region"
+
+typedef struct {
+    MaepTileKey key;
+    guint index;
+} region_tile_t;
+
+struct _MaepRegionPrivate
+{
+    MaepSourceManager *manager;
+    gulong downloaded_id;
+    guint source_id;
+    GArray *areas;
+    GArray *offsets;       /* index of the first tile of each area */
+    guint n_tiles;
+    gchar *filename;
+
+    MaepRegionState state;
+    //tiles before next have been asked, apart from the ones to retry
+    guint next;
+    GHashTable *pending;   /* downloading region_tile_t, by tile key */
+    GArray *retry;         /* cancelled tile indexes */
+    guint done, failed, downloaded;
+    guint64 bytes;
+    guint unsaved;
+
+    //throttling
+    guint concurrency;
+    gfloat rate;
+    gint64 next_at;
+    guint pump_id;
+};
+
+enum
+  {
+    PROP_0,
+    STATE_PROP,
+    CONCURRENCY_PROP,
+    RATE_PROP,
+    N_PROP
+  };
+static GParamSpec *_properties[N_PROP];
+enum {
+    PROGRESS,
+    LAST_SIGNAL
+};
+static guint _signals[LAST_SIGNAL] = { 0 };
+
+G_DEFINE_TYPE(MaepRegion, maep_region, G_TYPE_OBJECT)
+
+static void maep_region_dispose(GObject *obj);
+static void maep_region_finalize(GObject *obj);
+static void maep_region_get_property(GObject* obj, guint property_id,
+                                     GValue *value, GParamSpec *pspec);
+static void maep_region_set_property(GObject* obj, guint property_id,
+                                     const GValue *value, GParamSpec *pspec);
+static void _tile_downloaded(MaepSourceManager *manager, MaepTileKey key,
+                             guint status, gulong size, MaepRegion *region);
+static void _set_state(MaepRegion *region, MaepRegionState state);
+
+static void maep_region_class_init(MaepRegionClass *klass)
+{
+  /* Connect the overloading methods. */
+  G_OBJECT_CLASS(klass)->dispose = maep_region_dispose;
+  G_OBJECT_CLASS(klass)->finalize = maep_region_finalize;
+  G_OBJECT_CLASS(klass)->get_property = maep_region_get_property;
+  G_OBJECT_CLASS(klass)->set_property = maep_region_set_property;
+
+  /**
+   * MaepRegion::state:
+   *
+   * Whether the region is downloading, paused or complete.
+   */
+  _properties[STATE_PROP] =
+    g_param_spec_uint("state", "State", "download state",
+                      MAEP_REGION_PAUSED, MAEP_REGION_DONE, MAEP_REGION_PAUSED,
+                      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  /**
+   * MaepRegion::concurrency:
+   *
+   * Maximum number of tiles downloading at once.
+   */
+  _properties[CONCURRENCY_PROP] =
+    g_param_spec_uint("concurrency", "Concurrency", "tiles downloading at once",
+                      1, G_MAXUINT, REGION_CONCURRENCY,
+                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  /**
+   * MaepRegion::rate:
+   *
+   * Maximum number of downloads started per second, 0 for no limit.
+   */
+  _properties[RATE_PROP] =
+    g_param_spec_float("rate", "Rate", "downloads started per second",
+                       0.f, G_MAXFLOAT, REGION_RATE,
+                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties(G_OBJECT_CLASS(klass), N_PROP, _properties);
+
+  /**
+   * MaepRegion::progress:
+   *
+   * Emitted when tiles of the region have been downloaded, or
+   * skipped because they were already on disk.
+   */
+  _signals[PROGRESS] =
+    g_signal_new("progress", G_TYPE_FROM_CLASS(klass),
+                 G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+                 0, NULL, NULL, NULL, G_TYPE_NONE, 0);
+
+  g_type_class_add_private(klass, sizeof(MaepRegionPrivate));
+}
+
+static void maep_region_init(MaepRegion *self)
+{
+  self->priv = G_TYPE_INSTANCE_GET_PRIVATE(self, MAEP_TYPE_REGION,
+                                           MaepRegionPrivate);
+  self->priv->manager = NULL;
+  self->priv->downloaded_id = 0;
+  self->priv->areas = g_array_new(FALSE, FALSE, sizeof(MaepTileArea));
+  self->priv->offsets = g_array_new(FALSE, FALSE, sizeof(guint));
+  self->priv->n_tiles = 0;
+  self->priv->filename = NULL;
+  self->priv->state = MAEP_REGION_PAUSED;
+  self->priv->next = 0;
+  self->priv->pending = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                              NULL, g_free);
+  self->priv->retry = g_array_new(FALSE, FALSE, sizeof(guint));
+  self->priv->concurrency = REGION_CONCURRENCY;
+  self->priv->rate = REGION_RATE;
+  self->priv->next_at = 0;
+  self->priv->pump_id = 0;
+}
+
+static void _protect(MaepRegion *region, gboolean status)
+{
+  MaepRegionPrivate *priv = region->priv;
+  const MaepSource *source;
+  guint i;
+
+  source = maep_source_manager_getById(priv->manager, priv->source_id);
+  if (!source)
+      return;
+
+  for (i = 0; i < priv->areas->len; i++)
+      if (status)
+          maep_source_manager_protect_area(priv->manager, source,
+                                           &g_array_index(priv->areas, MaepTileArea, i));
+      else
+          maep_source_manager_unprotect_area(priv->manager, source,
+                                             &g_array_index(priv->areas, MaepTileArea, i));
+}
+
+static void maep_region_dispose(GObject *obj)
+{
+  MaepRegion *self = MAEP_REGION(obj);
+  GError *error = NULL;
+
+  if (self->priv->manager) {
+      if (self->priv->pump_id)
+          g_source_remove(self->priv->pump_id);
+      self->priv->pump_id = 0;
+      /* Remember where to resume. */
+      if (self->priv->filename && self->priv->unsaved &&
+          !maep_region_save(self, &error)) {
+          g_warning("%s", error->message);
+          g_error_free(error);
+      }
+      g_signal_handler_disconnect(self->priv->manager, self->priv->downloaded_id);
+      _protect(self, FALSE);
+      g_object_unref(self->priv->manager);
+      self->priv->manager = NULL;
+  }
+
+  G_OBJECT_CLASS(maep_region_parent_class)->dispose(obj);
+}
+
+static void maep_region_finalize(GObject *obj)
+{
+  MaepRegion *self = MAEP_REGION(obj);
+
+  g_array_free(self->priv->areas, TRUE);
+  g_array_free(self->priv->offsets, TRUE);
+  g_free(self->priv->filename);
+  g_hash_table_destroy(self->priv->pending);
+  g_array_free(self->priv->retry, TRUE);
+
+  G_OBJECT_CLASS(maep_region_parent_class)->finalize(obj);
+}
+
+static void maep_region_get_property(GObject* obj, guint property_id,
+                                     GValue *value, GParamSpec *pspec)
+{
+  MaepRegion *self = MAEP_REGION(obj);
+
+  switch (property_id) {
+  case STATE_PROP:
+      g_value_set_uint(value, self->priv->state);
+      break;
+  case CONCURRENCY_PROP:
+      g_value_set_uint(value, self->priv->concurrency);
+      break;
+  case RATE_PROP:
+      g_value_set_float(value, self->priv->rate);
+      break;
+  default:
+      /* We don't have any other property... */
+      G_OBJECT_WARN_INVALID_PROPERTY_ID(obj, property_id, pspec);
+      break;
+  }
+}
+
+static void maep_region_set_property(GObject* obj, guint property_id,
+                                     const GValue *value, GParamSpec *pspec)
+{
+  MaepRegion *self = MAEP_REGION(obj);
+
+  switch (property_id) {
+  case CONCURRENCY_PROP:
+      maep_region_set_limits(self, g_value_get_uint(value), self->priv->rate);
+      break;
+  case RATE_PROP:
+      maep_region_set_limits(self, self->priv->concurrency, g_value_get_float(value));
+      break;
+  default:
+      /* We don't have any other property... */
+      G_OBJECT_WARN_INVALID_PROPERTY_ID(obj, property_id, pspec);
+      break;
+  }
+}
+
+static MaepRegion* _new(MaepSourceManager *manager, guint source_id,
+                        const MaepTileArea *areas, guint n_areas)
+{
+  MaepRegion *region;
+  guint64 n_tiles;
+  guint i, offset;
+
+  n_tiles = 0;
+  for (i = 0; i < n_areas; i++) {
+      g_return_val_if_fail(areas[i].x1 >= areas[i].x0 &&
+                           areas[i].y1 >= areas[i].y0, NULL);
+      n_tiles += (guint64)(areas[i].x1 - areas[i].x0 + 1) *
+          (guint64)(areas[i].y1 - areas[i].y0 + 1);
+  }
+  if (n_tiles > REGION_MAX_TILES) {
+      g_warning("region of %" G_GUINT64_FORMAT " tiles is too large.", n_tiles);
+      return NULL;
+  }
+
+  region = MAEP_REGION(g_object_new(MAEP_TYPE_REGION, NULL));
+  region->priv->manager = g_object_ref(manager);
+  region->priv->source_id = source_id;
+  g_array_append_vals(region->priv->areas, areas, n_areas);
+  for (i = 0, offset = 0; i < n_areas; i++) {
+      g_array_append_val(region->priv->offsets, offset);
+      offset += (areas[i].x1 - areas[i].x0 + 1) * (areas[i].y1 - areas[i].y0 + 1);
+  }
+  region->priv->n_tiles = n_tiles;
+  region->priv->downloaded_id =
+      g_signal_connect(G_OBJECT(manager), "tile-downloaded",
+                       G_CALLBACK(_tile_downloaded), region);
+  _protect(region, TRUE);
+
+  return region;
+}
+
+/**
+ * maep_region_new:
+ * @manager: a #MaepSourceManager object.
+ * @source: the source to download tiles from.
+ * @areas: (array length=n_areas): the tiles of the region.
+ * @n_areas: number of areas.
+ *
+ * Create a paused download job for the tiles of @areas, in order.
+ *
+ * Returns: a new #MaepRegion, or NULL if the region is too large.
+ */
+MaepRegion* maep_region_new(MaepSourceManager *manager,
+                            const MaepSource *source,
+                            const MaepTileArea *areas, guint n_areas)
+{
+  g_return_val_if_fail(MAEP_IS_SOURCE_MANAGER(manager), NULL);
+  g_return_val_if_fail(source, NULL);
+  g_return_val_if_fail(areas || !n_areas, NULL);
+
+  return _new(manager, maep_source_get_id(source), areas, n_areas);
+}
+
+/**
+ * maep_region_new_for_bbox:
+ * @manager: a #MaepSourceManager object.
+ * @source: the source to download tiles from.
+ * @lat1: latitude of a corner, in degrees.
+ * @lon1: longitude of a corner, in degrees.
+ * @lat2: latitude of the opposite corner, in degrees.
+ * @lon2: longitude of the opposite corner, in degrees.
+ * @zoom_start: the first zoom level.
+ * @zoom_end: the last zoom level.
+ *
+ * Create a paused download job for the tiles covering a box at all
+ * zoom levels from @zoom_start to @zoom_end, within the ones of
+ * @source.
+ *
+ * Returns: a new #MaepRegion, or NULL if the region is too large.
+ */
+MaepRegion* maep_region_new_for_bbox(MaepSourceManager *manager,
+                                     const MaepSource *source,
+                                     gfloat lat1, gfloat lon1,
+                                     gfloat lat2, gfloat lon2,
+                                     int zoom_start, int zoom_end)
+{
+  MaepRegion *region;
+  GArray *areas;
+  MaepTileArea area;
+  int zoom, max;
+
+  g_return_val_if_fail(source, NULL);
+
+  zoom_start = MAX(zoom_start, maep_source_get_min_zoom(source));
+  zoom_end = MIN(zoom_end, maep_source_get_max_zoom(source));
+  areas = g_array_new(FALSE, FALSE, sizeof(MaepTileArea));
+  for (zoom = zoom_start; zoom <= zoom_end; zoom++) {
+      max = (1 << zoom) - 1;
+      area.zoom = zoom;
+      area.x0 = lon2pixel(zoom, deg2rad(MIN(lon1, lon2))) / TILESIZE;
+      area.x1 = lon2pixel(zoom, deg2rad(MAX(lon1, lon2))) / TILESIZE;
+      area.y0 = lat2pixel(zoom, deg2rad(MAX(lat1, lat2))) / TILESIZE;
+      area.y1 = lat2pixel(zoom, deg2rad(MIN(lat1, lat2))) / TILESIZE;
+      area.x0 = CLAMP(area.x0, 0, max);
+      area.x1 = CLAMP(area.x1, 0, max);
+      area.y0 = CLAMP(area.y0, 0, max);
+      area.y1 = CLAMP(area.y1, 0, max);
+      g_array_append_val(areas, area);
+  }
+  region = maep_region_new(manager, source,
+                           (const MaepTileArea*)areas->data, areas->len);
+  g_array_free(areas, TRUE);
+
+  return region;
+}
+
+/* Add the tiles crossing the disc of radius r around px, py, as
+   y << 32 | x, duplicates included. */
+static void _add_disc(GArray *tiles, int zoom, gfloat px, gfloat py, gfloat r)
+{
+  int max, x0, x1, y0, y1, x, y;
+  gfloat dx, dy;
+  guint64 tile;
+
+  max = (1 << zoom) - 1;
+  x0 = CLAMP((int)floorf((px - r) / TILESIZE), 0, max);
+  x1 = CLAMP((int)floorf((px + r) / TILESIZE), 0, max);
+  y0 = CLAMP((int)floorf((py - r) / TILESIZE), 0, max);
+  y1 = CLAMP((int)floorf((py + r) / TILESIZE), 0, max);
+  for (y = y0; y <= y1; y++)
+      for (x = x0; x <= x1; x++) {
+          /* Distance to the closest point of the tile. */
+          dx = px - CLAMP(px, x * TILESIZE, (x + 1) * TILESIZE);
+          dy = py - CLAMP(py, y * TILESIZE, (y + 1) * TILESIZE);
+          if (dx * dx + dy * dy > r * r)
+              continue;
+          tile = ((guint64)y << 32) | (guint64)x;
+          g_array_append_val(tiles, tile);
+      }
+}
+
+/* Radius in pixels at zoom of width metres, at latitude lat. */
+static gfloat _buffer_radius(int zoom, gfloat lat, gfloat width)
+{
+  return width * TILESIZE * (gfloat)(1 << zoom) /
+      (2. * G_PI * REGION_EARTH_RADIUS * MAX(cos(lat), 1e-3));
+}
+
+static gint _compare_tiles(gconstpointer a, gconstpointer b)
+{
+  guint64 ta = *(const guint64*)a, tb = *(const guint64*)b;
+
+  return (ta < tb) ? -1 : (ta > tb);
+}
+
+/* Append to areas the tiles at zoom within width of the track, as
+   runs of tiles along rows. */
+static void _add_corridor(GArray *areas, MaepGeodata *track, gfloat width, int zoom)
+{
+  MaepGeodataTrackIter iter;
+  GArray *tiles;
+  MaepTileArea area;
+  coord_t prev;
+  gfloat x0, y0, x1, y1, len, r;
+  guint64 tile;
+  guint i, n, j;
+  int st;
+
+  tiles = g_array_new(FALSE, FALSE, sizeof(guint64));
+  /* The track is sampled along its segments, the discs around
+     samples are enlarged to cover the parts in between. */
+  prev.rlat = prev.rlon = 0.f;
+  maep_geodata_track_iter_new(&iter, track);
+  while (maep_geodata_track_iter_next(&iter, &st)) {
+      x1 = lon2pixel(zoom, iter.cur->coord.rlon);
+      y1 = lat2pixel(zoom, iter.cur->coord.rlat);
+      r = _buffer_radius(zoom, iter.cur->coord.rlat, width) + REGION_TRACK_STEP / 2;
+      if (st & TRACK_POINT_START) {
+          _add_disc(tiles, zoom, x1, y1, r);
+      } else {
+          x0 = lon2pixel(zoom, prev.rlon);
+          y0 = lat2pixel(zoom, prev.rlat);
+          len = sqrtf((x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0));
+          n = (guint)ceilf(len / REGION_TRACK_STEP);
+          for (i = 1; i <= n; i++)
+              _add_disc(tiles, zoom, x0 + (x1 - x0) * i / n,
+                        y0 + (y1 - y0) * i / n, r);
+      }
+      prev = iter.cur->coord;
+  }
+
+  g_array_sort(tiles, _compare_tiles);
+  area.zoom = zoom;
+  for (i = 0; i < tiles->len; i = j) {
+      tile = g_array_index(tiles, guint64, i);
+      area.y0 = area.y1 = (int)(tile >> 32);
+      area.x0 = area.x1 = (int)(tile & 0xffffffff);
+      for (j = i + 1; j < tiles->len; j++) {
+          tile = g_array_index(tiles, guint64, j);
+          if ((int)(tile >> 32) != area.y0)
+              break;
+          if ((int)(tile & 0xffffffff) > area.x1 + 1)
+              break;
+          area.x1 = (int)(tile & 0xffffffff);
+      }
+      g_array_append_val(areas, area);
+  }
+  g_array_free(tiles, TRUE);
+}
+
+/**
+ * maep_region_new_for_track:
+ * @manager: a #MaepSourceManager object.
+ * @source: the source to download tiles from.
+ * @track: a #MaepGeodata object.
+ * @width: the distance to the track to cover, in metres.
+ * @zoom_start: the first zoom level.
+ * @zoom_end: the last zoom level.
+ *
+ * Create a paused download job for the tiles within @width of the
+ * points of @track, at all zoom levels from @zoom_start to
+ * @zoom_end, within the ones of @source.
+ *
+ * Returns: a new #MaepRegion, or NULL if the region is too large.
+ */
+MaepRegion* maep_region_new_for_track(MaepSourceManager *manager,
+                                      const MaepSource *source,
+                                      MaepGeodata *track, gfloat width,
+                                      int zoom_start, int zoom_end)
+{
+  MaepRegion *region;
+  GArray *areas;
+  int zoom;
+
+  g_return_val_if_fail(source, NULL);
+  g_return_val_if_fail(MAEP_IS_GEODATA(track), NULL);
+  g_return_val_if_fail(width >= 0.f, NULL);
+
+  zoom_start = MAX(zoom_start, maep_source_get_min_zoom(source));
+  zoom_end = MIN(zoom_end, maep_source_get_max_zoom(source));
+  areas = g_array_new(FALSE, FALSE, sizeof(MaepTileArea));
+  for (zoom = zoom_start; zoom <= zoom_end; zoom++)
+      _add_corridor(areas, track, width, zoom);
+  region = maep_region_new(manager, source,
+                           (const MaepTileArea*)areas->data, areas->len);
+  g_array_free(areas, TRUE);
+
+  return region;
+}
+
+/**
+ * maep_region_load:
+ * @manager: a #MaepSourceManager object.
+ * @filename: a file written by maep_region_save().
+ * @error: (allow-none): a location for an error.
+ *
+ * Read back a region and its progress. A region that was running
+ * when saved resumes its download.
+ *
+ * Returns: a new #MaepRegion, saved in @filename, or NULL on error.
+ */
+MaepRegion* maep_region_load(MaepSourceManager *manager,
+                             const gchar *filename, GError **error)
+{
+  MaepRegion *region;
+  GKeyFile *file;
+  gint *values;
+  gsize ln;
+  guint source_id, state, next;
+  GError *err = NULL;
+
+  g_return_val_if_fail(MAEP_IS_SOURCE_MANAGER(manager), NULL);
+  g_return_val_if_fail(filename, NULL);
+
+  file = g_key_file_new();
+  if (!g_key_file_load_from_file(file, filename, G_KEY_FILE_NONE, error)) {
+      g_key_file_free(file);
+      return NULL;
+  }
+
+  values = NULL;
+  source_id = g_key_file_get_integer(file, REGION_GROUP, "source", &err);
+  if (!err)
+      values = g_key_file_get_integer_list(file, REGION_GROUP, "areas", &ln, &err);
+  if (!err && ln % (sizeof(MaepTileArea) / sizeof(gint)))
+      g_set_error(&err, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                  "wrong number of values for areas in '%s'.", filename);
+  if (err) {
+      g_propagate_error(error, err);
+      g_free(values);
+      g_key_file_free(file);
+      return NULL;
+  }
+
+  region = _new(manager, source_id, (const MaepTileArea*)values,
+                ln / (sizeof(MaepTileArea) / sizeof(gint)));
+  g_free(values);
+  if (!region) {
+      g_key_file_free(file);
+      return NULL;
+  }
+  region->priv->filename = g_strdup(filename);
+
+  /* Tiles before next have all been done or have failed. */
+  state = g_key_file_get_integer(file, REGION_GROUP, "state", NULL);
+  next = MIN((guint)g_key_file_get_integer(file, REGION_GROUP, "next", NULL),
+             region->priv->n_tiles);
+  region->priv->next = next;
+  region->priv->failed = MIN((guint)g_key_file_get_integer(file, REGION_GROUP,
+                                                           "failed", NULL), next);
+  region->priv->done = next - region->priv->failed;
+  region->priv->downloaded = g_key_file_get_integer(file, REGION_GROUP,
+                                                    "downloaded", NULL);
+  region->priv->bytes = g_key_file_get_uint64(file, REGION_GROUP, "bytes", NULL);
+  if (g_key_file_has_key(file, REGION_GROUP, "concurrency", NULL))
+      region->priv->concurrency =
+          MAX(g_key_file_get_integer(file, REGION_GROUP, "concurrency", NULL), 1);
+  if (g_key_file_has_key(file, REGION_GROUP, "rate", NULL))
+      region->priv->rate =
+          MAX(g_key_file_get_double(file, REGION_GROUP, "rate", NULL), 0.);
+  g_key_file_free(file);
+
+  if (next == region->priv->n_tiles)
+      region->priv->state = MAEP_REGION_DONE;
+  else if (state == MAEP_REGION_RUNNING)
+      maep_region_start(region);
+
+  return region;
+}
+
+void maep_region_set_filename(MaepRegion *region, const gchar *filename)
+{
+  g_return_if_fail(MAEP_IS_REGION(region));
+
+  g_free(region->priv->filename);
+  region->priv->filename = g_strdup(filename);
+}
+
+const gchar* maep_region_get_filename(const MaepRegion *region)
+{
+  g_return_val_if_fail(MAEP_IS_REGION(region), NULL);
+
+  return region->priv->filename;
+}
+
+/* Tiles are done in order, apart from the downloading ones and the
+   ones to retry, the download resumes from the first of them. */
+static guint _resume_index(const MaepRegionPrivate *priv)
+{
+  GHashTableIter iter;
+  region_tile_t *tile;
+  guint i, index;
+
+  index = priv->next;
+  for (i = 0; i < priv->retry->len; i++)
+      index = MIN(index, g_array_index(priv->retry, guint, i));
+  g_hash_table_iter_init(&iter, priv->pending);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&tile))
+      index = MIN(index, tile->index);
+  return index;
+}
+
+/**
+ * maep_region_save:
+ * @region: a #MaepRegion object.
+ * @error: (allow-none): a location for an error.
+ *
+ * Write the region and its progress into its file, see
+ * maep_region_set_filename().
+ *
+ * Returns: TRUE on success.
+ */
+gboolean maep_region_save(MaepRegion *region, GError **error)
+{
+  MaepRegionPrivate *priv;
+  GKeyFile *file;
+  gchar *data, *dirname;
+  gsize len;
+  guint resume, failed;
+  gboolean ret;
+
+  g_return_val_if_fail(MAEP_IS_REGION(region), FALSE);
+  g_return_val_if_fail(region->priv->filename, FALSE);
+
+  priv = region->priv;
+  resume = _resume_index(priv);
+  /* Failures after the resume point will be counted again. */
+  failed = MIN(priv->failed, resume);
+
+  file = g_key_file_new();
+  g_key_file_set_integer(file, REGION_GROUP, "source", priv->source_id);
+  g_key_file_set_integer_list(file, REGION_GROUP, "areas", (gint*)priv->areas->data,
+                              priv->areas->len * (sizeof(MaepTileArea) / sizeof(gint)));
+  g_key_file_set_integer(file, REGION_GROUP, "state", priv->state);
+  g_key_file_set_integer(file, REGION_GROUP, "next", resume);
+  g_key_file_set_integer(file, REGION_GROUP, "failed", failed);
+  g_key_file_set_integer(file, REGION_GROUP, "downloaded", priv->downloaded);
+  g_key_file_set_uint64(file, REGION_GROUP, "bytes", priv->bytes);
+  g_key_file_set_integer(file, REGION_GROUP, "concurrency", priv->concurrency);
+  g_key_file_set_double(file, REGION_GROUP, "rate", priv->rate);
+  data = g_key_file_to_data(file, &len, NULL);
+  g_key_file_free(file);
+
+  dirname = g_path_get_dirname(priv->filename);
+  g_mkdir_with_parents(dirname, 0700);
+  g_free(dirname);
+  ret = g_file_set_contents(priv->filename, data, len, error);
+  g_free(data);
+
+  if (ret)
+      priv->unsaved = 0;
+  return ret;
+}
+
+guint maep_region_get_source_id(const MaepRegion *region)
+{
+  g_return_val_if_fail(MAEP_IS_REGION(region), 0);
+
+  return region->priv->source_id;
+}
+
+guint maep_region_get_n_tiles(const MaepRegion *region)
+{
+  g_return_val_if_fail(MAEP_IS_REGION(region), 0);
+
+  return region->priv->n_tiles;
+}
+
+/* Bytes to download for the whole region, based on the size of the
+   tiles received so far. Tiles already on disk are counted. */
+guint64 maep_region_estimate_bytes(const MaepRegion *region)
+{
+  const MaepRegionPrivate *priv;
+
+  g_return_val_if_fail(MAEP_IS_REGION(region), 0);
+
+  priv = region->priv;
+  if (!priv->downloaded)
+      return (guint64)priv->n_tiles * REGION_TILE_BYTES;
+  return (guint64)priv->n_tiles * (priv->bytes / priv->downloaded);
+}
+
+void maep_region_get_progress(const MaepRegion *region,
+                              guint *done, guint *failed, guint64 *bytes)
+{
+  g_return_if_fail(MAEP_IS_REGION(region));
+
+  if (done)
+      *done = region->priv->done;
+  if (failed)
+      *failed = region->priv->failed;
+  if (bytes)
+      *bytes = region->priv->bytes;
+}
+
+MaepRegionState maep_region_get_state(const MaepRegion *region)
+{
+  g_return_val_if_fail(MAEP_IS_REGION(region), MAEP_REGION_PAUSED);
+
+  return region->priv->state;
+}
+
+/* The tile at index, areas are walked row by row. */
+static void _tile_at(const MaepRegionPrivate *priv, guint index,
+                     int *zoom, int *x, int *y)
+{
+  const MaepTileArea *area;
+  guint lo, hi, mid, width;
+
+  lo = 0;
+  hi = priv->offsets->len - 1;
+  while (lo < hi) {
+      mid = (lo + hi + 1) / 2;
+      if (g_array_index(priv->offsets, guint, mid) <= index)
+          lo = mid;
+      else
+          hi = mid - 1;
+  }
+  area = &g_array_index(priv->areas, MaepTileArea, lo);
+  index -= g_array_index(priv->offsets, guint, lo);
+  width = area->x1 - area->x0 + 1;
+  *zoom = area->zoom;
+  *x = area->x0 + index % width;
+  *y = area->y0 + index / width;
+}
+
+static gboolean _pump(gpointer data);
+
+static void _schedule(MaepRegion *region, guint delay)
+{
+  if (region->priv->pump_id || region->priv->state != MAEP_REGION_RUNNING)
+      return;
+  region->priv->pump_id = delay ? g_timeout_add(delay, _pump, region) :
+      g_idle_add(_pump, region);
+}
+
+static void _progress(MaepRegion *region, guint n)
+{
+  GError *error = NULL;
+
+  region->priv->unsaved += n;
+  if (region->priv->filename && region->priv->unsaved >= REGION_SAVE_PERIOD &&
+      !maep_region_save(region, &error)) {
+      g_warning("%s", error->message);
+      g_error_free(error);
+  }
+  g_signal_emit(G_OBJECT(region), _signals[PROGRESS], 0);
+}
+
+static gboolean _next_index(MaepRegionPrivate *priv, guint *index)
+{
+  if (priv->retry->len) {
+      *index = g_array_index(priv->retry, guint, priv->retry->len - 1);
+      g_array_set_size(priv->retry, priv->retry->len - 1);
+      return TRUE;
+  }
+  if (priv->next < priv->n_tiles) {
+      *index = priv->next++;
+      return TRUE;
+  }
+  return FALSE;
+}
+
+/* Ask for the next tiles, within the limits. Tiles already on disk
+   are skipped, by batches so as not to block the main loop. */
+static gboolean _pump(gpointer data)
+{
+  MaepRegion *region = MAEP_REGION(data);
+  MaepRegionPrivate *priv = region->priv;
+  const MaepSource *source;
+  MaepTileRequest request;
+  region_tile_t *tile;
+  MaepTileKey key;
+  gint64 now;
+  guint index, checked;
+  int zoom, x, y;
+
+  priv->pump_id = 0;
+  if (priv->state != MAEP_REGION_RUNNING)
+      return FALSE;
+
+  source = maep_source_manager_getById(priv->manager, priv->source_id);
+  if (!source) {
+      g_warning("source %d of region is not available.", priv->source_id);
+      _set_state(region, MAEP_REGION_PAUSED);
+      return FALSE;
+  }
+
+  request.owner = region;
+  request.serial = 0;
+  request.priority = MAEP_TILE_PRIORITY_BACKGROUND;
+  checked = 0;
+  while (g_hash_table_size(priv->pending) < priv->concurrency) {
+      now = g_get_monotonic_time();
+      if (priv->rate > 0.f && now < priv->next_at) {
+          _schedule(region, (priv->next_at - now) / 1000 + 1);
+          break;
+      }
+      if (!_next_index(priv, &index))
+          break;
+
+      _tile_at(priv, index, &zoom, &x, &y);
+      key = MAEP_TILE_KEY(priv->source_id, zoom, x, y);
+      /* Areas may overlap. */
+      if (g_hash_table_contains(priv->pending, &key))
+          priv->done += 1;
+      else if (maep_source_manager_download_tile(priv->manager, source,
+                                                 zoom, x, y, &request)) {
+          tile = g_new(region_tile_t, 1);
+          tile->key = key;
+          tile->index = index;
+          g_hash_table_insert(priv->pending, &tile->key, tile);
+          if (priv->rate > 0.f)
+              priv->next_at = MAX(now, priv->next_at) + G_USEC_PER_SEC / priv->rate;
+      } else {
+          priv->done += 1;
+          if (++checked == REGION_CHECKS) {
+              _schedule(region, 0);
+              break;
+          }
+      }
+  }
+  if (checked)
+      _progress(region, checked);
+
+  if (!g_hash_table_size(priv->pending) && !priv->retry->len &&
+      priv->next == priv->n_tiles)
+      _set_state(region, MAEP_REGION_DONE);
+
+  return FALSE;
+}
+
+static void _tile_downloaded(MaepSourceManager *manager G_GNUC_UNUSED,
+                             MaepTileKey key, guint status, gulong size,
+                             MaepRegion *region)
+{
+  MaepRegionPrivate *priv = region->priv;
+  region_tile_t *tile;
+
+  tile = g_hash_table_lookup(priv->pending, &key);
+  if (!tile)
+      return;
+
+  if (status == SOUP_STATUS_CANCELLED)
+      /* Taken over by a map and dropped, ask again. */
+      g_array_append_val(priv->retry, tile->index);
+  else if (SOUP_STATUS_IS_SUCCESSFUL(status) ||
+           status == SOUP_STATUS_NOT_MODIFIED ||
+           status == SOUP_STATUS_NOT_FOUND) {
+      priv->done += 1;
+      if (size) {
+          priv->downloaded += 1;
+          priv->bytes += size;
+      }
+  } else
+      priv->failed += 1;
+  g_hash_table_remove(priv->pending, &key);
+
+  if (status != SOUP_STATUS_CANCELLED)
+      _progress(region, 1);
+  _schedule(region, 0);
+}
+
+static void _set_state(MaepRegion *region, MaepRegionState state)
+{
+  GError *error = NULL;
+
+  if (region->priv->state == state)
+      return;
+
+  region->priv->state = state;
+  if (region->priv->filename && !maep_region_save(region, &error)) {
+      g_warning("%s", error->message);
+      g_error_free(error);
+  }
+  g_object_notify_by_pspec(G_OBJECT(region), _properties[STATE_PROP]);
+}
+
+/**
+ * maep_region_set_limits:
+ * @region: a #MaepRegion object.
+ * @concurrency: maximum number of tiles downloading at once.
+ * @rate: maximum number of downloads started per second, 0 for no
+ * limit.
+ *
+ * Throttle the download of the region.
+ */
+void maep_region_set_limits(MaepRegion *region, guint concurrency, gfloat rate)
+{
+  g_return_if_fail(MAEP_IS_REGION(region));
+  g_return_if_fail(concurrency > 0 && rate >= 0.f);
+
+  if (region->priv->concurrency != concurrency) {
+      region->priv->concurrency = concurrency;
+      g_object_notify_by_pspec(G_OBJECT(region), _properties[CONCURRENCY_PROP]);
+  }
+  if (region->priv->rate != rate) {
+      region->priv->rate = rate;
+      region->priv->next_at = 0;
+      g_object_notify_by_pspec(G_OBJECT(region), _properties[RATE_PROP]);
+  }
+  _schedule(region, 0);
+}
+
+/* Start or resume the download, tiles already on disk and up to date
+   are not downloaded again. */
+void maep_region_start(MaepRegion *region)
+{
+  g_return_if_fail(MAEP_IS_REGION(region));
+
+  if (region->priv->state != MAEP_REGION_PAUSED)
+      return;
+
+  _set_state(region, MAEP_REGION_RUNNING);
+  _schedule(region, 0);
+}
+
+/* Stop asking for new tiles, the ones downloading complete anyway. */
+void maep_region_pause(MaepRegion *region)
+{
+  g_return_if_fail(MAEP_IS_REGION(region));
+
+  if (region->priv->state != MAEP_REGION_RUNNING)
+      return;
+
+  if (region->priv->pump_id)
+      g_source_remove(region->priv->pump_id);
+  region->priv->pump_id = 0;
+  _set_state(region, MAEP_REGION_PAUSED);
+}
@@ -0,0 +1,107 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * Copyright (C) 2017 Damien Caliste <dcaliste@free.fr>
+ *
+ * This file is part of Maep.
+ *
+ * Maep is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Maep is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Maep.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef REGION_H
+#define REGION_H
+
+#include <glib-object.h>
+
+#include "source.h"
+#include "../track.h"
+
+G_BEGIN_DECLS
+
+typedef enum {
+    MAEP_REGION_PAUSED,
+    MAEP_REGION_RUNNING,
+    MAEP_REGION_DONE
+} MaepRegionState;
+
+#define MAEP_TYPE_REGION	     (maep_region_get_type ())
+#define MAEP_REGION(obj)	     (G_TYPE_CHECK_INSTANCE_CAST(obj, MAEP_TYPE_REGION, MaepRegion))
+#define MAEP_REGION_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST(klass, MAEP_TYPE_REGION, MaepRegionClass))
+#define MAEP_IS_REGION(obj)    (G_TYPE_CHECK_INSTANCE_TYPE(obj, MAEP_TYPE_REGION))
+#define MAEP_IS_REGION_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE(klass, MAEP_TYPE_REGION))
+#define MAEP_REGION_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS(obj, MAEP_TYPE_REGION, MaepRegionClass))
+
+typedef struct _MaepRegion        MaepRegion;
+typedef struct _MaepRegionPrivate MaepRegionPrivate;
+typedef struct _MaepRegionClass   MaepRegionClass;
+
+/* A set of tiles of a source downloaded for offline use. The
+   download runs in the background, with a bounded number of tiles
+   at once and a bounded rate. Its progress can be saved and
+   resumed. The tiles of the region are protected from cache
+   eviction as long as the region exists. */
+struct _MaepRegion
+{
+  GObject parent;
+
+  MaepRegionPrivate *priv;
+};
+
+struct _MaepRegionClass
+{
+  GObjectClass parent;
+};
+
+GType maep_region_get_type(void);
+
+MaepRegion*     maep_region_new            (MaepSourceManager *manager,
+                                            const MaepSource *source,
+                                            const MaepTileArea *areas,
+                                            guint n_areas);
+MaepRegion*     maep_region_new_for_bbox   (MaepSourceManager *manager,
+                                            const MaepSource *source,
+                                            gfloat lat1, gfloat lon1,
+                                            gfloat lat2, gfloat lon2,
+                                            int zoom_start, int zoom_end);
+MaepRegion*     maep_region_new_for_track  (MaepSourceManager *manager,
+                                            const MaepSource *source,
+                                            MaepGeodata *track, gfloat width,
+                                            int zoom_start, int zoom_end);
+MaepRegion*     maep_region_load           (MaepSourceManager *manager,
+                                            const gchar *filename,
+                                            GError **error);
+
+void            maep_region_set_filename   (MaepRegion *region,
+                                            const gchar *filename);
+const gchar*    maep_region_get_filename   (const MaepRegion *region);
+gboolean        maep_region_save           (MaepRegion *region,
+                                            GError **error);
+
+guint           maep_region_get_source_id  (const MaepRegion *region);
+guint           maep_region_get_n_tiles    (const MaepRegion *region);
+guint64         maep_region_estimate_bytes (const MaepRegion *region);
+void            maep_region_get_progress   (const MaepRegion *region,
+                                            guint *done, guint *failed,
+                                            guint64 *bytes);
+MaepRegionState maep_region_get_state      (const MaepRegion *region);
+
+void            maep_region_set_limits     (MaepRegion *region,
+                                            guint concurrency,
+                                            gfloat rate);
+void            maep_region_start          (MaepRegion *region);
+void            maep_region_pause          (MaepRegion *region);
+
+G_END_DECLS
+
+#endif
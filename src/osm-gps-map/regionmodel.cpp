@@ -0,0 +1,335 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * Copyright (C) 2017 Damien Caliste <dcaliste@free.fr>
+ *
+ * This file is part of Maep.
+ *
+ * Maep is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Maep is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Maep.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "regionmodel.h"
+
+#include <glib/gstdio.h>
+
+#define REGION_SUFFIX ".region"
+
+Maep::RegionModel::RegionModel(QObject *parent)
+: QAbstractListModel(parent), manager(maep_source_manager_get_instance())
+{
+    GDir *dir;
+    const gchar *name;
+    
+    roles.insert(SourceId, "sourceId");
+    roles.insert(Label, "label");
+    roles.insert(State, "state");
+    roles.insert(TileCount, "tileCount");
+    roles.insert(EstimatedBytes, "estimatedBytes");
+    roles.insert(Done, "done");
+    roles.insert(Failed, "failed");
+    roles.insert(Bytes, "bytes");
+    roles.insert(Progress, "progress");
+
+    // Regions protect their tiles from eviction and resume their
+    // download, so they are all loaded on startup.
+    path = g_build_filename(g_get_user_cache_dir(), ORG, APP, "regions", NULL);
+    dir = g_dir_open(path, 0, NULL);
+    if (!dir)
+        return;
+    while ((name = g_dir_read_name(dir))) {
+        GError *error = NULL;
+        gchar *filename;
+        MaepRegion *region;
+
+        if (!g_str_has_suffix(name, REGION_SUFFIX))
+            continue;
+        filename = g_build_filename(path, name, NULL);
+        region = maep_region_load(manager, filename, &error);
+        if (region)
+            append(region);
+        else {
+            g_warning("cannot load region %s: %s", filename,
+                      error ? error->message : "invalid region");
+            if (error)
+                g_error_free(error);
+        }
+        g_free(filename);
+    }
+    g_dir_close(dir);
+}
+
+Maep::RegionModel::~RegionModel()
+{
+    for (int i = 0; i < regions.count(); i++) {
+        g_signal_handlers_disconnect_by_data(G_OBJECT(regions.at(i)), this);
+        // Progress is saved on dispose.
+        g_object_unref(G_OBJECT(regions.at(i)));
+    }
+    g_free(path);
+}
+
+void Maep::RegionModel::append(MaepRegion *region)
+{
+    g_signal_connect(G_OBJECT(region), "progress",
+                     G_CALLBACK(onProgress), this);
+    g_signal_connect(G_OBJECT(region), "notify::state",
+                     G_CALLBACK(onState), this);
+
+    beginInsertRows(QModelIndex(), regions.count(), regions.count());
+    regions.append(region);
+    endInsertRows();
+    emit progressChanged();
+}
+
+void Maep::RegionModel::onProgress(MaepRegion *region, Maep::RegionModel *model)
+{
+    int row = model->regions.indexOf(region);
+    if (row < 0)
+        return;
+
+    QModelIndex index = model->index(row);
+    emit model->dataChanged(index, index, QVector<int>()
+                            << int(Maep::RegionModel::Done)
+                            << int(Maep::RegionModel::Failed)
+                            << int(Maep::RegionModel::Bytes)
+                            << int(Maep::RegionModel::EstimatedBytes)
+                            << int(Maep::RegionModel::Progress));
+    emit model->progressChanged();
+}
+
+void Maep::RegionModel::onState(MaepRegion *region, GParamSpec *pspec,
+                                Maep::RegionModel *model)
+{
+    Q_UNUSED(pspec);
+
+    int row = model->regions.indexOf(region);
+    if (row < 0)
+        return;
+
+    QModelIndex index = model->index(row);
+    emit model->dataChanged(index, index, QVector<int>()
+                            << int(Maep::RegionModel::State));
+    emit model->progressChanged();
+}
+
+QHash<int, QByteArray> Maep::RegionModel::roleNames() const
+{
+    return roles;
+}
+
+int Maep::RegionModel::tileCount() const
+{
+    int count = 0;
+
+    for (int i = 0; i < regions.count(); i++)
+        count += maep_region_get_n_tiles(regions.at(i));
+    return count;
+}
+
+int Maep::RegionModel::doneCount() const
+{
+    int count = 0;
+
+    for (int i = 0; i < regions.count(); i++) {
+        guint done, failed;
+        maep_region_get_progress(regions.at(i), &done, &failed, NULL);
+        count += done + failed;
+    }
+    return count;
+}
+
+bool Maep::RegionModel::running() const
+{
+    for (int i = 0; i < regions.count(); i++)
+        if (maep_region_get_state(regions.at(i)) == MAEP_REGION_RUNNING)
+            return true;
+    return false;
+}
+
+QVariantMap Maep::RegionModel::estimate(MaepRegion *region) const
+{
+    QVariantMap result;
+
+    if (!region)
+        return result;
+
+    result.insert("tileCount", maep_region_get_n_tiles(region));
+    result.insert("estimatedBytes", qreal(maep_region_estimate_bytes(region)));
+    g_object_unref(G_OBJECT(region));
+    return result;
+}
+
+QVariantMap Maep::RegionModel::estimate(int source, const QGeoCoordinate &corner1,
+                                        const QGeoCoordinate &corner2,
+                                        int zoomStart, int zoomEnd) const
+{
+    const MaepSource *src;
+
+    src = maep_source_manager_getById(manager, guint(source));
+    if (!src)
+        return QVariantMap();
+    return estimate(maep_region_new_for_bbox(manager, src,
+                                             corner1.latitude(), corner1.longitude(),
+                                             corner2.latitude(), corner2.longitude(),
+                                             zoomStart, zoomEnd));
+}
+
+QVariantMap Maep::RegionModel::estimateTrack(int source, Maep::Track *track,
+                                             qreal width, int zoomStart, int zoomEnd) const
+{
+    const MaepSource *src;
+
+    src = maep_source_manager_getById(manager, guint(source));
+    if (!src || !track)
+        return QVariantMap();
+    return estimate(maep_region_new_for_track(manager, src, track->get(), width,
+                                              zoomStart, zoomEnd));
+}
+
+int Maep::RegionModel::add(MaepRegion *region)
+{
+    gchar *name, *filename;
+
+    if (!region)
+        return -1;
+
+    name = g_strdup_printf("%" G_GINT64_FORMAT REGION_SUFFIX, g_get_real_time());
+    filename = g_build_filename(path, name, NULL);
+    maep_region_set_filename(region, filename);
+    g_free(filename);
+    g_free(name);
+
+    append(region);
+    maep_region_start(region);
+    return regions.count() - 1;
+}
+
+int Maep::RegionModel::add(int source, const QGeoCoordinate &corner1,
+                           const QGeoCoordinate &corner2,
+                           int zoomStart, int zoomEnd)
+{
+    const MaepSource *src;
+
+    src = maep_source_manager_getById(manager, guint(source));
+    if (!src)
+        return -1;
+    return add(maep_region_new_for_bbox(manager, src,
+                                        corner1.latitude(), corner1.longitude(),
+                                        corner2.latitude(), corner2.longitude(),
+                                        zoomStart, zoomEnd));
+}
+
+// Tiles along the track are downloaded in the background, at low
+// priority, like any other region.
+int Maep::RegionModel::addTrack(int source, Maep::Track *track, qreal width,
+                                int zoomStart, int zoomEnd)
+{
+    const MaepSource *src;
+
+    src = maep_source_manager_getById(manager, guint(source));
+    if (!src || !track)
+        return -1;
+    return add(maep_region_new_for_track(manager, src, track->get(), width,
+                                         zoomStart, zoomEnd));
+}
+
+void Maep::RegionModel::start(int row)
+{
+    if (row >= 0 && row < regions.count())
+        maep_region_start(regions.at(row));
+}
+
+void Maep::RegionModel::pause(int row)
+{
+    if (row >= 0 && row < regions.count())
+        maep_region_pause(regions.at(row));
+}
+
+void Maep::RegionModel::remove(int row)
+{
+    if (row < 0 || row >= regions.count())
+        return;
+
+    MaepRegion *region = regions.at(row);
+    beginRemoveRows(QModelIndex(), row, row);
+    regions.removeAt(row);
+    endRemoveRows();
+
+    g_signal_handlers_disconnect_by_data(G_OBJECT(region), this);
+    maep_region_pause(region);
+    if (maep_region_get_filename(region))
+        g_unlink(maep_region_get_filename(region));
+    // Without file, nothing is saved on dispose.
+    maep_region_set_filename(region, NULL);
+    g_object_unref(G_OBJECT(region));
+    emit progressChanged();
+}
+
+QVariant Maep::RegionModel::data(const QModelIndex& index, int role) const
+{
+    QVariant result;
+    if (index.isValid()) {
+        int row = index.row();
+        if (row > -1 && row < regions.count()) {
+            MaepRegion *region = regions.at(row);
+            const MaepSource *source;
+            guint done, failed;
+            guint64 bytes;
+
+            maep_region_get_progress(region, &done, &failed, &bytes);
+            switch(role)
+            {
+            case SourceId:
+              result.setValue<int>(maep_region_get_source_id(region));
+              break;
+            case Label:
+              source = maep_source_manager_getById(manager, maep_region_get_source_id(region));
+              result.setValue<QString>(source ? maep_source_get_friendly_name(source) : "");
+              break;
+            case State:
+              result.setValue<int>(int(maep_region_get_state(region)));
+              break;
+            case TileCount:
+              result.setValue<int>(maep_region_get_n_tiles(region));
+              break;
+            case EstimatedBytes:
+              result.setValue<qreal>(maep_region_estimate_bytes(region));
+              break;
+            case Done:
+              result.setValue<int>(done);
+              break;
+            case Failed:
+              result.setValue<int>(failed);
+              break;
+            case Bytes:
+              result.setValue<qreal>(bytes);
+              break;
+            case Progress:
+              result.setValue<qreal>(maep_region_get_n_tiles(region) ?
+                                     qreal(done + failed) / maep_region_get_n_tiles(region) : 1.);
+              break;
+            default:
+                result.setValue<QString>(QString("Unknown role: %1").arg(role));
+                break;
+            }
+        }
+    }
+    return result;
+}
+
+int Maep::RegionModel::rowCount(const QModelIndex& parent) const
+{
+    if (parent.isValid())
+        return 0;
+    return regions.count();
+}
@@ -0,0 +1,106 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * Copyright (C) 2017 Damien Caliste <dcaliste@free.fr>
+ *
+ * This file is part of Maep.
+ *
+ * Maep is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Maep is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Maep.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REGIONMODEL_H
+#define REGIONMODEL_H
+
+#include "region.h"
+#include "osm-gps-map-qt.h"
+
+#include <QtCore/QAbstractListModel>
+#include <QGeoCoordinate>
+#include <QVariantMap>
+
+namespace Maep {
+
+class RegionModel : public QAbstractListModel
+{
+    Q_OBJECT
+
+    Q_ENUMS(RegionState)
+    Q_PROPERTY(int tileCount READ tileCount NOTIFY progressChanged)
+    Q_PROPERTY(int doneCount READ doneCount NOTIFY progressChanged)
+    Q_PROPERTY(bool running READ running NOTIFY progressChanged)
+
+public:
+    enum RegionModelRoles {
+        SourceId = Qt::UserRole + 1,
+        Label,
+        State,
+        TileCount,
+        EstimatedBytes,
+        Done,
+        Failed,
+        Bytes,
+        Progress
+    };
+
+    enum RegionState {
+        PAUSED = MAEP_REGION_PAUSED,
+        RUNNING = MAEP_REGION_RUNNING,
+        DONE = MAEP_REGION_DONE
+    };
+
+    explicit RegionModel(QObject *parent = 0);
+    virtual ~RegionModel();
+
+    QVariant data(const QModelIndex &index, int role) const;
+    int rowCount(const QModelIndex &parent) const;
+    QHash<int, QByteArray> roleNames() const;
+
+    int tileCount() const;
+    int doneCount() const;
+    bool running() const;
+
+    Q_INVOKABLE QVariantMap estimate(int source, const QGeoCoordinate &corner1,
+                                     const QGeoCoordinate &corner2,
+                                     int zoomStart, int zoomEnd) const;
+    Q_INVOKABLE int add(int source, const QGeoCoordinate &corner1,
+                        const QGeoCoordinate &corner2,
+                        int zoomStart, int zoomEnd);
+    Q_INVOKABLE QVariantMap estimateTrack(int source, Maep::Track *track,
+                                          qreal width, int zoomStart, int zoomEnd) const;
+    Q_INVOKABLE int addTrack(int source, Maep::Track *track, qreal width,
+                             int zoomStart, int zoomEnd);
+    Q_INVOKABLE void start(int row);
+    Q_INVOKABLE void pause(int row);
+    Q_INVOKABLE void remove(int row);
+
+signals:
+    void progressChanged();
+
+private:
+    static void onProgress(MaepRegion *region, RegionModel *model);
+    static void onState(MaepRegion *region, GParamSpec *pspec, RegionModel *model);
+    void append(MaepRegion *region);
+    // Both take ownership of region.
+    QVariantMap estimate(MaepRegion *region) const;
+    int add(MaepRegion *region);
+
+    QHash<int, QByteArray> roles;
+
+    MaepSourceManager *manager;
+    QList<MaepRegion*> regions;
+    gchar *path;
+};
+
+}
+
+#endif // REGIONMODEL_H
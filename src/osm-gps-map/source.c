@@ -22,8 +22,10 @@
  */
 
 #include "source.h"
+#include "tile-missing.h"
 
 #include "../config.h"
+#include "../img_loader.h"
 
 #include <string.h>
 #include <libsoup/soup.h>
@@ -42,6 +44,25 @@ struct _MaepSource
     guint min_zoom, max_zoom;
     guint cache_period;
     gboolean cache_policy;
+    /* How long after cache_period an outdated tile can still be shown
+       while, or instead of, being refreshed. Only used without
+       cache_policy, which allows any outdated tile. */
+    guint max_stale;
+    /* How tiles are kept on disk, a migration may be running to change
+       it. */
+    MaepTileStoreKind store_kind;
+    gboolean migrating;
+    /* Bytes allowed on disk, 0 for no limit, and what the last
+       eviction pass found on disk and removed so far. */
+    guint64 quota;
+    guint64 usage, evicted_bytes;
+    guint evicted_tiles;
+    /* Tiles never evicted, as arrays of protected_run_t by row, see
+       _row_key(). */
+    GHashTable *protected_rows;
+    /* Downloads allowed at once, 0 for the default, and running. */
+    guint max_conns;
+    guint in_flight;
     gboolean active;
     int uri_format;
 };
@@ -119,6 +140,7 @@ static void _sourceFree(MaepSource *source)
         g_free(source->image_suffix);
         g_free(source->copyright_notice);
         g_free(source->copyright_url);
+        g_hash_table_destroy(source->protected_rows);
         g_free(source);
     }
 }
@@ -145,12 +167,206 @@ static MaepSource* _sourceNew(const gchar *name,
     source->max_zoom = max_zoom;
     source->cache_period = cache_period;
     source->cache_policy = cache_policy;
+    source->max_stale = cache_policy ? G_MAXUINT : cache_period;
+    source->store_kind = MAEP_TILE_STORE_DIRECTORY;
+    source->migrating = FALSE;
+    source->quota = 0;
+    source->usage = 0;
+    source->evicted_bytes = 0;
+    source->evicted_tiles = 0;
+    source->protected_rows = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free,
+                                                   (GDestroyNotify)g_array_unref);
+    source->max_conns = 0;
+    source->in_flight = 0;
     source->active = TRUE;
     source->uri_format = _inspect_map_uri(repo_uri);
 
     return source;
 }
 
+MaepTile* maep_tile_ref(MaepTile *tile)
+{
+    g_return_val_if_fail(tile, NULL);
+
+    tile->ref_count += 1;
+    return tile;
+}
+
+void maep_tile_unref(MaepTile *tile)
+{
+    g_return_if_fail(tile);
+
+    tile->ref_count -= 1;
+    if (!tile->ref_count) {
+        cairo_surface_destroy(tile->surf);
+        g_slice_free(MaepTile, tile);
+    }
+}
+
+static MaepTile* _tileNew(cairo_surface_t *surf)
+{
+    MaepTile *tile;
+
+    if (!surf)
+        return NULL;
+    if (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surf);
+        return NULL;
+    }
+
+    tile = g_slice_new(MaepTile);
+    tile->surf = surf;
+    tile->stamp = time(NULL);
+    tile->synthetic = 0;
+    tile->ref_count = 1;
+
+    return tile;
+}
+
+static gsize _tileSize(const MaepTile *tile)
+{
+    return cairo_image_surface_get_stride(tile->surf) *
+        cairo_image_surface_get_height(tile->surf);
+}
+
+/* Tiles referenced by a map, on screen or around, are not evicted. */
+static gboolean _tileBorrowed(G_GNUC_UNUSED MaepTileKey key, gpointer value,
+                              G_GNUC_UNUSED gpointer data)
+{
+    return ((MaepTile*)value)->ref_count > 1;
+}
+
+/* Formats without scaled decoding are decoded in full, then scaled. */
+static cairo_surface_t* _tile_scale(cairo_surface_t *surf, gfloat scale)
+{
+    cairo_surface_t *scaled;
+    cairo_t *cr;
+    int width, height;
+
+    if (!surf || scale == 1.f)
+        return surf;
+
+    width = MAX((int)(cairo_image_surface_get_width(surf) * scale + 0.5f), 1);
+    height = MAX((int)(cairo_image_surface_get_height(surf) * scale + 0.5f), 1);
+    scaled = cairo_image_surface_create(cairo_image_surface_get_format(surf),
+                                        width, height);
+    cr = cairo_create(scaled);
+    cairo_scale(cr, scale, scale);
+    cairo_set_source_surface(cr, surf, 0, 0);
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    cairo_surface_destroy(surf);
+
+    return scaled;
+}
+
+static cairo_surface_t* _tile_from_file(const char *filename,
+                                        gfloat scale, MaepLoaderQuality quality)
+{
+    cairo_surface_t *surf;
+    GError *error;
+
+    error = NULL;
+    if (g_str_has_suffix(filename, "png"))
+        surf = _tile_scale(maep_loader_png_from_file(filename, &error), scale);
+    else
+        surf = maep_loader_jpeg_from_file_scaled(filename, scale, quality, &error);
+    if (error) {
+        g_warning("%s", error->message);
+        g_error_free(error);
+    }
+
+    return surf;
+}
+
+static cairo_surface_t* _tile_from_mem(const char *suffix,
+                                       const unsigned char *buffer, size_t len,
+                                       gfloat scale, MaepLoaderQuality quality)
+{
+    cairo_surface_t *surf;
+    GError *error;
+
+    error = NULL;
+    if (g_str_has_suffix(suffix, "png"))
+        surf = _tile_scale(maep_loader_png_from_mem(buffer, len, &error), scale);
+    else
+        surf = maep_loader_jpeg_from_mem_scaled(buffer, len, scale, quality, &error);
+    if (error) {
+        g_warning("%s", error->message);
+        g_error_free(error);
+    }
+
+    return surf;
+}
+
+/* Tiles with a file of their own are decoded from it, the others are
+   decoded in place from the mapped store. */
+static cairo_surface_t* _tile_from_store(MaepTileStore *store, const char *suffix,
+                                         MaepTileKey key,
+                                         gfloat scale, MaepLoaderQuality quality)
+{
+    cairo_surface_t *surf;
+    gchar *filename;
+    GBytes *bytes;
+    gconstpointer data;
+    gsize len;
+    GError *error;
+
+    maep_tile_store_mark_used(store, MAEP_TILE_KEY_ZOOM(key),
+                              MAEP_TILE_KEY_X(key), MAEP_TILE_KEY_Y(key));
+    filename = maep_tile_store_get_filename(store, MAEP_TILE_KEY_ZOOM(key),
+                                            MAEP_TILE_KEY_X(key), MAEP_TILE_KEY_Y(key));
+    if (filename) {
+        surf = _tile_from_file(filename, scale, quality);
+        g_free(filename);
+        return surf;
+    }
+
+    error = NULL;
+    bytes = maep_tile_store_borrow(store, MAEP_TILE_KEY_ZOOM(key),
+                                   MAEP_TILE_KEY_X(key), MAEP_TILE_KEY_Y(key), &error);
+    if (!bytes) {
+        g_warning("%s", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+    data = g_bytes_get_data(bytes, &len);
+    surf = _tile_from_mem(suffix, (const unsigned char*)data, len, scale, quality);
+    g_bytes_unref(bytes);
+
+    return surf;
+}
+
+#define TILE_CACHE_BUDGET           (32 * 1024 * 1024)
+#define DECODE_THREADS              2
+/* Downloads given to the session at once, the others wait in the
+   queue so that the most urgent ones can still overtake them. */
+#define DOWNLOAD_SLOTS              16
+/* Default downloads at once for a source, spread over its hosts. */
+#define SOURCE_CONNS                8
+/* Downloads at once to a host are tuned between 1 and HOST_CONNS:
+   one more per window of successes, halved on errors or when the
+   latency grows past HOST_LATENCY_FACTOR times the base one. */
+#define HOST_CONNS                  6
+#define HOST_WINDOW_START           2.f
+#define HOST_LATENCY_FACTOR         3
+/* Failing hosts are retried after an exponential delay in seconds,
+   and paused after some consecutive failures. */
+#define BACKOFF_BASE                1
+#define BACKOFF_MAX                 64
+#define BACKOFF_RETRIES             5
+#define BREAKER_FAILURES            8
+#define BREAKER_PAUSE               300
+/* Tiles not found on the server are not asked again for a week. */
+#define MISSING_TTL                 (7 * 24 * 3600)
+#define MISSING_SUFFIX              ".missing"
+#define MISSING_SAVE_DELAY          30
+/* Eviction passes run after this delay, once this amount of tiles
+   has been written since the last one. */
+#define EVICT_DELAY                 10
+#define EVICT_SLACK                 (4 * 1024 * 1024)
 
 #define USER_AGENT                  PACKAGE "-libsoup/" VERSION
 
@@ -164,11 +380,38 @@ struct _MaepSourceManagerPrivate
     //how we download tiles
     SoupSession *soup_session;
     char *proxy_uri;
-    GHashTable *tile_queue;
-    GHashTable *missing_tiles;
-
-    const MaepSource *current;
-    gchar *cache_dir;
+    GHashTable *downloads;       /* queued or in flight, by tile key */
+    GPtrArray *download_queue;   /* not yet given to the session,
+                                    most urgent first */
+    guint n_in_flight;
+    guint download_seq;
+    GHashTable *hosts;           /* download state, by host name */
+    guint retry_id;
+    //tiles not found on the server, by source id
+    GHashTable *missing;
+    guint missing_ttl;
+    guint missing_save_id;
+    //tiles are written to disk in the background
+    GThreadPool *writer;
+    //and read from disk and decoded in the background
+    GThreadPool *decoder;
+    GMutex decode_lock;
+    GPtrArray *decode_queue; /* protected by decode_lock */
+    GHashTable *decoding;    /* queued or running, by tile key */
+    GHashTable *building;    /* same for tiles built from children */
+
+    //decoded tiles, shared by all maps
+    MaepTileCache *tiles;
+
+    //where tiles are kept on disk, by source id
+    GHashTable *stores;
+
+    //and evicted from, in the background
+    GThreadPool *evictor;
+    guint64 cache_quota;
+    guint64 written;
+    guint evict_id;
+    gboolean evicting, evict_again;
 };
 
 enum
@@ -178,12 +421,22 @@ enum
     CACHE_DIR_PROP,
     PROXY_URI_PROP,
     TILES_QUEUED_PROP,
+    TILES_IN_FLIGHT_PROP,
+    TILE_CACHE_BUDGET_PROP,
+    TILE_CACHE_HITS_PROP,
+    TILE_CACHE_MISSES_PROP,
+    TILE_CACHE_EVICTIONS_PROP,
+    CACHE_QUOTA_PROP,
+    MISSING_TTL_PROP,
     N_PROP
   };
 static GParamSpec *_properties[N_PROP];
 enum {
     TILE_SAVED,
     TILE_RECEIVED,
+    TILE_LOADED,
+    TILE_DOWNLOADED,
+    CACHE_USAGE_CHANGED,
     LAST_SIGNAL
 };
 static guint _signals[LAST_SIGNAL] = { 0 };
@@ -196,14 +449,30 @@ static void maep_source_manager_get_property(GObject* obj, guint property_id,
                                              GValue *value, GParamSpec *pspec);
 static void maep_source_manager_set_property(GObject* obj, guint property_id,
                                              const GValue *value, GParamSpec *pspec);
-static void _download_tile(MaepSourceManager *manager,
-                           const MaepSource *source,
-                           int zoom, int x, int y);
+static gboolean _download_tile(MaepSourceManager *manager,
+                               const MaepSource *source,
+                               int zoom, int x, int y,
+                               const MaepTileRequest *request);
+static void _renew_download(MaepSourceManager *manager, MaepTileKey key,
+                            const MaepTileRequest *request);
+static void _cancel_downloads(MaepSourceManager *manager,
+                              const MaepTileRequest *request);
+static void _clear_downloads(MaepSourceManager *manager);
+static void _start_downloads(MaepSourceManager *manager);
+static void _host_free(gpointer data);
 #if USE_LIBSOUP22
 static void _tile_download_complete(SoupMessage *msg, gpointer user_data);
 #else
+static void _request_started(SoupSession *session, SoupMessage *msg,
+                             SoupSocket *socket, MaepSourceManager *manager);
 static void _tile_download_complete(SoupSession *session, SoupMessage *msg, gpointer user_data);
 #endif
+static void _write_tile(gpointer data, gpointer user_data);
+static void _decode_tile(gpointer data, gpointer user_data);
+static void _evict_tiles(gpointer data, gpointer user_data);
+static void _schedule_eviction(MaepSourceManager *manager);
+static gboolean _has_quota(const MaepSourceManager *manager);
+static gboolean _save_missing(gpointer data);
 
 static void maep_source_manager_class_init(MaepSourceManagerClass *klass)
 {
@@ -231,22 +500,127 @@ static void maep_source_manager_class_init(MaepSourceManagerClass *klass)
   _properties[PROXY_URI_PROP] =
       g_param_spec_string("proxy-uri", "proxy uri", "http proxy uri on NULL",
                           NULL, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+  /**
+   * MaepSourceManager::tiles-queued:
+   *
+   * Number of tiles waiting for a download slot. The counts of
+   * downloads are not notified, they should be polled.
+   */
   _properties[TILES_QUEUED_PROP] =
       g_param_spec_uint("tiles-queued", "tiles-queued", "number of tiles currently waiting to download",
                         0, G_MAXUINT, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  /**
+   * MaepSourceManager::tiles-in-flight:
+   *
+   * Number of tiles currently downloading.
+   */
+  _properties[TILES_IN_FLIGHT_PROP] =
+      g_param_spec_uint("tiles-in-flight", "tiles-in-flight", "number of tiles currently downloading",
+                        0, G_MAXUINT, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  /**
+   * MaepSourceManager::tile-cache-budget:
+   *
+   * Memory in bytes used to keep decoded tiles, tiles currently
+   * referenced by a map are kept in addition.
+   */
+  _properties[TILE_CACHE_BUDGET_PROP] =
+      g_param_spec_uint("tile-cache-budget", "Tile cache budget",
+                        "memory in bytes used to keep decoded tiles",
+                        0, G_MAXUINT, TILE_CACHE_BUDGET,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  /**
+   * MaepSourceManager::tile-cache-hits:
+   *
+   * Number of tiles found in memory. The counters are not notified,
+   * they should be polled.
+   */
+  _properties[TILE_CACHE_HITS_PROP] =
+      g_param_spec_uint("tile-cache-hits", "Tile cache hits",
+                        "number of tiles found in memory",
+                        0, G_MAXUINT, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  _properties[TILE_CACHE_MISSES_PROP] =
+      g_param_spec_uint("tile-cache-misses", "Tile cache misses",
+                        "number of tiles not found in memory",
+                        0, G_MAXUINT, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  _properties[TILE_CACHE_EVICTIONS_PROP] =
+      g_param_spec_uint("tile-cache-evictions", "Tile cache evictions",
+                        "number of tiles dropped to fit the budget",
+                        0, G_MAXUINT, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  /**
+   * MaepSourceManager::cache-quota:
+   *
+   * Bytes on disk allowed for the tiles of all sources, 0 for no
+   * limit. The least recently used tiles are evicted in the
+   * background to fit it.
+   */
+  _properties[CACHE_QUOTA_PROP] =
+      g_param_spec_uint64("cache-quota", "Cache quota",
+                          "bytes on disk allowed for all sources",
+                          0, G_MAXUINT64, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  /**
+   * MaepSourceManager::missing-ttl:
+   *
+   * Seconds during which a tile not found on the server is not
+   * downloaded again. These tiles are remembered next to the cache
+   * of each source.
+   */
+  _properties[MISSING_TTL_PROP] =
+      g_param_spec_uint("missing-ttl", "Missing tiles TTL",
+                        "seconds before downloading again a tile not found",
+                        0, G_MAXUINT, MISSING_TTL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
 
   g_object_class_install_properties(G_OBJECT_CLASS(klass), N_PROP, _properties);
 
+  /**
+   * MaepSourceManager::tile-saved:
+   *
+   * Emitted when a downloaded tile has been written on disk, with
+   * its file name, or NULL if stored in a pack.
+   */
   _signals[TILE_SAVED] =
     g_signal_new("tile-saved", G_TYPE_FROM_CLASS(klass),
                  G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
-                 0, NULL, NULL, g_cclosure_marshal_VOID__STRING,
-                 G_TYPE_NONE, 1, G_TYPE_STRING, NULL);
+                 0, NULL, NULL, NULL,
+                 G_TYPE_NONE, 2, G_TYPE_UINT64, G_TYPE_STRING);
   _signals[TILE_RECEIVED] =
     g_signal_new("tile-received", G_TYPE_FROM_CLASS(klass),
                  G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
-                 0, NULL, NULL, g_cclosure_marshal_VOID__STRING,
-                 G_TYPE_NONE, 1, G_TYPE_STRING, NULL);
+                 0, NULL, NULL, NULL,
+                 G_TYPE_NONE, 4, G_TYPE_UINT64, G_TYPE_STRING,
+                 G_TYPE_POINTER, G_TYPE_ULONG);
+  /**
+   * MaepSourceManager::tile-loaded:
+   *
+   * Emitted when a new decoded tile is available in memory.
+   */
+  _signals[TILE_LOADED] =
+    g_signal_new("tile-loaded", G_TYPE_FROM_CLASS(klass),
+                 G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+                 0, NULL, NULL, NULL,
+                 G_TYPE_NONE, 1, G_TYPE_UINT64);
+  /**
+   * MaepSourceManager::tile-downloaded:
+   *
+   * Emitted when a download is over, with the HTTP status and the
+   * size of the received tile. Queued downloads that are cancelled
+   * end with SOUP_STATUS_CANCELLED.
+   */
+  _signals[TILE_DOWNLOADED] =
+    g_signal_new("tile-downloaded", G_TYPE_FROM_CLASS(klass),
+                 G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+                 0, NULL, NULL, NULL,
+                 G_TYPE_NONE, 3, G_TYPE_UINT64, G_TYPE_UINT, G_TYPE_ULONG);
+  /**
+   * MaepSourceManager::cache-usage-changed:
+   *
+   * Emitted after an eviction pass, with the id of each source
+   * whose disk usage has been computed again.
+   */
+  _signals[CACHE_USAGE_CHANGED] =
+    g_signal_new("cache-usage-changed", G_TYPE_FROM_CLASS(klass),
+                 G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+                 0, NULL, NULL, NULL,
+                 G_TYPE_NONE, 1, G_TYPE_UINT);
 
   g_type_class_add_private(klass, sizeof(MaepSourceManagerPrivate));
 }
@@ -261,8 +635,8 @@ static void maep_source_manager_init(MaepSourceManager *self)
   self->priv->sourcesById = g_hash_table_new(g_direct_hash, g_direct_equal);
 
   self->priv->userId = 0;
-  self->priv->current = NULL;
-  self->priv->cache_dir = NULL;
+  self->priv->stores = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                             (GDestroyNotify)maep_tile_store_unref);
 
 #if USE_LIBSOUP22
     /* libsoup-2.2 has no special way to set the user agent, so we */
@@ -280,12 +654,50 @@ static void maep_source_manager_init(MaepSourceManager *self)
                                           USER_AGENT, NULL);
 #endif
 #endif
-    //Hash table which maps tile d/l URIs to SoupMessage requests
-  self->priv->tile_queue = g_hash_table_new (g_str_hash, g_str_equal);
+  /* Connections are limited by our own scheduler, keep-alive
+     connections are reused across downloads to the same host. */
+  g_object_set(G_OBJECT(self->priv->soup_session),
+               SOUP_SESSION_MAX_CONNS, DOWNLOAD_SLOTS,
+               SOUP_SESSION_MAX_CONNS_PER_HOST, HOST_CONNS, NULL);
+#if !USE_LIBSOUP22
+  g_signal_connect(G_OBJECT(self->priv->soup_session), "request-started",
+                   G_CALLBACK(_request_started), self);
+#endif
+    //Downloads by tile key, those waiting for a slot are also in the queue
+  self->priv->downloads = g_hash_table_new (g_int64_hash, g_int64_equal);
+  self->priv->download_queue = g_ptr_array_new();
+  self->priv->n_in_flight = 0;
+  self->priv->download_seq = 0;
+  self->priv->hosts = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                            NULL, _host_free);
+  self->priv->retry_id = 0;
 
     //Some mapping providers (Google) have varying degrees of tiles at multiple
     //zoom levels
-  self->priv->missing_tiles = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->priv->missing = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                              (GDestroyNotify)maep_tile_missing_free);
+  self->priv->missing_ttl = MISSING_TTL;
+  self->priv->missing_save_id = 0;
+
+    //A single writer keeps the flash writes sequential
+  self->priv->writer = g_thread_pool_new(_write_tile, NULL, 1, FALSE, NULL);
+  self->priv->decoder = g_thread_pool_new(_decode_tile, NULL, DECODE_THREADS, FALSE, NULL);
+  g_mutex_init(&self->priv->decode_lock);
+  self->priv->decode_queue = g_ptr_array_new();
+  self->priv->decoding = g_hash_table_new(g_int64_hash, g_int64_equal);
+  self->priv->building = g_hash_table_new(g_int64_hash, g_int64_equal);
+
+  self->priv->tiles = maep_tile_cache_new_full((GDestroyNotify)maep_tile_unref,
+                                               (MaepTileCacheSizeFunc)_tileSize,
+                                               TILE_CACHE_BUDGET);
+  maep_tile_cache_set_keep_func(self->priv->tiles, _tileBorrowed, NULL);
+
+  self->priv->evictor = g_thread_pool_new(_evict_tiles, NULL, 1, FALSE, NULL);
+  self->priv->cache_quota = 0;
+  self->priv->written = 0;
+  self->priv->evict_id = 0;
+  self->priv->evicting = FALSE;
+  self->priv->evict_again = FALSE;
 }
 
 static void maep_source_manager_finalize(GObject* obj)
@@ -296,14 +708,36 @@ static void maep_source_manager_finalize(GObject* obj)
 
   g_free(self->priv->tile_dir);
   g_hash_table_destroy(self->priv->sources);
-  g_free(self->priv->cache_dir);
   g_free(self->priv->proxy_uri);
 
+  /* Before aborting, so that no queued download is started. */
+  if (self->priv->retry_id)
+      g_source_remove(self->priv->retry_id);
+  _clear_downloads(self);
   soup_session_abort(self->priv->soup_session);
   g_object_unref(self->priv->soup_session);
 
-  g_hash_table_destroy(self->priv->tile_queue);
-  g_hash_table_destroy(self->priv->missing_tiles);
+  if (self->priv->evict_id)
+      g_source_remove(self->priv->evict_id);
+  g_thread_pool_free(self->priv->evictor, TRUE, TRUE);
+  g_thread_pool_free(self->priv->writer, FALSE, TRUE);
+  g_thread_pool_free(self->priv->decoder, TRUE, TRUE);
+  g_mutex_clear(&self->priv->decode_lock);
+  g_ptr_array_free(self->priv->decode_queue, TRUE);
+  g_hash_table_destroy(self->priv->decoding);
+  g_hash_table_destroy(self->priv->building);
+
+  g_hash_table_destroy(self->priv->downloads);
+  g_ptr_array_free(self->priv->download_queue, TRUE);
+  g_hash_table_destroy(self->priv->hosts);
+  if (self->priv->missing_save_id) {
+      g_source_remove(self->priv->missing_save_id);
+      _save_missing(self);
+  }
+  g_hash_table_destroy(self->priv->missing);
+  maep_tile_cache_free(self->priv->tiles);
+  /* After the writer, so packs are closed once written. */
+  g_hash_table_destroy(self->priv->stores);
 
   G_OBJECT_CLASS(maep_source_manager_parent_class)->finalize(obj);
 }
@@ -312,6 +746,7 @@ static void maep_source_manager_get_property(GObject* obj, guint property_id,
                                              GValue *value, GParamSpec *pspec)
 {
   MaepSourceManager *self = MAEP_SOURCE_MANAGER(obj);
+  guint stat;
 
   switch (property_id) {
   case N_SOURCES_PROP:
@@ -324,7 +759,31 @@ static void maep_source_manager_get_property(GObject* obj, guint property_id,
       g_value_set_string(value, self->priv->proxy_uri);
       break;
   case TILES_QUEUED_PROP:
-      g_value_set_uint(value, g_hash_table_size(self->priv->tile_queue));
+      g_value_set_uint(value, self->priv->download_queue->len);
+      break;
+  case TILES_IN_FLIGHT_PROP:
+      g_value_set_uint(value, self->priv->n_in_flight);
+      break;
+  case TILE_CACHE_BUDGET_PROP:
+      g_value_set_uint(value, maep_tile_cache_get_budget(self->priv->tiles));
+      break;
+  case TILE_CACHE_HITS_PROP:
+      maep_tile_cache_get_stats(self->priv->tiles, &stat, NULL, NULL);
+      g_value_set_uint(value, stat);
+      break;
+  case TILE_CACHE_MISSES_PROP:
+      maep_tile_cache_get_stats(self->priv->tiles, NULL, &stat, NULL);
+      g_value_set_uint(value, stat);
+      break;
+  case TILE_CACHE_EVICTIONS_PROP:
+      maep_tile_cache_get_stats(self->priv->tiles, NULL, NULL, &stat);
+      g_value_set_uint(value, stat);
+      break;
+  case CACHE_QUOTA_PROP:
+      g_value_set_uint64(value, self->priv->cache_quota);
+      break;
+  case MISSING_TTL_PROP:
+      g_value_set_uint(value, self->priv->missing_ttl);
       break;
   default:
       /* We don't have any other property... */
@@ -337,11 +796,16 @@ static void maep_source_manager_set_property(GObject* obj, guint property_id,
                                              const GValue *value, GParamSpec *pspec)
 {
   MaepSourceManager *self = MAEP_SOURCE_MANAGER(obj);
+  GHashTableIter iter;
+  gpointer missing;
 
   switch (property_id) {
   case CACHE_DIR_PROP:
       g_free(self->priv->tile_dir);
       self->priv->tile_dir = g_value_dup_string(value);
+      g_hash_table_remove_all(self->priv->stores);
+      g_hash_table_remove_all(self->priv->missing);
+      _schedule_eviction(self);
       break;
   case PROXY_URI_PROP:
       if ( g_value_get_string(value) ) {
@@ -361,6 +825,19 @@ static void maep_source_manager_set_property(GObject* obj, guint property_id,
       } else
           self->priv->proxy_uri = NULL;
       break;
+  case TILE_CACHE_BUDGET_PROP:
+      maep_tile_cache_set_budget(self->priv->tiles, g_value_get_uint(value));
+      break;
+  case CACHE_QUOTA_PROP:
+      self->priv->cache_quota = g_value_get_uint64(value);
+      _schedule_eviction(self);
+      break;
+  case MISSING_TTL_PROP:
+      self->priv->missing_ttl = g_value_get_uint(value);
+      g_hash_table_iter_init(&iter, self->priv->missing);
+      while (g_hash_table_iter_next(&iter, NULL, &missing))
+          maep_tile_missing_set_ttl((MaepTileMissing*)missing, self->priv->missing_ttl);
+      break;
   default:
       /* We don't have any other property... */
       G_OBJECT_WARN_INVALID_PROPERTY_ID(obj, property_id, pspec);
@@ -592,18 +1069,208 @@ const MaepSource* maep_source_manager_add(MaepSourceManager *manager,
     return source;
 }
 
+static gboolean _tileOfSource(MaepTileKey key, G_GNUC_UNUSED gpointer value,
+                              gpointer data)
+{
+    return MAEP_TILE_KEY_SOURCE(key) == ((MaepSource*)data)->id;
+}
+
 gboolean maep_source_manager_remove(MaepSourceManager *manager,
                                     MaepSource* source)
 {
     g_return_val_if_fail(MAEP_IS_SOURCE_MANAGER(manager), FALSE);
     g_return_val_if_fail(source, FALSE);
 
-    if (manager->priv->current == source)
-        manager->priv->current = NULL;
+    g_hash_table_remove(manager->priv->stores, GINT_TO_POINTER(source->id));
+    g_hash_table_remove(manager->priv->missing, GINT_TO_POINTER(source->id));
+
+    maep_tile_cache_foreach_remove(manager->priv->tiles, _tileOfSource, source);
 
     return g_hash_table_remove(manager->priv->sources, source->name);
 }
 
+void maep_source_manager_set_max_stale(MaepSourceManager *manager,
+                                       const MaepSource *source,
+                                       guint max_stale)
+{
+    MaepSource *src;
+
+    g_return_if_fail(MAEP_IS_SOURCE_MANAGER(manager));
+    g_return_if_fail(source);
+
+    src = g_hash_table_lookup(manager->priv->sources, source->name);
+    g_return_if_fail(src == source);
+
+    src->max_stale = max_stale;
+}
+
+/**
+ * maep_source_manager_set_quota:
+ * @manager: a #MaepSourceManager object.
+ * @source: a source of @manager.
+ * @quota: bytes on disk allowed, 0 for no limit.
+ *
+ * Limit the disk space used by the tiles of @source. The least
+ * recently used tiles out of protected areas are evicted in the
+ * background to fit it.
+ */
+void maep_source_manager_set_quota(MaepSourceManager *manager,
+                                   const MaepSource *source,
+                                   guint64 quota)
+{
+    MaepSource *src;
+
+    g_return_if_fail(MAEP_IS_SOURCE_MANAGER(manager));
+    g_return_if_fail(source);
+
+    src = g_hash_table_lookup(manager->priv->sources, source->name);
+    g_return_if_fail(src == source);
+
+    if (src->quota == quota)
+        return;
+    src->quota = quota;
+    _schedule_eviction(manager);
+}
+
+/**
+ * maep_source_manager_set_max_connections:
+ * @manager: a #MaepSourceManager object.
+ * @source: a source of @manager.
+ * @max_conns: downloads allowed at once, 0 for the default.
+ *
+ * Limit the downloads running at once for @source, over all its
+ * servers. Each server is also limited by the latency and the errors
+ * observed.
+ */
+void maep_source_manager_set_max_connections(MaepSourceManager *manager,
+                                             const MaepSource *source,
+                                             guint max_conns)
+{
+    MaepSource *src;
+
+    g_return_if_fail(MAEP_IS_SOURCE_MANAGER(manager));
+    g_return_if_fail(source);
+
+    src = g_hash_table_lookup(manager->priv->sources, source->name);
+    g_return_if_fail(src == source);
+
+    if (src->max_conns == max_conns)
+        return;
+    src->max_conns = max_conns;
+    _start_downloads(manager);
+}
+
+void maep_source_manager_set_cache_quota(MaepSourceManager *manager,
+                                         guint64 quota)
+{
+    g_return_if_fail(MAEP_IS_SOURCE_MANAGER(manager));
+
+    if (manager->priv->cache_quota == quota)
+        return;
+    manager->priv->cache_quota = quota;
+    _schedule_eviction(manager);
+    g_object_notify_by_pspec(G_OBJECT(manager), _properties[CACHE_QUOTA_PROP]);
+}
+
+/* Protected tiles are kept as runs on each row, so that checking a
+   tile only looks at the runs of its row. A run protected several
+   times is counted. */
+typedef struct {
+    int x0, x1;
+    guint count;
+} protected_run_t;
+
+static inline MaepTileKey _row_key(int zoom, int y)
+{
+    return MAEP_TILE_KEY(0, zoom, 0, y);
+}
+
+static protected_run_t* _find_run(GArray *runs, int x0, int x1)
+{
+    protected_run_t *run;
+    guint i;
+
+    for (i = 0; runs && i < runs->len; i++) {
+        run = &g_array_index(runs, protected_run_t, i);
+        if (run->x0 == x0 && run->x1 == x1)
+            return run;
+    }
+    return NULL;
+}
+
+/**
+ * maep_source_manager_protect_area:
+ * @manager: a #MaepSourceManager object.
+ * @source: a source of @manager.
+ * @area: tiles to keep on disk.
+ *
+ * Never evict the tiles of @area, like the ones of a region
+ * downloaded for offline use. An area can be protected several
+ * times, it is released once unprotected as many times.
+ */
+void maep_source_manager_protect_area(MaepSourceManager *manager,
+                                      const MaepSource *source,
+                                      const MaepTileArea *area)
+{
+    MaepSource *src;
+    protected_run_t *run, new_run;
+    MaepTileKey key;
+    GArray *runs;
+    int y;
+
+    g_return_if_fail(MAEP_IS_SOURCE_MANAGER(manager));
+    g_return_if_fail(source && area);
+
+    src = g_hash_table_lookup(manager->priv->sources, source->name);
+    g_return_if_fail(src == source);
+
+    for (y = area->y0; y <= area->y1; y++) {
+        key = _row_key(area->zoom, y);
+        runs = g_hash_table_lookup(src->protected_rows, &key);
+        if (!runs) {
+            runs = g_array_new(FALSE, FALSE, sizeof(protected_run_t));
+            g_hash_table_insert(src->protected_rows, g_memdup(&key, sizeof(key)), runs);
+        }
+        run = _find_run(runs, area->x0, area->x1);
+        if (run) {
+            run->count += 1;
+        } else {
+            new_run.x0 = area->x0;
+            new_run.x1 = area->x1;
+            new_run.count = 1;
+            g_array_append_val(runs, new_run);
+        }
+    }
+}
+
+void maep_source_manager_unprotect_area(MaepSourceManager *manager,
+                                        const MaepSource *source,
+                                        const MaepTileArea *area)
+{
+    MaepSource *src;
+    protected_run_t *run;
+    MaepTileKey key;
+    GArray *runs;
+    int y;
+
+    g_return_if_fail(MAEP_IS_SOURCE_MANAGER(manager));
+    g_return_if_fail(source && area);
+
+    src = g_hash_table_lookup(manager->priv->sources, source->name);
+    g_return_if_fail(src == source);
+
+    for (y = area->y0; y <= area->y1; y++) {
+        key = _row_key(area->zoom, y);
+        runs = g_hash_table_lookup(src->protected_rows, &key);
+        run = _find_run(runs, area->x0, area->x1);
+        if (!run || --run->count)
+            continue;
+        g_array_remove_index_fast(runs, run - (protected_run_t*)runs->data);
+        if (!runs->len)
+            g_hash_table_remove(src->protected_rows, &key);
+    }
+}
+
 const MaepSource* maep_source_manager_get(const MaepSourceManager *manager,
                                           const gchar *label)
 {
@@ -632,21 +1299,46 @@ void maep_source_manager_set_cache_dir(MaepSourceManager *manager, const gchar *
 
     g_free(manager->priv->tile_dir);
     manager->priv->tile_dir = g_strdup(dir);
+    g_hash_table_remove_all(manager->priv->stores);
+    g_hash_table_remove_all(manager->priv->missing);
+    _schedule_eviction(manager);
     g_object_notify_by_pspec(G_OBJECT(manager), _properties[CACHE_DIR_PROP]);
 }
 
-static void _update_current(const MaepSourceManager *manager, const MaepSource *source)
+/**
+ * maep_source_manager_sync:
+ * @manager: a #MaepSourceManager object.
+ *
+ * Save what is only kept in memory about the tiles on disk, like the
+ * index of the packs, or the tiles found missing on the servers. To
+ * be called before the application quits, since the shared manager
+ * is never finalized.
+ */
+void maep_source_manager_sync(MaepSourceManager *manager)
 {
-    g_return_val_if_fail(MAEP_IS_SOURCE_MANAGER(manager), NULL);
-    g_return_val_if_fail(source, NULL);
+    GHashTableIter iter;
+    gpointer store;
 
-    if (manager->priv->current == source)
-        return;
+    g_return_if_fail(MAEP_IS_SOURCE_MANAGER(manager));
+
+    /* Not waiting for the delayed save. */
+    if (manager->priv->missing_save_id) {
+        g_source_remove(manager->priv->missing_save_id);
+        _save_missing(manager);
+    }
+
+    g_hash_table_iter_init(&iter, manager->priv->stores);
+    while (g_hash_table_iter_next(&iter, NULL, &store))
+        maep_tile_store_sync((MaepTileStore*)store);
+}
+
+static gchar* _get_cache_dir(const MaepSourceManager *manager, const MaepSource *source)
+{
+    gchar *cache_dir;
 
-    g_free(manager->priv->cache_dir);
     if (!manager->priv->tile_dir
         || g_str_has_prefix(manager->priv->tile_dir, MAEP_SOURCE_MANAGER_CACHE_NONE)) {
-        manager->priv->cache_dir = NULL;
+        cache_dir = NULL;
     } else if (g_str_has_prefix(manager->priv->tile_dir, MAEP_SOURCE_MANAGER_CACHE_AUTO)) {
 #if GLIB_CHECK_VERSION (2, 16, 0)
         char *md5 = g_compute_checksum_for_string
@@ -654,141 +1346,735 @@ static void _update_current(const MaepSourceManager *manager, const MaepSource *
 #else
         char *md5 = g_strdup(maep_source_get_friendly_name(source));
 #endif
-        manager->priv->cache_dir = g_build_filename(manager->priv->tile_dir + 7, md5, NULL);
+        cache_dir = g_build_filename(manager->priv->tile_dir + 7, md5, NULL);
         g_free(md5);
     } else if (g_str_has_prefix(manager->priv->tile_dir, MAEP_SOURCE_MANAGER_CACHE_FRIENDLY)) {
-        manager->priv->cache_dir = g_build_filename(manager->priv->tile_dir + 11,
-                                                    maep_source_get_friendly_name(source),
-                                                    NULL);
+        cache_dir = g_build_filename(manager->priv->tile_dir + 11,
+                                     maep_source_get_friendly_name(source),
+                                     NULL);
     } else {
-        manager->priv->cache_dir = g_build_filename(manager->priv->tile_dir,
-                                                    maep_source_get_friendly_name(source),
-                                                    NULL);
+        cache_dir = g_build_filename(manager->priv->tile_dir,
+                                     maep_source_get_friendly_name(source),
+                                     NULL);
     }
 
-    manager->priv->current = source;
-    return;
+    return cache_dir;
 }
 
-static gchar* _get_tile_id(const MaepSourceManager *manager,
-                           const MaepSource *source,
-                           int zoom, int x, int y)
+/* The store of source, NULL if tiles are not kept on disk. */
+static MaepTileStore* _get_store(const MaepSourceManager *manager,
+                                 const MaepSource *source)
 {
+    MaepTileStore *store;
+    gchar *cache_dir;
+
     g_return_val_if_fail(MAEP_IS_SOURCE_MANAGER(manager), NULL);
     g_return_val_if_fail(source, NULL);
 
-    if (manager->priv->current != source)
-        _update_current(manager, source);
+    store = g_hash_table_lookup(manager->priv->stores, GINT_TO_POINTER(source->id));
+    if (store)
+        return store;
 
-    return g_strdup_printf("%s%c%d%c%d%c%d.%s",
-                           manager->priv->cache_dir ? manager->priv->cache_dir : maep_source_get_friendly_name(source), G_DIR_SEPARATOR,
-                           zoom, G_DIR_SEPARATOR,
-                           x, G_DIR_SEPARATOR,
-                           y,
-                           source->image_suffix);
+    cache_dir = _get_cache_dir(manager, source);
+    if (!cache_dir)
+        return NULL;
+
+    store = maep_tile_store_new(source->store_kind, cache_dir, source->image_suffix);
+    g_free(cache_dir);
+    g_hash_table_insert(manager->priv->stores, GINT_TO_POINTER(source->id), store);
+
+    return store;
 }
 
-static gboolean _tile_age_exceeded(char *filename, guint period) 
+/* The tiles of source not found on the server, only kept in memory
+   if there is no cache. */
+static MaepTileMissing* _get_missing(const MaepSourceManager *manager,
+                                     const MaepSource *source)
 {
-    struct stat buf;
-    
-    if(!g_stat(filename, &buf)) 
-        return(time(NULL) - buf.st_mtime > (gint)period);
+    MaepTileMissing *missing;
+    gchar *cache_dir, *filename;
+
+    missing = g_hash_table_lookup(manager->priv->missing, GINT_TO_POINTER(source->id));
+    if (missing)
+        return missing;
 
+    cache_dir = _get_cache_dir(manager, source);
+    filename = cache_dir ? g_strconcat(cache_dir, MISSING_SUFFIX, NULL) : NULL;
+    missing = maep_tile_missing_new(filename, source->id, manager->priv->missing_ttl);
+    g_free(filename);
+    g_free(cache_dir);
+    g_hash_table_insert(manager->priv->missing, GINT_TO_POINTER(source->id), missing);
+
+    return missing;
+}
+
+static gboolean _save_missing(gpointer data)
+{
+    MaepSourceManager *manager = MAEP_SOURCE_MANAGER(data);
+    GHashTableIter iter;
+    gpointer missing;
+    GError *error;
+
+    manager->priv->missing_save_id = 0;
+    g_hash_table_iter_init(&iter, manager->priv->missing);
+    while (g_hash_table_iter_next(&iter, NULL, &missing)) {
+        error = NULL;
+        if (maep_tile_missing_is_dirty((MaepTileMissing*)missing) &&
+            !maep_tile_missing_save((MaepTileMissing*)missing, &error)) {
+            g_warning("%s", error->message);
+            g_error_free(error);
+        }
+    }
     return FALSE;
 }
 
-static gchar* _get_cached_tile(const MaepSourceManager *manager,
-                               const MaepSource *source,
-                               int zoom, int x, int y)
+/* Remember that a tile is not on the server, saving the set a bit
+   later to group the writes. */
+static void _tile_missing(MaepSourceManager *manager, MaepTileKey key)
 {
-    gchar *filename;
+    MaepTileMissing *missing;
 
-    g_return_val_if_fail(MAEP_IS_SOURCE_MANAGER(manager), NULL);
-    g_return_val_if_fail(source, NULL);
+    missing = g_hash_table_lookup(manager->priv->missing,
+                                  GINT_TO_POINTER(MAEP_TILE_KEY_SOURCE(key)));
+    /* The source may have been removed, or the cache dir changed. */
+    if (!missing)
+        return;
+    maep_tile_missing_add(missing, key);
+    if (!manager->priv->missing_save_id)
+        manager->priv->missing_save_id =
+            g_timeout_add_seconds(MISSING_SAVE_DELAY, _save_missing, manager);
+}
 
-    if (manager->priv->current != source)
-        _update_current(manager, source);
+/* Whether the tile is on disk, and how long ago it has been stored or
+   checked. */
+static gboolean _get_cached_tile(const MaepSourceManager *manager,
+                                 const MaepSource *source,
+                                 int zoom, int x, int y, time_t *age)
+{
+    MaepTileStore *store;
+    time_t mtime;
 
-    if (!manager->priv->cache_dir)
-        return NULL;
+    store = _get_store(manager, source);
+    if (!store || !maep_tile_store_stat(store, zoom, x, y, &mtime))
+        return FALSE;
 
-    filename = g_strdup_printf("%s%c%d%c%d%c%d.%s",
-                               manager->priv->cache_dir, G_DIR_SEPARATOR,
-                               zoom, G_DIR_SEPARATOR,
-                               x, G_DIR_SEPARATOR,
-                               y,
-                               source->image_suffix);
-    if (!g_file_test(filename, G_FILE_TEST_EXISTS)) {
-        g_free(filename);
-        return NULL;
-    }
+    *age = time(NULL) - mtime;
+    return TRUE;
+}
 
-    g_debug("Found file %s", filename);
-    return filename;
+/* Whether an outdated tile can still be shown. */
+static gboolean _tile_usable(const MaepSource *source, time_t age)
+{
+    if (source->cache_policy || source->max_stale >= G_MAXINT - source->cache_period)
+        return TRUE;
+
+    return age <= (time_t)(source->cache_period + source->max_stale);
+}
+
+gboolean maep_source_manager_has_cached_tile(const MaepSourceManager *manager,
+                                             const MaepSource *source,
+                                             int zoom, int x, int y)
+{
+    time_t age;
+
+    g_return_val_if_fail(source, FALSE);
+
+    /* Allow outdated cached tiles, up to max_stale. */
+    return _get_cached_tile(manager, source, zoom, x, y, &age) &&
+        _tile_usable(source, age);
 }
 
+/* Tiles in a pack have no file of their own, NULL is returned for
+   them. */
 gchar* maep_source_manager_get_cached_tile(const MaepSourceManager *manager,
                                            const MaepSource *source,
                                            int zoom, int x, int y)
 {
     gchar *filename;
 
-    g_return_val_if_fail(source, NULL);
-
-    filename = _get_cached_tile(manager, source, zoom, x, y);
-    if (!filename)
+    if (!maep_source_manager_has_cached_tile(manager, source, zoom, x, y))
         return NULL;
 
-    /* Allow outdated cached tiles. */
-    if (source->cache_policy)
-        return filename;
-
-    if (!_tile_age_exceeded(filename, source->cache_period))
-        return filename;
+    filename = maep_tile_store_get_filename(_get_store(manager, source), zoom, x, y);
+    g_debug("Found file %s", filename);
+    return filename;
+}
 
-    g_free(filename);
+/**
+ * maep_source_manager_advise_tiles:
+ * @manager: a #MaepSourceManager object.
+ * @source: a #MaepSource.
+ * @zoom: the zoom level.
+ * @x0: the first column.
+ * @y0: the first row.
+ * @x1: the last column.
+ * @y1: the last row.
+ *
+ * Hint that the tiles of the area are about to be loaded, so the
+ * store can read them ahead.
+ */
+void maep_source_manager_advise_tiles(const MaepSourceManager *manager,
+                                      const MaepSource *source, int zoom,
+                                      int x0, int y0, int x1, int y1)
+{
+    MaepTileStore *store;
 
-    return NULL;
+    store = _get_store(manager, source);
+    if (store)
+        maep_tile_store_advise(store, zoom, x0, y0, x1, y1);
 }
 
-gchar* maep_source_manager_get_tile_async(MaepSourceManager *manager,
-                                          const MaepSource *source,
-                                          int zoom, int x, int y)
+static gboolean _get_tile_async(MaepSourceManager *manager,
+                                const MaepSource *source,
+                                int zoom, int x, int y,
+                                const MaepTileRequest *request)
 {
-    gchar *filename;
-    gboolean queueing;
+    time_t age;
+    gboolean cached;
 
-    g_return_val_if_fail(source, NULL);
+    cached = _get_cached_tile(manager, source, zoom, x, y, &age);
+    if (!cached || age > (time_t)source->cache_period)
+        _download_tile(manager, source, zoom, x, y, request);
 
-    filename = _get_cached_tile(manager, source, zoom, x, y);
+    /* Outdated tiles are shown while the new ones are downloading,
+       they are replaced when received. */
+    return cached && _tile_usable(source, age);
+}
 
-    queueing = TRUE;
-    if (!filename || (queueing = _tile_age_exceeded(filename, source->cache_period)))
-        _download_tile(manager, source, zoom, x, y);
+/**
+ * maep_source_manager_download_tile:
+ * @manager: a #MaepSourceManager object.
+ * @source: a #MaepSource.
+ * @zoom: the zoom level.
+ * @x: the tile column.
+ * @y: the tile row.
+ * @request: (allow-none): who asks for it, and how urgently.
+ *
+ * Queue the download of a tile that is missing or outdated on disk,
+ * without decoding it.
+ *
+ * Returns: TRUE if the tile is downloading, the
+ * MaepSourceManager::tile-downloaded signal tells when it is over.
+ * FALSE if the tile on disk is up to date or if it is known to be
+ * missing on the server.
+ */
+gboolean maep_source_manager_download_tile(MaepSourceManager *manager,
+                                           const MaepSource *source,
+                                           int zoom, int x, int y,
+                                           const MaepTileRequest *request)
+{
+    time_t age;
 
-    if (source->cache_policy || !queueing)
-        return filename;
+    g_return_val_if_fail(MAEP_IS_SOURCE_MANAGER(manager), FALSE);
+    g_return_val_if_fail(source, FALSE);
 
-    g_free(filename);
+    if (_get_cached_tile(manager, source, zoom, x, y, &age) &&
+        age <= (time_t)source->cache_period)
+        return FALSE;
 
-    return NULL;
+    return _download_tile(manager, source, zoom, x, y, request);
 }
 
-GType maep_source_get_type(void)
+/* Returns a new reference on the cached tile, taken before insertion
+   so that the eviction run by the insertion cannot free it. */
+static MaepTile* _cache_tile(MaepSourceManager *manager, MaepTileKey key,
+                             cairo_surface_t *surf, guint synthetic)
 {
-    static GType g_define_type_id = 0;
+    MaepTile *tile;
 
-    if (g_define_type_id == 0)
-        g_define_type_id = g_boxed_type_register_static("MaepSource",
-                                                        (GBoxedCopyFunc)_sourceRef,
-                                                        (GBoxedFreeFunc)_sourceFree);
-    return g_define_type_id;
+    tile = _tileNew(surf);
+    if (!tile)
+        return NULL;
+
+    tile->synthetic = synthetic;
+    maep_tile_ref(tile);
+    /* if the tile is already in the cache, it will be overwritten. */
+    maep_tile_cache_insert(manager->priv->tiles, key, tile);
+
+    return tile;
 }
 
-guint maep_source_get_id(const MaepSource *source)
+/* Synthetic tiles are only placeholders, they don't count as loaded. */
+static MaepTile* _peek_loaded(MaepSourceManager *manager, MaepTileKey key)
 {
-    g_return_val_if_fail(source, 0);
+    MaepTile *tile;
+
+    tile = maep_tile_cache_peek(manager->priv->tiles, key);
+    return (tile && !tile->synthetic) ? tile : NULL;
+}
+
+typedef struct {
+    /* The tile to read and decode */
+    MaepTileKey key;
+    /* When not zero, the tile is built from its children this number
+       of levels below instead. */
+    int depth;
+    MaepTileStore *store;
+    gchar *suffix;
+    MaepTileRequest request;
+    gboolean queued;
+    cairo_surface_t *surf;
+    MaepSourceManager *manager;
+} tile_decode_t;
+
+static GHashTable* _decode_table(MaepSourceManagerPrivate *priv,
+                                 const tile_decode_t *dec)
+{
+    return dec->depth ? priv->building : priv->decoding;
+}
+
+static void _tile_decode_free(tile_decode_t *dec)
+{
+    if (dec->surf)
+        cairo_surface_destroy(dec->surf);
+    g_object_unref(dec->manager);
+    maep_tile_store_unref(dec->store);
+    g_free(dec->suffix);
+    g_free(dec);
+}
+
+static gboolean _tile_decoded(gpointer data)
+{
+    tile_decode_t *dec = (tile_decode_t*)data;
+    MaepTile *tile;
+
+    g_hash_table_remove(_decode_table(dec->manager->priv, dec), &dec->key);
+
+    if (dec->depth) {
+        /* The real tile or another build may have been quicker, but
+           a tile upscaled from far parents is replaced. */
+        tile = maep_tile_cache_peek(dec->manager->priv->tiles, dec->key);
+        if (dec->surf && (!tile || tile->synthetic > 1)) {
+            tile = _cache_tile(dec->manager, dec->key, dec->surf, 1);
+            if (tile) {
+                maep_tile_unref(tile);
+                g_signal_emit(G_OBJECT(dec->manager), _signals[TILE_LOADED], 0, dec->key);
+            }
+            dec->surf = NULL;
+        }
+        _tile_decode_free(dec);
+        return FALSE;
+    }
+
+    /* A download may have been quicker. */
+    if (!_peek_loaded(dec->manager, dec->key)) {
+        tile = _cache_tile(dec->manager, dec->key, dec->surf, 0);
+        if (tile) {
+            maep_tile_unref(tile);
+            g_signal_emit(G_OBJECT(dec->manager), _signals[TILE_LOADED], 0, dec->key);
+        } else {
+            g_warning("cannot load tile %d/%d/%d from cache.",
+                      MAEP_TILE_KEY_ZOOM(dec->key), MAEP_TILE_KEY_X(dec->key),
+                      MAEP_TILE_KEY_Y(dec->key));
+            /* Download it again. */
+            maep_tile_store_forget(dec->store, MAEP_TILE_KEY_ZOOM(dec->key),
+                                   MAEP_TILE_KEY_X(dec->key), MAEP_TILE_KEY_Y(dec->key));
+        }
+        dec->surf = NULL;
+    }
+
+    _tile_decode_free(dec);
+    return FALSE;
+}
+
+/* Paste the children of a tile, decoded at the reduced scale of
+   their level, into a surface of the size of a tile. Children that
+   cannot be decoded are left transparent, as are the clear areas of
+   children with alpha. The tile only stands in for the real one, so
+   the children get a preview decode. */
+static cairo_surface_t* _tile_from_children(MaepTileStore *store, const char *suffix,
+                                            MaepTileKey key, int depth)
+{
+    cairo_surface_t *surf, **children;
+    cairo_format_t format;
+    cairo_t *cr;
+    int n, i, size;
+    gfloat scale;
+
+    n = 1 << depth;
+    scale = 1.f / n;
+    children = g_new0(cairo_surface_t*, n * n);
+    format = CAIRO_FORMAT_RGB24;
+    size = 0;
+    for (i = 0; i < n * n; i++) {
+        children[i] = _tile_from_store(store, suffix,
+                                       MAEP_TILE_KEY(MAEP_TILE_KEY_SOURCE(key),
+                                                     MAEP_TILE_KEY_ZOOM(key) + depth,
+                                                     MAEP_TILE_KEY_X(key) * n + i / n,
+                                                     MAEP_TILE_KEY_Y(key) * n + i % n),
+                                       scale, MAEP_LOADER_QUALITY_PREVIEW);
+        if (!children[i] ||
+            cairo_image_surface_get_format(children[i]) != CAIRO_FORMAT_RGB24)
+            format = CAIRO_FORMAT_ARGB32;
+        if (children[i])
+            size = cairo_image_surface_get_width(children[i]);
+    }
+
+    surf = NULL;
+    if (size) {
+        /* A new surface is cleared to transparent. */
+        surf = cairo_image_surface_create(format, size * n, size * n);
+        cr = cairo_create(surf);
+        cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+        for (i = 0; i < n * n; i++) {
+            if (!children[i])
+                continue;
+            cairo_set_source_surface(cr, children[i], (i / n) * size, (i % n) * size);
+            cairo_rectangle(cr, (i / n) * size, (i % n) * size, size, size);
+            cairo_fill(cr);
+        }
+        cairo_destroy(cr);
+    }
+    for (i = 0; i < n * n; i++)
+        if (children[i])
+            cairo_surface_destroy(children[i]);
+    g_free(children);
+
+    return surf;
+}
+
+/* Run in the decoder threads, each run picks the most urgent request. */
+static void _decode_tile(gpointer data, G_GNUC_UNUSED gpointer user_data)
+{
+    MaepSourceManagerPrivate *priv = ((MaepSourceManager*)data)->priv;
+    tile_decode_t *dec, *best;
+    guint i, ibest;
+
+    g_mutex_lock(&priv->decode_lock);
+    best = NULL;
+    ibest = 0;
+    for (i = 0; i < priv->decode_queue->len; i++) {
+        dec = g_ptr_array_index(priv->decode_queue, i);
+        if (!best || dec->request.priority < best->request.priority) {
+            best = dec;
+            ibest = i;
+        }
+    }
+    if (best) {
+        g_ptr_array_remove_index_fast(priv->decode_queue, ibest);
+        best->queued = FALSE;
+    }
+    g_mutex_unlock(&priv->decode_lock);
+
+    /* Cancelled request. */
+    if (!best)
+        return;
+
+    if (best->depth)
+        best->surf = _tile_from_children(best->store, best->suffix, best->key,
+                                         best->depth);
+    else
+        best->surf = _tile_from_store(best->store, best->suffix, best->key,
+                                      1.f, MAEP_LOADER_QUALITY_FULL);
+    g_idle_add(_tile_decoded, best);
+}
+
+static void _queue_decode(MaepSourceManager *manager, MaepTileKey key, int depth,
+                          MaepTileStore *store, const gchar *suffix,
+                          const MaepTileRequest *request)
+{
+    MaepSourceManagerPrivate *priv = manager->priv;
+    tile_decode_t *dec;
+
+    dec = g_hash_table_lookup(depth ? priv->building : priv->decoding, &key);
+    if (dec) {
+        g_mutex_lock(&priv->decode_lock);
+        if (dec->queued) {
+            dec->request.owner = request->owner;
+            dec->request.serial = request->serial;
+            dec->request.priority = request->priority;
+        }
+        g_mutex_unlock(&priv->decode_lock);
+        return;
+    }
+
+    dec = g_new0(tile_decode_t, 1);
+    dec->key = key;
+    dec->depth = depth;
+    dec->store = maep_tile_store_ref(store);
+    dec->suffix = g_strdup(suffix);
+    dec->request = *request;
+    dec->queued = TRUE;
+    dec->manager = g_object_ref(manager);
+    g_hash_table_insert(_decode_table(priv, dec), &dec->key, dec);
+
+    g_mutex_lock(&priv->decode_lock);
+    g_ptr_array_add(priv->decode_queue, dec);
+    g_mutex_unlock(&priv->decode_lock);
+    /* The pool task is only a wake up, the request is taken from the queue. */
+    g_thread_pool_push(priv->decoder, manager, NULL);
+}
+
+/* Decode the tile on disk now without request, or in the background. */
+static MaepTile* _load_tile(MaepSourceManager *manager, const MaepSource *source,
+                            MaepTileKey key, const MaepTileRequest *request)
+{
+    MaepTileStore *store;
+    MaepTile *tile;
+
+    store = _get_store(manager, source);
+    if (request) {
+        _queue_decode(manager, key, 0, store, source->image_suffix, request);
+        return NULL;
+    }
+
+    tile = _cache_tile(manager, key, _tile_from_store(store, source->image_suffix, key,
+                                                      1.f, MAEP_LOADER_QUALITY_FULL), 0);
+    if (!tile) {
+        g_warning("cannot load tile %d/%d/%d from cache.",
+                  MAEP_TILE_KEY_ZOOM(key), MAEP_TILE_KEY_X(key), MAEP_TILE_KEY_Y(key));
+        maep_tile_store_forget(store, MAEP_TILE_KEY_ZOOM(key),
+                               MAEP_TILE_KEY_X(key), MAEP_TILE_KEY_Y(key));
+    }
+
+    return tile;
+}
+
+/**
+ * maep_source_manager_cancel_requests:
+ * @manager: a #MaepSourceManager object.
+ * @request: the current request of an owner.
+ *
+ * Drop the queued decodings and downloads of @request owner that
+ * have not been asked again with the current serial. Decodings and
+ * downloads already running complete anyway.
+ */
+void maep_source_manager_cancel_requests(MaepSourceManager *manager,
+                                         const MaepTileRequest *request)
+{
+    MaepSourceManagerPrivate *priv;
+    tile_decode_t *dec;
+    guint i;
+
+    g_return_if_fail(MAEP_IS_SOURCE_MANAGER(manager));
+    g_return_if_fail(request);
+
+    priv = manager->priv;
+    g_mutex_lock(&priv->decode_lock);
+    for (i = priv->decode_queue->len; i > 0; i--) {
+        dec = g_ptr_array_index(priv->decode_queue, i - 1);
+        if (dec->request.owner == request->owner &&
+            dec->request.serial != request->serial) {
+            g_ptr_array_remove_index_fast(priv->decode_queue, i - 1);
+            g_hash_table_remove(_decode_table(priv, dec), &dec->key);
+            _tile_decode_free(dec);
+        }
+    }
+    g_mutex_unlock(&priv->decode_lock);
+
+    _cancel_downloads(manager, request);
+}
+
+/* Returns a new reference on the decoded tile, from memory or from the
+   disk cache, NULL if none. A download is queued if the tile is
+   missing or outdated. With a request, a tile not in memory is
+   decoded in the background and tile-loaded is emitted when ready. */
+MaepTile* maep_source_manager_get_tile(MaepSourceManager *manager,
+                                       const MaepSource *source,
+                                       int zoom, int x, int y,
+                                       const MaepTileRequest *request)
+{
+    MaepTileKey key;
+    MaepTile *tile;
+    gboolean cached;
+
+    g_return_val_if_fail(MAEP_IS_SOURCE_MANAGER(manager), NULL);
+    g_return_val_if_fail(source, NULL);
+
+    key = MAEP_TILE_KEY(source->id, zoom, x, y);
+    tile = maep_tile_cache_lookup(manager->priv->tiles, key);
+    if (tile && tile->synthetic)
+        tile = NULL;
+    /* Tiles in memory are only checked against the disk cache (and
+       possibly refreshed) once per cache period. Their pending
+       refresh is still kept in the request. */
+    if (tile && time(NULL) - tile->stamp <= (gint)source->cache_period) {
+        if (request)
+            _renew_download(manager, key, request);
+        return maep_tile_ref(tile);
+    }
+
+    cached = _get_tile_async(manager, source, zoom, x, y, request);
+    if (tile) {
+        if (!cached) {
+            maep_tile_cache_remove(manager->priv->tiles, key);
+            return NULL;
+        }
+        /* The memory version is the one from the disk, a fresher one
+           will replace it when downloaded. */
+        tile->stamp = time(NULL);
+        return maep_tile_ref(tile);
+    }
+    if (!cached)
+        return NULL;
+
+    return _load_tile(manager, source, key, request);
+}
+
+/**
+ * maep_source_manager_add_synthetic_tile:
+ * @manager: a #MaepSourceManager object.
+ * @source: a #MaepSource.
+ * @zoom: the zoom level.
+ * @x: the tile column.
+ * @y: the tile row.
+ * @surf: (transfer full): a surface standing for the tile.
+ * @levels: the number of zoom levels up to the parent @surf is
+ * upscaled from.
+ *
+ * Keep a provisional rendering of a missing tile in the tile cache,
+ * so it is not rendered again at each redraw. It is replaced when
+ * the real tile is loaded, or by a rendering from closer levels.
+ *
+ * Returns: (transfer full): the tile now in memory for these
+ * coordinates, NULL on error.
+ */
+MaepTile* maep_source_manager_add_synthetic_tile(MaepSourceManager *manager,
+                                                 const MaepSource *source,
+                                                 int zoom, int x, int y,
+                                                 cairo_surface_t *surf,
+                                                 guint levels)
+{
+    MaepTileKey key;
+    MaepTile *tile;
+
+    g_return_val_if_fail(MAEP_IS_SOURCE_MANAGER(manager), NULL);
+    g_return_val_if_fail(source, NULL);
+    g_return_val_if_fail(surf, NULL);
+    g_return_val_if_fail(levels > 0, NULL);
+
+    key = MAEP_TILE_KEY(source->id, zoom, x, y);
+    tile = maep_tile_cache_peek(manager->priv->tiles, key);
+    if (tile && tile->synthetic <= levels) {
+        cairo_surface_destroy(surf);
+        return maep_tile_ref(tile);
+    }
+
+    return _cache_tile(manager, key, surf, levels);
+}
+
+/* Like maep_source_manager_get_tile(), but never download and allow
+   outdated tiles following the cache policy of the source. */
+MaepTile* maep_source_manager_load_cached_tile(MaepSourceManager *manager,
+                                               const MaepSource *source,
+                                               int zoom, int x, int y,
+                                               const MaepTileRequest *request)
+{
+    MaepTileKey key;
+    MaepTile *tile;
+
+    g_return_val_if_fail(MAEP_IS_SOURCE_MANAGER(manager), NULL);
+    g_return_val_if_fail(source, NULL);
+
+    key = MAEP_TILE_KEY(source->id, zoom, x, y);
+    tile = maep_tile_cache_lookup(manager->priv->tiles, key);
+    if (tile && !tile->synthetic)
+        return maep_tile_ref(tile);
+
+    if (!maep_source_manager_has_cached_tile(manager, source, zoom, x, y))
+        return NULL;
+
+    return _load_tile(manager, source, key, request);
+}
+
+static gboolean _has_children(const MaepSourceManager *manager, const MaepSource *source,
+                              int zoom, int x, int y, int depth)
+{
+    int n, i, j;
+
+    if (zoom + depth > source->max_zoom)
+        return FALSE;
+
+    n = 1 << depth;
+    for (i = 0; i < n; i++)
+        for (j = 0; j < n; j++)
+            if (!maep_source_manager_has_cached_tile(manager, source, zoom + depth,
+                                                     x * n + i, y * n + j))
+                return FALSE;
+    return TRUE;
+}
+
+/**
+ * maep_source_manager_get_tile_from_children:
+ * @manager: a #MaepSourceManager object.
+ * @source: a #MaepSource.
+ * @zoom: the zoom level.
+ * @x: the tile column.
+ * @y: the tile row.
+ * @request: the request to build the tile with.
+ *
+ * Get a synthetic tile made of the children of a missing tile, which
+ * is what is on disk after browsing an area at a higher zoom level.
+ * The four children one level below are used, or the sixteen two
+ * levels below, decoded at half or quarter scale in the background.
+ * tile-loaded is emitted when ready, the synthetic tile is replaced
+ * when the real one is loaded.
+ *
+ * Returns: (transfer full): the tile if it is in memory already,
+ * real or made of its children, NULL otherwise.
+ */
+MaepTile* maep_source_manager_get_tile_from_children(MaepSourceManager *manager,
+                                                     const MaepSource *source,
+                                                     int zoom, int x, int y,
+                                                     const MaepTileRequest *request)
+{
+    MaepTileKey key;
+    MaepTile *tile;
+    int depth;
+
+    g_return_val_if_fail(MAEP_IS_SOURCE_MANAGER(manager), NULL);
+    g_return_val_if_fail(source, NULL);
+    g_return_val_if_fail(request, NULL);
+
+    key = MAEP_TILE_KEY(source->id, zoom, x, y);
+    tile = maep_tile_cache_lookup(manager->priv->tiles, key);
+    if (tile && tile->synthetic <= 1)
+        return maep_tile_ref(tile);
+
+    /* A queued build only gets its request updated. */
+    if (g_hash_table_contains(manager->priv->building, &key))
+        depth = 1;
+    else if (_has_children(manager, source, zoom, x, y, 1))
+        depth = 1;
+    else if (_has_children(manager, source, zoom, x, y, 2))
+        depth = 2;
+    else
+        return NULL;
+
+    _queue_decode(manager, key, depth, _get_store(manager, source),
+                  source->image_suffix, request);
+    return NULL;
+}
+
+/* Returns a new reference on the tile if it is in memory. */
+MaepTile* maep_source_manager_peek_tile(const MaepSourceManager *manager,
+                                        const MaepSource *source,
+                                        int zoom, int x, int y)
+{
+    MaepTile *tile;
+
+    g_return_val_if_fail(MAEP_IS_SOURCE_MANAGER(manager), NULL);
+    g_return_val_if_fail(source, NULL);
+
+    tile = maep_tile_cache_peek(manager->priv->tiles,
+                                MAEP_TILE_KEY(source->id, zoom, x, y));
+    return tile ? maep_tile_ref(tile) : NULL;
+}
+
+GType maep_source_get_type(void)
+{
+    static GType g_define_type_id = 0;
+
+    if (g_define_type_id == 0)
+        g_define_type_id = g_boxed_type_register_static("MaepSource",
+                                                        (GBoxedCopyFunc)_sourceRef,
+                                                        (GBoxedFreeFunc)_sourceFree);
+    return g_define_type_id;
+}
+
+guint maep_source_get_id(const MaepSource *source)
+{
+    g_return_val_if_fail(source, 0);
 
     return source->id;
 }
@@ -868,6 +2154,48 @@ gboolean maep_source_get_cache_policy(const MaepSource *source)
     return source->cache_policy;
 }
 
+MaepTileStoreKind maep_source_get_store(const MaepSource *source)
+{
+    g_return_val_if_fail(source, MAEP_TILE_STORE_DIRECTORY);
+
+    return source->store_kind;
+}
+
+guint maep_source_get_max_stale(const MaepSource *source)
+{
+    g_return_val_if_fail(source, 0);
+
+    return source->max_stale;
+}
+
+guint64 maep_source_get_quota(const MaepSource *source)
+{
+    g_return_val_if_fail(source, 0);
+
+    return source->quota;
+}
+
+guint maep_source_get_max_connections(const MaepSource *source)
+{
+    g_return_val_if_fail(source, 0);
+
+    return source->max_conns ? source->max_conns : SOURCE_CONNS;
+}
+
+/* Usage is only known after a first eviction pass. */
+void maep_source_get_cache_usage(const MaepSource *source, guint64 *usage,
+                                 guint64 *evicted_bytes, guint *evicted_tiles)
+{
+    g_return_if_fail(source);
+
+    if (usage)
+        *usage = source->usage;
+    if (evicted_bytes)
+        *evicted_bytes = source->evicted_bytes;
+    if (evicted_tiles)
+        *evicted_tiles = source->evicted_tiles;
+}
+
 static void map_convert_coords_to_quadtree_string(gint x, gint y, gint zoomlevel,
                                                   gchar *buffer, const gchar initial,
                                                   const gchar *const quadrant)
@@ -1037,12 +2365,14 @@ gchar* maep_source_get_tile_uri(const MaepSource *source,
             //                    zoom - (MAX_ZOOM - 17));
             break;
         case MAEP_SOURCE_HAS_R:
-            s = g_strdup_printf("%d", g_random_int_range(0,4));
+            /* Neighbouring tiles go to different servers, a tile
+               always to the same one, for the HTTP caches. */
+            s = g_strdup_printf("%d", (x + y) % 4);
             url = replace_string(url, URI_MARKER_R, s);
             //g_debug("FOUND " URI_MARKER_R);
             break;
         case MAEP_SOURCE_HAS_TR:
-            s = g_strdup_printf("%c", letters[g_random_int_range(0,3)]);
+            s = g_strdup_printf("%c", letters[(x + y) % 3]);
             url = replace_string(url, URI_MARKER_T, s);
             //g_debug("FOUND " URI_MARKER_R);
             break;
@@ -1065,6 +2395,7 @@ gchar* maep_source_get_tile_uri(const MaepSource *source,
 /* libsoup-2.2 and libsoup-2.4 use different ways to store the body data */
 #if USE_LIBSOUP22
 #define soup_message_headers_append(a,b,c) soup_message_add_header(a,b,c)
+#define soup_message_headers_get_one(a,b) soup_message_get_header(a,b)
 #define MSG_RESPONSE_BODY(a)    ((a)->response.body)
 #define MSG_RESPONSE_LEN(a)     ((a)->response.length)
 #define MSG_RESPONSE_LEN_FORMAT "%u"
@@ -1074,50 +2405,968 @@ gchar* maep_source_get_tile_uri(const MaepSource *source,
 #define MSG_RESPONSE_LEN_FORMAT G_GOFFSET_FORMAT
 #endif
 
+typedef struct {
+    gchar *name;
+    guint in_flight;
+    /* Consecutive failures, reset by any answer. */
+    guint failures;
+    /* No new attempt before, in monotonic time. */
+    gint64 retry_at;
+    guint retries, given_up;
+    /* Downloads allowed at once, base and smoothed latency in
+       microseconds, and when the window was last reduced. */
+    gfloat window;
+    gint64 base_rtt, srtt;
+    gint64 reduced_at;
+    /* Requests sent, and the ones on an already open connection. */
+    guint requests, reused;
+} download_host_t;
+
+static void _host_free(gpointer data)
+{
+    download_host_t *host = (download_host_t*)data;
+
+    g_free(host->name);
+    g_free(host);
+}
+
+static download_host_t* _get_host(MaepSourceManager *manager, const gchar *name)
+{
+    download_host_t *host;
+
+    host = g_hash_table_lookup(manager->priv->hosts, name ? name : "");
+    if (!host) {
+        host = g_new0(download_host_t, 1);
+        host->name = g_strdup(name ? name : "");
+        host->window = HOST_WINDOW_START;
+        g_hash_table_insert(manager->priv->hosts, host->name, host);
+    }
+    return host;
+}
+
+static gboolean _host_paused(const download_host_t *host)
+{
+    return host->failures >= BREAKER_FAILURES;
+}
+
+/* Server errors and network failures may be temporary, other answers
+   are final. */
+static gboolean _status_retryable(guint status)
+{
+    return (SOUP_STATUS_IS_TRANSPORT_ERROR(status) &&
+            status != SOUP_STATUS_CANCELLED) ||
+        status == SOUP_STATUS_REQUEST_TIMEOUT ||
+        status == 429 /* Too Many Requests */ ||
+        SOUP_STATUS_IS_SERVER_ERROR(status);
+}
+
+/* Delay in seconds asked by the server, 0 if none. */
+static gint64 _retry_after(SoupMessage *msg)
+{
+    const char *value;
+#if !USE_LIBSOUP22
+    SoupDate *date;
+#endif
+    gint64 delay;
+
+    value = soup_message_headers_get_one(msg->response_headers, "Retry-After");
+    if (!value)
+        return 0;
+    delay = 0;
+    if (g_ascii_isdigit(*value))
+        delay = g_ascii_strtoll(value, NULL, 10);
+#if !USE_LIBSOUP22
+    else if ((date = soup_date_new_from_string(value))) {
+        delay = soup_date_to_time_t(date) - time(NULL);
+        soup_date_free(date);
+    }
+#endif
+    return CLAMP(delay, 0, BREAKER_PAUSE);
+}
+
+/* Multiplicative decrease, at most once per round trip. */
+static void _host_reduce(download_host_t *host, gint64 now)
+{
+    if (now - host->reduced_at < host->srtt)
+        return;
+    host->window = MAX(host->window / 2.f, 1.f);
+    host->reduced_at = now;
+}
+
+static void _host_succeeded(download_host_t *host, gint64 latency)
+{
+    gint64 now;
+
+    host->failures = 0;
+    host->retry_at = 0;
+
+    /* The base latency follows slowly any lasting increase, after a
+       change of network for instance. */
+    if (!host->base_rtt || latency < host->base_rtt)
+        host->base_rtt = latency;
+    else
+        host->base_rtt += (latency - host->base_rtt) / 32;
+    host->srtt = host->srtt ? (7 * host->srtt + latency) / 8 : latency;
+
+    now = g_get_monotonic_time();
+    if (latency > HOST_LATENCY_FACTOR * host->base_rtt)
+        /* Requests are queuing somewhere, back off. */
+        _host_reduce(host, now);
+    else
+        /* Additive increase, one more per window of successes. */
+        host->window = MIN(host->window + 1.f / host->window, (gfloat)HOST_CONNS);
+}
+
+/* Back off exponentially with jitter, so that clients do not retry
+   all together. Failures of downloads sent before the backoff count
+   only once. */
+static void _host_failed(download_host_t *host, SoupMessage *msg)
+{
+    gint64 now, delay;
+
+    now = g_get_monotonic_time();
+    if (now >= host->retry_at)
+        host->failures += 1;
+    _host_reduce(host, now);
+
+    if (_host_paused(host)) {
+        delay = BREAKER_PAUSE * G_USEC_PER_SEC;
+        if (host->failures == BREAKER_FAILURES)
+            g_warning("Too many failures, pausing downloads from %s.", host->name);
+    } else {
+        delay = MIN((gint64)BACKOFF_BASE << (host->failures - 1), BACKOFF_MAX) * G_USEC_PER_SEC;
+        delay = delay / 2 + g_random_double() * (delay / 2);
+    }
+    delay = MAX(delay, _retry_after(msg) * G_USEC_PER_SEC);
+    host->retry_at = MAX(host->retry_at, now + delay);
+}
+
+/* After a failure, hosts are probed with a single download at a
+   time, until one succeeds. */
+static gboolean _host_ready(const download_host_t *host, gint64 now, gint64 *wake)
+{
+    if (host->retry_at > now) {
+        if (!*wake || host->retry_at < *wake)
+            *wake = host->retry_at;
+        return FALSE;
+    }
+    return !host->in_flight ||
+        (!host->failures && host->in_flight < (guint)host->window);
+}
+
+#if !USE_LIBSOUP22
+/* Count the requests sent on connections kept alive. */
+static void _request_started(SoupSession *session G_GNUC_UNUSED,
+                             SoupMessage *msg, SoupSocket *socket,
+                             MaepSourceManager *manager)
+{
+    download_host_t *host;
+    guint count;
+
+    host = _get_host(manager, soup_uri_get_host(soup_message_get_uri(msg)));
+    host->requests += 1;
+    count = GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(socket), "maep-requests"));
+    if (count)
+        host->reused += 1;
+    g_object_set_data(G_OBJECT(socket), "maep-requests", GUINT_TO_POINTER(count + 1));
+}
+#endif
+
 typedef struct {
     /* The details of the tile to download */
     char *uri;
-    char *filename;
+    MaepTileStore *store;
+    gchar *suffix;
+    MaepTileKey key;
     MaepSourceManager *manager;
+    /* Scheduling, the most urgent are sent first, in the order they
+       have been asked for equal priorities. */
+    SoupMessage *msg;
+    MaepTileRequest request;
+    guint seq;
+    gboolean queued;
+    download_host_t *host;
+    MaepSource *source;
+    guint retries;
+    gint64 sent_at;
 } tile_download_t;
 
+static void _tile_download_free(tile_download_t *dl)
+{
+    if (dl->source)
+        _sourceFree(dl->source);
+    if (dl->store)
+        maep_tile_store_unref(dl->store);
+    g_free(dl->suffix);
+    g_free(dl);
+}
+
+static gboolean _retry_downloads(gpointer data);
+
+static gint _cmp_download(const tile_download_t *a, const tile_download_t *b)
+{
+    if (a->request.priority != b->request.priority)
+        return (a->request.priority < b->request.priority) ? -1 : 1;
+    return (a->seq < b->seq) ? -1 : (a->seq > b->seq);
+}
+
+/* The queue is kept sorted, the most urgent first. This is the
+   position of dl in the queue, or where it goes. */
+static guint _queue_position(const GPtrArray *queue, const tile_download_t *dl)
+{
+    guint lo, hi, mid;
+
+    for (lo = 0, hi = queue->len; lo < hi; ) {
+        mid = lo + (hi - lo) / 2;
+        if (_cmp_download(g_ptr_array_index(queue, mid), dl) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void _queue_download(MaepSourceManager *manager, tile_download_t *dl)
+{
+    GPtrArray *queue = manager->priv->download_queue;
+
+    dl->queued = TRUE;
+    g_ptr_array_insert(queue, _queue_position(queue, dl), dl);
+}
+
+/* Give the most urgent queued downloads to the session, as long as
+   some slots are free and their host is not backing off. Sending
+   only makes the skipped ones wait longer, so one pass is enough. */
+static void _start_downloads(MaepSourceManager *manager)
+{
+    MaepSourceManagerPrivate *priv = manager->priv;
+    tile_download_t *dl;
+    guint i;
+    gint64 now, wake;
+
+    now = g_get_monotonic_time();
+    wake = 0;
+    for (i = 0; i < priv->download_queue->len && priv->n_in_flight < DOWNLOAD_SLOTS; ) {
+        dl = g_ptr_array_index(priv->download_queue, i);
+        if (dl->source->in_flight >=
+            (dl->source->max_conns ? dl->source->max_conns : SOURCE_CONNS) ||
+            !_host_ready(dl->host, now, &wake)) {
+            i += 1;
+            continue;
+        }
+        g_ptr_array_remove_index(priv->download_queue, i);
+        dl->queued = FALSE;
+        dl->host->in_flight += 1;
+        dl->source->in_flight += 1;
+        dl->sent_at = now;
+        priv->n_in_flight += 1;
+        /* The session takes the message over. */
+        soup_session_queue_message(priv->soup_session, dl->msg,
+                                   _tile_download_complete, dl);
+    }
+
+    if (wake && !priv->retry_id)
+        priv->retry_id = g_timeout_add((wake - now) / 1000 + 1,
+                                       _retry_downloads, manager);
+}
+
+static gboolean _retry_downloads(gpointer data)
+{
+    MaepSourceManager *manager = MAEP_SOURCE_MANAGER(data);
+
+    manager->priv->retry_id = 0;
+    _start_downloads(manager);
+    return FALSE;
+}
+
+static void _download_host_clear(gpointer data)
+{
+    g_free(((MaepDownloadHost*)data)->host);
+}
+
+/**
+ * maep_source_manager_get_download_hosts:
+ * @manager: a #MaepSourceManager object.
+ *
+ * Report the state of the tile servers contacted so far.
+ *
+ * Returns: (transfer full): a new array of #MaepDownloadHost.
+ */
+GArray* maep_source_manager_get_download_hosts(MaepSourceManager *manager)
+{
+    GArray *hosts;
+    GHashTableIter iter;
+    download_host_t *host;
+    MaepDownloadHost state;
+    gint64 now;
+
+    g_return_val_if_fail(MAEP_IS_SOURCE_MANAGER(manager), NULL);
+
+    hosts = g_array_new(FALSE, FALSE, sizeof(MaepDownloadHost));
+    g_array_set_clear_func(hosts, _download_host_clear);
+    now = g_get_monotonic_time();
+    g_hash_table_iter_init(&iter, manager->priv->hosts);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&host)) {
+        state.host = g_strdup(host->name);
+        state.in_flight = host->in_flight;
+        state.failures = host->failures;
+        state.paused = _host_paused(host);
+        state.retry_in = host->retry_at > now ?
+            (host->retry_at - now + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC : 0;
+        state.retries = host->retries;
+        state.given_up = host->given_up;
+        state.window = host->window;
+        state.latency = host->srtt / 1000;
+        state.requests = host->requests;
+        state.reused = host->reused;
+        g_array_append_val(hosts, state);
+    }
+    return hosts;
+}
+
+static void _drop_download(MaepSourceManager *manager, tile_download_t *dl)
+{
+    g_hash_table_remove(manager->priv->downloads, &dl->key);
+    g_object_unref(dl->msg);
+    g_free(dl->uri);
+    _tile_download_free(dl);
+}
+
+/* A download still waiting for its slot takes the new request. */
+static void _renew_download(MaepSourceManager *manager, MaepTileKey key,
+                            const MaepTileRequest *request)
+{
+    GPtrArray *queue = manager->priv->download_queue;
+    tile_download_t *dl;
+
+    dl = g_hash_table_lookup(manager->priv->downloads, &key);
+    /* Another owner only takes over a more urgent download, so
+       background requests do not delay nor cancel the ones of maps. */
+    if (dl && dl->queued && request &&
+        (dl->request.owner == request->owner ||
+         request->priority < dl->request.priority)) {
+        g_ptr_array_remove_index(queue, _queue_position(queue, dl));
+        dl->request = *request;
+        _queue_download(manager, dl);
+    } else if (dl && request && request->priority < dl->request.priority)
+        /* Sent already, but now wanted by a map, so decoded once
+           received. */
+        dl->request.priority = request->priority;
+}
+
+static void _cancel_downloads(MaepSourceManager *manager,
+                              const MaepTileRequest *request)
+{
+    MaepSourceManagerPrivate *priv = manager->priv;
+    tile_download_t *dl;
+    guint i;
+
+    for (i = priv->download_queue->len; i > 0; i--) {
+        dl = g_ptr_array_index(priv->download_queue, i - 1);
+        if (dl->request.owner == request->owner &&
+            dl->request.serial != request->serial) {
+            g_ptr_array_remove_index(priv->download_queue, i - 1);
+            g_signal_emit(G_OBJECT(manager), _signals[TILE_DOWNLOADED], 0,
+                          dl->key, SOUP_STATUS_CANCELLED, 0ul);
+            _drop_download(manager, dl);
+        }
+    }
+}
+
+static void _clear_downloads(MaepSourceManager *manager)
+{
+    MaepSourceManagerPrivate *priv = manager->priv;
+    guint i;
+
+    for (i = 0; i < priv->download_queue->len; i++)
+        _drop_download(manager, g_ptr_array_index(priv->download_queue, i));
+    g_ptr_array_set_size(priv->download_queue, 0);
+}
+
+/* The validators of a tile are stored with it, as the corresponding
+   response headers, to revalidate it when outdated. */
+static gchar* _tile_meta_new(SoupMessage *msg)
+{
+    const char *etag, *modified;
+    GString *meta;
+
+    etag = soup_message_headers_get_one(msg->response_headers, "ETag");
+    modified = soup_message_headers_get_one(msg->response_headers, "Last-Modified");
+    if (!etag && !modified)
+        return NULL;
+
+    meta = g_string_new(NULL);
+    if (etag)
+        g_string_append_printf(meta, "ETag: %s\n", etag);
+    if (modified)
+        g_string_append_printf(meta, "Last-Modified: %s\n", modified);
+    return g_string_free(meta, FALSE);
+}
+
+/* Make the request conditional when a previous version of the tile
+   is on disk. */
+static void _tile_meta_apply(MaepTileStore *store, MaepTileKey key, SoupMessage *msg)
+{
+    gchar *meta, **lines, **line;
+
+    meta = maep_tile_store_get_meta(store, MAEP_TILE_KEY_ZOOM(key),
+                                    MAEP_TILE_KEY_X(key), MAEP_TILE_KEY_Y(key));
+    if (!meta)
+        return;
+
+    lines = g_strsplit(meta, "\n", -1);
+    for (line = lines; *line; line++) {
+        if (g_str_has_prefix(*line, "ETag: "))
+            soup_message_headers_append(msg->request_headers, "If-None-Match",
+                                        *line + strlen("ETag: "));
+        else if (g_str_has_prefix(*line, "Last-Modified: "))
+            soup_message_headers_append(msg->request_headers, "If-Modified-Since",
+                                        *line + strlen("Last-Modified: "));
+    }
+    g_strfreev(lines);
+    g_free(meta);
+}
+
+typedef struct {
+    /* The tile to write on disk, or only to mark as fresh when
+       data is NULL, or all the tiles to remove from the store */
+    MaepTileStore *store;
+    gchar *suffix;
+    gchar *data;
+    gsize len;
+    gchar *meta;
+    MaepTileKey key;
+    gboolean clear;
+    gboolean saved;
+    /* Wanted by a map, but not decoded from the body */
+    gboolean decode;
+    MaepSourceManager *manager;
+} tile_write_t;
+
+static gboolean _tile_written(gpointer data)
+{
+    tile_write_t *wr = (tile_write_t*)data;
+    gchar *filename;
+
+    if (wr->saved) {
+        /* The body could not be decoded from memory, try again from disk. */
+        if (wr->decode && !_peek_loaded(wr->manager, wr->key)) {
+            MaepTileRequest request = {NULL, 0, 0};
+            _queue_decode(wr->manager, wr->key, 0, wr->store, wr->suffix, &request);
+        }
+        filename = maep_tile_store_get_filename(wr->store, MAEP_TILE_KEY_ZOOM(wr->key),
+                                                MAEP_TILE_KEY_X(wr->key),
+                                                MAEP_TILE_KEY_Y(wr->key));
+        g_signal_emit(G_OBJECT(wr->manager), _signals[TILE_SAVED], 0,
+                      wr->key, filename);
+        g_free(filename);
+
+        wr->manager->priv->written += wr->len;
+        if (wr->manager->priv->written >= EVICT_SLACK && _has_quota(wr->manager))
+            _schedule_eviction(wr->manager);
+    }
+
+    g_object_unref(wr->manager);
+    maep_tile_store_unref(wr->store);
+    g_free(wr->suffix);
+    g_free(wr->meta);
+    g_free(wr);
+    return FALSE;
+}
+
+/* Run in the writer thread. */
+static void _write_tile(gpointer data, G_GNUC_UNUSED gpointer user_data)
+{
+    tile_write_t *wr = (tile_write_t*)data;
+    int zoom, x, y;
+    GError *error;
+
+    zoom = MAEP_TILE_KEY_ZOOM(wr->key);
+    x = MAEP_TILE_KEY_X(wr->key);
+    y = MAEP_TILE_KEY_Y(wr->key);
+    if (wr->clear) {
+        maep_tile_store_clear(wr->store);
+    } else if (!wr->data) {
+        /* Not modified on the server, only renew the age of the tile. */
+        if (!maep_tile_store_touch(wr->store, zoom, x, y))
+            g_warning("Cannot update time of tile %d/%d/%d", zoom, x, y);
+    } else {
+        error = NULL;
+        wr->saved = maep_tile_store_write(wr->store, zoom, x, y,
+                                          wr->data, wr->len, wr->meta, 0, &error);
+        if (error) {
+            g_warning("%s", error->message);
+            g_error_free(error);
+        } else
+            g_debug("Wrote %"G_GSIZE_FORMAT" bytes for tile %d/%d/%d",
+                    wr->len, zoom, x, y);
+        g_free(wr->data);
+        wr->data = NULL;
+    }
+
+    g_idle_add(_tile_written, wr);
+}
+
+typedef struct {
+    /* A store being converted to another kind */
+    MaepSourceManager *manager;
+    guint id;
+    MaepTileStore *from, *to;
+    guint n;
+} store_migrate_t;
+
+static gboolean _store_migrated(gpointer data)
+{
+    store_migrate_t *mig = (store_migrate_t*)data;
+    MaepSourceManagerPrivate *priv = mig->manager->priv;
+    MaepSource *source;
+    tile_write_t *wr;
+
+    source = g_hash_table_lookup(priv->sourcesById, GINT_TO_POINTER(mig->id));
+    /* The source may have been removed, or the cache dir changed. */
+    if (source && source->migrating &&
+        g_hash_table_lookup(priv->stores, GINT_TO_POINTER(mig->id)) == mig->from) {
+        g_debug("Moved %d tiles of %s.", mig->n, source->name);
+        source->store_kind = maep_tile_store_get_kind(mig->to);
+        g_hash_table_insert(priv->stores, GINT_TO_POINTER(mig->id),
+                            maep_tile_store_ref(mig->to));
+
+        /* Behind the pending writes to the old store. */
+        wr = g_new0(tile_write_t, 1);
+        wr->store = maep_tile_store_ref(mig->from);
+        wr->clear = TRUE;
+        wr->manager = g_object_ref(mig->manager);
+        g_thread_pool_push(priv->writer, wr, NULL);
+    }
+    if (source)
+        source->migrating = FALSE;
+
+    maep_tile_store_unref(mig->from);
+    maep_tile_store_unref(mig->to);
+    g_object_unref(mig->manager);
+    g_free(mig);
+    return FALSE;
+}
+
+static gpointer _migrate_store(gpointer data)
+{
+    store_migrate_t *mig = (store_migrate_t*)data;
+
+    mig->n = maep_tile_store_copy(mig->to, mig->from);
+    g_idle_add(_store_migrated, mig);
+    return NULL;
+}
+
+/**
+ * maep_source_manager_set_store:
+ * @manager: a #MaepSourceManager object.
+ * @source: a source of @manager.
+ * @kind: how to keep the tiles on disk.
+ *
+ * Change the way the tiles of @source are kept on disk. The tiles
+ * already on disk are moved in the background, the previous store
+ * stays in use until they are all moved. Without any tile on disk,
+ * the change is immediate.
+ */
+void maep_source_manager_set_store(MaepSourceManager *manager,
+                                   const MaepSource *source,
+                                   MaepTileStoreKind kind)
+{
+    MaepSource *src;
+    MaepTileStore *store;
+    store_migrate_t *mig;
+    gchar *cache_dir;
+    GThread *thread;
+
+    g_return_if_fail(MAEP_IS_SOURCE_MANAGER(manager));
+    g_return_if_fail(source);
+
+    src = g_hash_table_lookup(manager->priv->sources, source->name);
+    g_return_if_fail(src == source);
+
+    if (src->store_kind == kind || src->migrating)
+        return;
+
+    store = _get_store(manager, src);
+    cache_dir = _get_cache_dir(manager, src);
+    if (!store || !cache_dir || maep_tile_store_is_empty(store)) {
+        g_free(cache_dir);
+        src->store_kind = kind;
+        g_hash_table_remove(manager->priv->stores, GINT_TO_POINTER(src->id));
+        return;
+    }
+
+    mig = g_new0(store_migrate_t, 1);
+    mig->manager = g_object_ref(manager);
+    mig->id = src->id;
+    mig->from = maep_tile_store_ref(store);
+    mig->to = maep_tile_store_new(kind, cache_dir, src->image_suffix);
+    g_free(cache_dir);
+    src->migrating = TRUE;
+
+    thread = g_thread_new("tile store migration", _migrate_store, mig);
+    g_thread_unref(thread);
+}
+
+typedef struct {
+    /* The tiles of a source considered for eviction */
+    guint id;
+    MaepTileStore *store;
+    guint64 quota;
+    GArray *runs;   /* protected, as evict_run_t sorted by row */
+    GArray *tiles;
+    GArray *victims;
+    guint64 usage, freed;
+} source_evict_t;
+
+typedef struct {
+    MaepTileStoreEntry *tile;
+    source_evict_t *src;
+} evict_candidate_t;
+
+typedef struct {
+    MaepTileKey row;
+    int x0, x1;
+} evict_run_t;
+
+typedef struct {
+    /* An eviction pass over all sources */
+    MaepSourceManager *manager;
+    guint64 quota;
+    GPtrArray *sources;
+} cache_evict_t;
+
+static void _source_evict_free(source_evict_t *src)
+{
+    maep_tile_store_unref(src->store);
+    g_array_free(src->runs, TRUE);
+    if (src->tiles)
+        g_array_free(src->tiles, TRUE);
+    if (src->victims)
+        g_array_free(src->victims, TRUE);
+    g_free(src);
+}
+
+static gint _cmp_row(gconstpointer a, gconstpointer b)
+{
+    MaepTileKey ra = ((const evict_run_t*)a)->row;
+    MaepTileKey rb = ((const evict_run_t*)b)->row;
+
+    return (ra < rb) ? -1 : (ra > rb);
+}
+
+/* The protected runs of a source, for the evictor thread. */
+static GArray* _protected_runs(const MaepSource *source)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GArray *runs, *row;
+    evict_run_t run;
+    guint i;
+
+    runs = g_array_new(FALSE, FALSE, sizeof(evict_run_t));
+    g_hash_table_iter_init(&iter, source->protected_rows);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        row = (GArray*)value;
+        run.row = *(MaepTileKey*)key;
+        for (i = 0; i < row->len; i++) {
+            run.x0 = g_array_index(row, protected_run_t, i).x0;
+            run.x1 = g_array_index(row, protected_run_t, i).x1;
+            g_array_append_val(runs, run);
+        }
+    }
+    g_array_sort(runs, _cmp_row);
+    return runs;
+}
+
+static gboolean _tile_protected(const source_evict_t *src, const MaepTileStoreEntry *tile)
+{
+    const evict_run_t *run;
+    MaepTileKey row;
+    guint lo, hi, mid;
+
+    /* First run of the row of tile. */
+    row = _row_key(tile->zoom, tile->y);
+    for (lo = 0, hi = src->runs->len; lo < hi; ) {
+        mid = lo + (hi - lo) / 2;
+        if (g_array_index(src->runs, evict_run_t, mid).row < row)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < src->runs->len; lo++) {
+        run = &g_array_index(src->runs, evict_run_t, lo);
+        if (run->row != row)
+            break;
+        if (tile->x >= run->x0 && tile->x <= run->x1)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static gint _cmp_atime(gconstpointer a, gconstpointer b)
+{
+    guint32 ta = ((const evict_candidate_t*)a)->tile->atime;
+    guint32 tb = ((const evict_candidate_t*)b)->tile->atime;
+
+    return (ta < tb) ? -1 : (ta > tb);
+}
+
+static gboolean _over_quota(const cache_evict_t *evict, guint64 total, guint n_over)
+{
+    return (evict->quota && total > evict->quota) || n_over > 0;
+}
+
+static gboolean _tiles_evicted(gpointer data)
+{
+    cache_evict_t *evict = (cache_evict_t*)data;
+    MaepSourceManagerPrivate *priv = evict->manager->priv;
+    source_evict_t *src;
+    MaepSource *source;
+    guint i;
+
+    for (i = 0; i < evict->sources->len; i++) {
+        src = g_ptr_array_index(evict->sources, i);
+        source = g_hash_table_lookup(priv->sourcesById, GINT_TO_POINTER(src->id));
+        /* The store may have changed meanwhile. */
+        if (!source || g_hash_table_lookup(priv->stores, GINT_TO_POINTER(src->id)) != src->store)
+            continue;
+        source->usage = src->usage;
+        source->evicted_bytes += src->freed;
+        source->evicted_tiles += src->victims->len;
+        g_signal_emit(G_OBJECT(evict->manager), _signals[CACHE_USAGE_CHANGED], 0, src->id);
+    }
+
+    priv->evicting = FALSE;
+    if (priv->evict_again) {
+        priv->evict_again = FALSE;
+        _schedule_eviction(evict->manager);
+    }
+
+    g_ptr_array_free(evict->sources, TRUE);
+    g_object_unref(evict->manager);
+    g_free(evict);
+    return FALSE;
+}
+
+/* Run in the evictor thread. The least recently used tiles out of
+   protected areas are removed, until each source fits its quota and
+   all sources fit the global one. */
+static void _evict_tiles(gpointer data, G_GNUC_UNUSED gpointer user_data)
+{
+    cache_evict_t *evict = (cache_evict_t*)data;
+    source_evict_t *src;
+    GArray *candidates;
+    evict_candidate_t cand;
+    guint64 total;
+    guint i, j, n_over;
+
+    candidates = g_array_new(FALSE, FALSE, sizeof(evict_candidate_t));
+    total = 0;
+    n_over = 0;
+    for (i = 0; i < evict->sources->len; i++) {
+        src = g_ptr_array_index(evict->sources, i);
+        src->tiles = maep_tile_store_list(src->store);
+        src->victims = g_array_new(FALSE, FALSE, sizeof(MaepTileStoreEntry));
+        for (j = 0; j < src->tiles->len; j++) {
+            cand.tile = &g_array_index(src->tiles, MaepTileStoreEntry, j);
+            cand.src = src;
+            src->usage += cand.tile->size;
+            if (!_tile_protected(src, cand.tile))
+                g_array_append_val(candidates, cand);
+        }
+        total += src->usage;
+        if (src->quota && src->usage > src->quota)
+            n_over += 1;
+    }
+
+    if (_over_quota(evict, total, n_over)) {
+        g_array_sort(candidates, _cmp_atime);
+        for (i = 0; i < candidates->len && _over_quota(evict, total, n_over); i++) {
+            cand = g_array_index(candidates, evict_candidate_t, i);
+            src = cand.src;
+            /* Only the global quota may require to evict this one. */
+            if (!(evict->quota && total > evict->quota) &&
+                !(src->quota && src->usage > src->quota))
+                continue;
+            g_array_append_val(src->victims, *cand.tile);
+            if (src->quota && src->usage > src->quota &&
+                src->usage - cand.tile->size <= src->quota)
+                n_over -= 1;
+            src->usage -= cand.tile->size;
+            total -= cand.tile->size;
+        }
+    }
+    g_array_free(candidates, TRUE);
+
+    /* Packs may also be compacted without victims. */
+    for (i = 0; i < evict->sources->len; i++) {
+        src = g_ptr_array_index(evict->sources, i);
+        src->freed = maep_tile_store_evict(src->store,
+                                           (const MaepTileStoreEntry*)src->victims->data,
+                                           src->victims->len);
+        if (src->victims->len)
+            g_debug("Evicted %d tiles (%"G_GUINT64_FORMAT" bytes) of source %d.",
+                    src->victims->len, src->freed, src->id);
+    }
+
+    g_idle_add(_tiles_evicted, evict);
+}
+
+static gboolean _start_eviction(gpointer data)
+{
+    MaepSourceManager *manager = (MaepSourceManager*)data;
+    MaepSourceManagerPrivate *priv = manager->priv;
+    GHashTableIter iter;
+    MaepSource *source;
+    MaepTileStore *store;
+    cache_evict_t *evict;
+    source_evict_t *src;
+
+    priv->evict_id = 0;
+
+    evict = g_new0(cache_evict_t, 1);
+    evict->manager = g_object_ref(manager);
+    evict->quota = priv->cache_quota;
+    evict->sources = g_ptr_array_new_with_free_func((GDestroyNotify)_source_evict_free);
+    g_hash_table_iter_init(&iter, priv->sourcesById);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&source)) {
+        /* Tiles are being moved to another store. */
+        if (source->migrating)
+            continue;
+        /* Packs are only read on first use, in the evictor thread
+           for the ones not used yet. */
+        store = _get_store(manager, source);
+        if (!store)
+            continue;
+        src = g_new0(source_evict_t, 1);
+        src->id = source->id;
+        src->store = maep_tile_store_ref(store);
+        src->quota = source->quota;
+        src->runs = _protected_runs(source);
+        g_ptr_array_add(evict->sources, src);
+    }
+
+    priv->evicting = TRUE;
+    priv->written = 0;
+    g_thread_pool_push(priv->evictor, evict, NULL);
+    return FALSE;
+}
+
+/* Without any quota, written tiles do not start a pass, only the
+   changes of settings do, to update the usage. */
+static gboolean _has_quota(const MaepSourceManager *manager)
+{
+    GHashTableIter iter;
+    MaepSource *source;
+
+    if (manager->priv->cache_quota)
+        return TRUE;
+    g_hash_table_iter_init(&iter, manager->priv->sourcesById);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&source))
+        if (source->quota)
+            return TRUE;
+    return FALSE;
+}
+
+/* Passes are delayed, so changes in a row make only one. */
+static void _schedule_eviction(MaepSourceManager *manager)
+{
+    MaepSourceManagerPrivate *priv = manager->priv;
+
+    if (priv->evicting)
+        priv->evict_again = TRUE;
+    else if (!priv->evict_id)
+        priv->evict_id = g_timeout_add_seconds(EVICT_DELAY, _start_eviction, manager);
+}
+
 #if USE_LIBSOUP22
 static void _tile_download_complete(SoupMessage *msg, gpointer user_data)
 #else
 static void _tile_download_complete(SoupSession *session, SoupMessage *msg, gpointer user_data)
 #endif
 {
-    FILE *file;
     tile_download_t *dl = (tile_download_t *)user_data;
+    MaepSourceManager *manager = dl->manager;
+    MaepTileKey key = dl->key;
+    gboolean over = TRUE;
+    gboolean decode;
+    gchar *filename;
+    MaepTile *tile;
+
+    if (msg->status_code == SOUP_STATUS_CANCELLED) {
+        /* Application exiting, nothing is sent anymore. */
+        manager->priv->n_in_flight -= 1;
+        dl->host->in_flight -= 1;
+        dl->source->in_flight -= 1;
+        g_hash_table_remove(manager->priv->downloads, &dl->key);
+        g_free(dl->uri);
+        _tile_download_free(dl);
+        return;
+    }
+
+    /* The slot is free for the next one. */
+    manager->priv->n_in_flight -= 1;
+    dl->host->in_flight -= 1;
+    dl->source->in_flight -= 1;
+    if (!_status_retryable(msg->status_code))
+        _host_succeeded(dl->host, g_get_monotonic_time() - dl->sent_at);
 
     if (SOUP_STATUS_IS_SUCCESSFUL (msg->status_code)) {
+        /* decode directly from the body, the disk is only written
+           afterwards. Background downloads are only written, they
+           are decoded from disk once shown. */
+        decode = (dl->request.priority != MAEP_TILE_PRIORITY_BACKGROUND || !dl->store);
+        tile = !decode ? NULL :
+            _cache_tile(dl->manager, dl->key,
+                        _tile_from_mem(dl->suffix, (const unsigned char*)MSG_RESPONSE_BODY(msg),
+                                       MSG_RESPONSE_LEN(msg),
+                                       1.f, MAEP_LOADER_QUALITY_FULL), 0);
+        if (tile) {
+            maep_tile_unref(tile);
+            g_signal_emit(G_OBJECT(dl->manager), _signals[TILE_LOADED], 0, dl->key);
+        }
+        filename = dl->store ?
+            maep_tile_store_get_filename(dl->store, MAEP_TILE_KEY_ZOOM(dl->key),
+                                         MAEP_TILE_KEY_X(dl->key),
+                                         MAEP_TILE_KEY_Y(dl->key)) : NULL;
+        g_signal_emit(G_OBJECT(dl->manager), _signals[TILE_RECEIVED], 0,
+                      dl->key, filename,
+                      MSG_RESPONSE_BODY(msg), (gulong)MSG_RESPONSE_LEN(msg));
+        g_free(filename);
+
         /* save tile into cachedir if one has been specified */
-        if (g_path_is_absolute(dl->filename)) {
-            gchar *folder;
-            folder = g_path_get_dirname(dl->filename);
-            if (g_mkdir_with_parents(folder,0700) == 0) {
-                file = g_fopen(dl->filename, "wb");
-                if (file != NULL) {
-                    fwrite (MSG_RESPONSE_BODY(msg), 1, MSG_RESPONSE_LEN(msg), file);
-                    g_debug("Wrote %"MSG_RESPONSE_LEN_FORMAT" bytes to %s", MSG_RESPONSE_LEN(msg), dl->filename);
-                    fclose (file);
-                    g_signal_emit(G_OBJECT(dl->manager), _signals[TILE_SAVED], 0, dl->filename);
-                }
-            } else {
-                g_warning("Error creating tile download directory: %s", folder);
-                perror("perror:");
-            }
-            g_free(folder);
-        } else {
-            g_signal_emit(G_OBJECT(dl->manager), _signals[TILE_RECEIVED], 0, dl->filename,
-                          MSG_RESPONSE_BODY(msg), MSG_RESPONSE_LEN(msg));
+        if (dl->store) {
+            tile_write_t *wr = g_new0(tile_write_t, 1);
+            wr->store = maep_tile_store_ref(dl->store);
+            wr->suffix = g_strdup(dl->suffix);
+            wr->data = g_memdup(MSG_RESPONSE_BODY(msg), MSG_RESPONSE_LEN(msg));
+            wr->len = MSG_RESPONSE_LEN(msg);
+            wr->meta = _tile_meta_new(msg);
+            wr->key = dl->key;
+            wr->decode = decode && !tile;
+            wr->manager = g_object_ref(dl->manager);
+            g_thread_pool_push(dl->manager->priv->writer, wr, NULL);
         }
 
-        g_hash_table_remove(dl->manager->priv->tile_queue, dl->uri);
+        g_hash_table_remove(dl->manager->priv->downloads, &dl->key);
+
+        g_free(dl->uri);
+        _tile_download_free(dl);
+    }
+    else if (msg->status_code == SOUP_STATUS_NOT_MODIFIED && dl->store)
+    {
+        /* The tile on disk, and possibly in memory, is still valid. */
+        tile_write_t *wr = g_new0(tile_write_t, 1);
+        wr->store = maep_tile_store_ref(dl->store);
+        wr->key = dl->key;
+        wr->manager = g_object_ref(dl->manager);
+        g_thread_pool_push(dl->manager->priv->writer, wr, NULL);
+
+        g_hash_table_remove(dl->manager->priv->downloads, &dl->key);
 
         g_free(dl->uri);
-        g_free(dl->filename);
-        g_free(dl);
+        _tile_download_free(dl);
     }
     else
     {
@@ -1125,38 +3374,69 @@ static void _tile_download_complete(SoupSession *session, SoupMessage *msg, gpoi
                   msg->status_code, msg->reason_phrase, dl->uri);
         if (msg->status_code == SOUP_STATUS_NOT_FOUND)
         {
-            g_hash_table_add(dl->manager->priv->missing_tiles, dl->uri);
-            g_hash_table_remove(dl->manager->priv->tile_queue, dl->uri);
-            g_free(dl->filename);
-            g_free(dl);
-        }
-        else if (msg->status_code == SOUP_STATUS_CANCELLED)
-        {
-            ;//application exiting
+            _tile_missing(manager, dl->key);
+            g_hash_table_remove(dl->manager->priv->downloads, &dl->key);
+            g_free(dl->uri);
+            _tile_download_free(dl);
         }
-        else if (msg->status_code == SOUP_STATUS_CANT_RESOLVE)
+        else if (_status_retryable(msg->status_code) &&
+                 dl->retries < BACKOFF_RETRIES)
         {
-            ; /* No network... */
+            /* Queued again, to be sent once the host backoff is over. */
+            _host_failed(dl->host, msg);
+            dl->host->retries += 1;
+            dl->retries += 1;
+            dl->msg = g_object_ref(msg);
+            _queue_download(manager, dl);
+            over = FALSE;
         }
         else
         {
-            g_warning("Download status %d, requeueing.", msg->status_code);
-#if USE_LIBSOUP22
-            soup_session_requeue_message(dl->manager->priv->soup_session, msg);
-#else
-            soup_session_requeue_message(session, msg);
-#endif
-            return;
+            /* Given up, a later request will try again. */
+            if (_status_retryable(msg->status_code))
+                _host_failed(dl->host, msg);
+            dl->host->given_up += 1;
+            g_hash_table_remove(dl->manager->priv->downloads, &dl->key);
+            g_free(dl->uri);
+            _tile_download_free(dl);
         }
     }
+
+    if (over)
+        g_signal_emit(G_OBJECT(manager), _signals[TILE_DOWNLOADED], 0, key,
+                      msg->status_code,
+                      SOUP_STATUS_IS_SUCCESSFUL(msg->status_code) ?
+                      (gulong)MSG_RESPONSE_LEN(msg) : 0ul);
+    _start_downloads(manager);
 }
 
-static void _download_tile(MaepSourceManager *manager,
-                           const MaepSource *source,
-                           int zoom, int x, int y)
+/* Queue the download of a tile, on behalf of @request if any. The
+   queue is served by priority, requests not renewed by their owner
+   are dropped by maep_source_manager_cancel_requests(). */
+static gboolean _download_tile(MaepSourceManager *manager,
+                               const MaepSource *source,
+                               int zoom, int x, int y,
+                               const MaepTileRequest *request)
 {
     SoupMessage *msg;
-    tile_download_t *dl = g_new0(tile_download_t,1);
+    MaepTileKey key;
+    tile_download_t *dl;
+
+    //check the tile has not already been queued for download
+    key = MAEP_TILE_KEY(maep_source_get_id(source), zoom, x, y);
+    if (g_hash_table_contains(manager->priv->downloads, &key)) {
+        g_debug("Tile already downloading");
+        _renew_download(manager, key, request);
+        return TRUE;
+    }
+
+    //or has been attempted, and its missing
+    if (maep_tile_missing_contains(_get_missing(manager, source), key)) {
+        g_debug("Tile missing");
+        return FALSE;
+    }
+
+    dl = g_new0(tile_download_t,1);
 
     //calculate the uri to download
     dl->uri = maep_source_get_tile_uri(source, zoom, x, y);
@@ -1166,27 +3446,22 @@ static void _download_tile(MaepSourceManager *manager,
     dl->session = priv->soup_session;
 #endif
 
-    //check the tile has not already been queued for download,
-    //or has been attempted, and its missing
-    if (g_hash_table_contains(manager->priv->tile_queue, dl->uri) ||
-        g_hash_table_contains(manager->priv->missing_tiles, dl->uri)) {
-        g_debug("Tile already downloading (or missing)");
-        g_free(dl->uri);
-        g_free(dl);
-        return;
-    }
-
-    dl->filename = _get_tile_id(manager, source, zoom, x, y);
+    dl->store = _get_store(manager, source);
+    if (dl->store)
+        maep_tile_store_ref(dl->store);
+    dl->suffix = g_strdup(source->image_suffix);
+    dl->key = key;
     dl->manager = manager;
+    dl->source = _sourceRef((MaepSource*)source);
 
-    /* g_message("Download tile: %d,%d z:%d\n\t%s --> %s", x, y, zoom, dl->uri, dl->filename); */
+    /* g_message("Download tile: %d,%d z:%d\n\t%s", x, y, zoom, dl->uri); */
 
     msg = soup_message_new (SOUP_METHOD_GET, dl->uri);
     if (!msg) {
         g_warning("Could not create soup message");
         g_free(dl->uri);
-        g_free(dl->filename);
-        g_free(dl);
+        _tile_download_free(dl);
+        return FALSE;
     }
 
     if (maep_source_get_uri_format(source) & MAEP_SOURCE_HAS_GOOGLE_DOMAIN) {
@@ -1207,7 +3482,18 @@ static void _download_tile(MaepSourceManager *manager,
     soup_message_headers_append(msg->request_headers, "User-Agent", USER_AGENT);
 #endif
 
-    g_hash_table_insert (manager->priv->tile_queue, dl->uri, msg);
-    soup_session_queue_message (manager->priv->soup_session, msg,
-                                _tile_download_complete, dl);
+    if (dl->store)
+        _tile_meta_apply(dl->store, dl->key, msg);
+
+    dl->msg = msg;
+    dl->host = _get_host(manager, soup_uri_get_host(soup_message_get_uri(msg)));
+    if (request)
+        dl->request = *request;
+    else
+        dl->request.priority = MAEP_TILE_PRIORITY_BACKGROUND;
+    dl->seq = manager->priv->download_seq++;
+    g_hash_table_insert (manager->priv->downloads, &dl->key, dl);
+    _queue_download(manager, dl);
+    _start_downloads(manager);
+    return TRUE;
 }
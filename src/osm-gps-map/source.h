@@ -25,6 +25,11 @@
 #define SOURCE_H
 
 #include <glib-object.h>
+#include <cairo.h>
+#include <time.h>
+
+#include "tile-cache.h"
+#include "tile-store.h"
 
 G_BEGIN_DECLS
 
@@ -90,10 +95,45 @@ int         maep_source_get_max_zoom      (const MaepSource *source);
 int         maep_source_get_uri_format    (const MaepSource *source);
 guint       maep_source_get_cache_period  (const MaepSource *source);
 gboolean    maep_source_get_cache_policy  (const MaepSource *source);
+guint       maep_source_get_max_stale     (const MaepSource *source);
+MaepTileStoreKind maep_source_get_store   (const MaepSource *source);
+guint64     maep_source_get_quota         (const MaepSource *source);
+guint       maep_source_get_max_connections(const MaepSource *source);
+void        maep_source_get_cache_usage   (const MaepSource *source,
+                                           guint64 *usage,
+                                           guint64 *evicted_bytes,
+                                           guint *evicted_tiles);
 gboolean    maep_source_is_valid          (const MaepSource *source);
 gchar*      maep_source_get_tile_uri      (const MaepSource *source,
                                            int zoom, int x, int y);
 
+/* A rectangle of tiles at a given zoom level, bounds included. */
+typedef struct _MaepTileArea MaepTileArea;
+struct _MaepTileArea
+{
+    int zoom;
+    int x0, y0, x1, y1;
+};
+
+/* A decoded tile, shared by all the maps of the process. */
+typedef struct _MaepTile MaepTile;
+struct _MaepTile
+{
+    cairo_surface_t *surf;
+    /* When the tile has last been checked against its cache period. */
+    time_t stamp;
+    /* Not zero for a tile built from the tiles of another zoom level,
+       until the real one is loaded: the number of levels up to the
+       parent it is upscaled from, or one if made of its children. */
+    guint synthetic;
+
+    /* private */
+    guint ref_count;
+};
+
+MaepTile*   maep_tile_ref                 (MaepTile *tile);
+void        maep_tile_unref               (MaepTile *tile);
+
 #define MAEP_SOURCE_MANAGER_CACHE_NONE  "none://"
 #define MAEP_SOURCE_MANAGER_CACHE_AUTO  "auto://"
 #define MAEP_SOURCE_MANAGER_CACHE_FRIENDLY  "friendly://"
@@ -136,6 +176,26 @@ const MaepSource*  maep_source_manager_add       (MaepSourceManager *manager,
                                                   gboolean cache_policy);
 gboolean           maep_source_manager_remove    (MaepSourceManager *manager,
                                                   MaepSource* source);
+void               maep_source_manager_set_max_stale(MaepSourceManager *manager,
+                                                     const MaepSource *source,
+                                                     guint max_stale);
+void               maep_source_manager_set_store(MaepSourceManager *manager,
+                                                 const MaepSource *source,
+                                                 MaepTileStoreKind kind);
+void               maep_source_manager_set_quota(MaepSourceManager *manager,
+                                                 const MaepSource *source,
+                                                 guint64 quota);
+void               maep_source_manager_set_max_connections(MaepSourceManager *manager,
+                                                           const MaepSource *source,
+                                                           guint max_conns);
+void               maep_source_manager_set_cache_quota(MaepSourceManager *manager,
+                                                       guint64 quota);
+void               maep_source_manager_protect_area(MaepSourceManager *manager,
+                                                    const MaepSource *source,
+                                                    const MaepTileArea *area);
+void               maep_source_manager_unprotect_area(MaepSourceManager *manager,
+                                                      const MaepSource *source,
+                                                      const MaepTileArea *area);
 
 const MaepSource*  maep_source_manager_get(const MaepSourceManager *manager,
                                            const gchar *label);
@@ -144,12 +204,80 @@ const MaepSource*  maep_source_manager_getById(MaepSourceManager *manager,
 
 void               maep_source_manager_set_cache_dir(MaepSourceManager *manager,
                                                      const gchar *dir);
+void               maep_source_manager_sync(MaepSourceManager *manager);
+gboolean           maep_source_manager_has_cached_tile(const MaepSourceManager *manager,
+                                                       const MaepSource *source,
+                                                       int zoom, int x, int y);
 gchar*             maep_source_manager_get_cached_tile(const MaepSourceManager *manager,
                                                        const MaepSource *source,
                                                        int zoom, int x, int y);
-gchar*             maep_source_manager_get_tile_async(MaepSourceManager *manager,
-                                                      const MaepSource *source,
-                                                      int zoom, int x, int y);
+void               maep_source_manager_advise_tiles(const MaepSourceManager *manager,
+                                                    const MaepSource *source, int zoom,
+                                                    int x0, int y0, int x1, int y1);
+
+/* Download state of a tile server, for diagnostics. */
+typedef struct _MaepDownloadHost MaepDownloadHost;
+struct _MaepDownloadHost
+{
+    gchar *host;
+    guint in_flight;
+    /* Consecutive failures, downloads are paused after too many. */
+    guint failures;
+    gboolean paused;
+    /* Seconds before the next attempt, 0 if the host is available. */
+    guint retry_in;
+    guint retries, given_up;
+    /* Downloads allowed at once, tuned on latency and errors, and
+       smoothed latency in milliseconds. */
+    gfloat window;
+    guint latency;
+    /* Requests sent, and the ones reusing an open connection. */
+    guint requests, reused;
+};
+
+GArray*            maep_source_manager_get_download_hosts(MaepSourceManager *manager);
+
+/* Tiles not in memory are decoded in the background, on behalf of
+   an owner. Lower priorities are decoded first. Between two batches
+   of requests, the owner increments the serial, so pending requests
+   not repeated can be cancelled. */
+typedef struct _MaepTileRequest MaepTileRequest;
+struct _MaepTileRequest
+{
+    gconstpointer owner;
+    guint serial;
+    guint priority;
+};
+/* The priority of downloads asked without request, they come after
+   all the others. */
+#define MAEP_TILE_PRIORITY_BACKGROUND G_MAXUINT
+
+MaepTile*          maep_source_manager_get_tile(MaepSourceManager *manager,
+                                                const MaepSource *source,
+                                                int zoom, int x, int y,
+                                                const MaepTileRequest *request);
+MaepTile*          maep_source_manager_get_tile_from_children(MaepSourceManager *manager,
+                                                              const MaepSource *source,
+                                                              int zoom, int x, int y,
+                                                              const MaepTileRequest *request);
+MaepTile*          maep_source_manager_add_synthetic_tile(MaepSourceManager *manager,
+                                                          const MaepSource *source,
+                                                          int zoom, int x, int y,
+                                                          cairo_surface_t *surf,
+                                                          guint levels);
+MaepTile*          maep_source_manager_load_cached_tile(MaepSourceManager *manager,
+                                                        const MaepSource *source,
+                                                        int zoom, int x, int y,
+                                                        const MaepTileRequest *request);
+void               maep_source_manager_cancel_requests(MaepSourceManager *manager,
+                                                       const MaepTileRequest *request);
+gboolean           maep_source_manager_download_tile(MaepSourceManager *manager,
+                                                     const MaepSource *source,
+                                                     int zoom, int x, int y,
+                                                     const MaepTileRequest *request);
+MaepTile*          maep_source_manager_peek_tile(const MaepSourceManager *manager,
+                                                 const MaepSource *source,
+                                                 int zoom, int x, int y);
 
 /* void               maep_source_manager_set_active(MaepSourceManager *manager, */
 /*                                                   MaepSource *source); */
@@ -22,6 +22,12 @@
 
 #include "../conf.h"
 #define MAEP_CONF_KEY_LIST       "source-list"
+#define MAEP_CONF_KEY_PACKED     "source-packed-list"
+#define MAEP_CONF_KEY_QUOTAS     "source-quota-list"
+#define MAEP_CONF_KEY_MAX_STALES "source-max-stale-list"
+#define MAEP_CONF_KEY_MAX_CONNS  "source-max-conns-list"
+#define MAEP_CONF_KEY_CACHE_QUOTA "cache-quota"
+#define MIB (1024 * 1024)
 
 Maep::SourceModel::SourceModel(QObject *parent)
 : QAbstractListModel(parent), manager(maep_source_manager_get_instance())
@@ -36,6 +42,13 @@ Maep::SourceModel::SourceModel(QObject *parent)
     roles.insert(Section, "section");
     roles.insert(Enabled, "enabled");
     roles.insert(Active, "active");
+    roles.insert(Packed, "packed");
+    roles.insert(CacheUsage, "cacheUsage");
+    roles.insert(CacheQuota, "cacheQuota");
+    roles.insert(EvictedBytes, "evictedBytes");
+    roles.insert(EvictedTiles, "evictedTiles");
+    roles.insert(MaxStale, "maxStale");
+    roles.insert(MaxConnections, "maxConnections");
 
     values = maep_conf_get_uint_list(MAEP_CONF_KEY_LIST, &ln);
     if (values)
@@ -44,6 +57,38 @@ Maep::SourceModel::SourceModel(QObject *parent)
             confList.append(values[i]);
         }
     g_free(values);
+
+    values = maep_conf_get_uint_list(MAEP_CONF_KEY_PACKED, &ln);
+    if (values)
+        for (i = 0; i < ln; i++)
+            packedList.append(values[i]);
+    g_free(values);
+
+    // Stored as pairs of source id and quota.
+    values = maep_conf_get_uint_list(MAEP_CONF_KEY_QUOTAS, &ln);
+    if (values)
+        for (i = 0; i + 1 < ln; i += 2)
+            quotas.insert(values[i], values[i + 1]);
+    g_free(values);
+
+    // Stored as pairs of source id and seconds.
+    values = maep_conf_get_uint_list(MAEP_CONF_KEY_MAX_STALES, &ln);
+    if (values)
+        for (i = 0; i + 1 < ln; i += 2)
+            maxStales.insert(values[i], values[i + 1]);
+    g_free(values);
+
+    // Stored as pairs of source id and connections.
+    values = maep_conf_get_uint_list(MAEP_CONF_KEY_MAX_CONNS, &ln);
+    if (values)
+        for (i = 0; i + 1 < ln; i += 2)
+            maxConns.insert(values[i], values[i + 1]);
+    g_free(values);
+
+    maep_source_manager_set_cache_quota
+        (manager, guint64(maep_conf_get_int(MAEP_CONF_KEY_CACHE_QUOTA, 0)) * MIB);
+    g_signal_connect(G_OBJECT(manager), "cache-usage-changed",
+                     G_CALLBACK(onCacheUsageChanged), this);
 }
 
 Maep::SourceModel::~SourceModel()
@@ -51,12 +96,86 @@ Maep::SourceModel::~SourceModel()
     guint *ids;
     int i, j;
 
+    g_signal_handlers_disconnect_by_data(G_OBJECT(manager), this);
+
     ids = static_cast<guint*>(g_malloc(sizeof(guint) * sources.length()));
     for (i = 0, j = 0; i < sources.length(); i++)
         if (sources.at(i).enabled)
             ids[j++] = maep_source_get_id(sources.at(i).source);
     maep_conf_set_uint_list(MAEP_CONF_KEY_LIST, ids, j);
     g_free(ids);
+
+    ids = static_cast<guint*>(g_malloc(sizeof(guint) * packedList.length()));
+    for (i = 0; i < packedList.length(); i++)
+        ids[i] = packedList.at(i);
+    maep_conf_set_uint_list(MAEP_CONF_KEY_PACKED, ids, packedList.length());
+    g_free(ids);
+
+    ids = static_cast<guint*>(g_malloc(sizeof(guint) * 2 * quotas.size()));
+    j = 0;
+    for (QHash<guint, guint>::const_iterator it = quotas.constBegin();
+         it != quotas.constEnd(); it++) {
+        ids[j++] = it.key();
+        ids[j++] = it.value();
+    }
+    maep_conf_set_uint_list(MAEP_CONF_KEY_QUOTAS, ids, j);
+    g_free(ids);
+
+    ids = static_cast<guint*>(g_malloc(sizeof(guint) * 2 * maxStales.size()));
+    j = 0;
+    for (QHash<guint, guint>::const_iterator it = maxStales.constBegin();
+         it != maxStales.constEnd(); it++) {
+        ids[j++] = it.key();
+        ids[j++] = it.value();
+    }
+    maep_conf_set_uint_list(MAEP_CONF_KEY_MAX_STALES, ids, j);
+    g_free(ids);
+
+    ids = static_cast<guint*>(g_malloc(sizeof(guint) * 2 * maxConns.size()));
+    j = 0;
+    for (QHash<guint, guint>::const_iterator it = maxConns.constBegin();
+         it != maxConns.constEnd(); it++) {
+        ids[j++] = it.key();
+        ids[j++] = it.value();
+    }
+    maep_conf_set_uint_list(MAEP_CONF_KEY_MAX_CONNS, ids, j);
+    g_free(ids);
+}
+
+void Maep::SourceModel::onCacheUsageChanged(MaepSourceManager *manager, guint id,
+                                            Maep::SourceModel *model)
+{
+    Q_UNUSED(manager);
+
+    for (int i = 0; i < model->sources.count(); i++)
+        if (maep_source_get_id(model->sources.at(i).source) == id) {
+            QModelIndex index = model->index(i);
+            emit model->dataChanged(index, index, QVector<int>()
+                                    << int(Maep::SourceModel::CacheUsage)
+                                    << int(Maep::SourceModel::EvictedBytes)
+                                    << int(Maep::SourceModel::EvictedTiles));
+            return;
+        }
+}
+
+qreal Maep::SourceModel::cacheQuota() const
+{
+    guint64 quota;
+
+    g_object_get(G_OBJECT(manager), "cache-quota", &quota, NULL);
+    return qreal(quota);
+}
+
+void Maep::SourceModel::setCacheQuota(qreal quota)
+{
+    gint mib = gint(quota / MIB);
+
+    if (guint64(mib) * MIB == guint64(cacheQuota()))
+        return;
+
+    maep_conf_set_int(MAEP_CONF_KEY_CACHE_QUOTA, mib);
+    maep_source_manager_set_cache_quota(manager, guint64(mib) * MIB);
+    emit cacheQuotaChanged();
 }
 
 QHash<int, QByteArray> Maep::SourceModel::roleNames() const
@@ -73,6 +192,18 @@ void Maep::SourceModel::addPreset(Maep::SourceModel::SourceId id,
     if (sources.contains(source))
         return;
 
+    if (packedList.contains(guint(id)))
+        maep_source_manager_set_store(manager, source.source, MAEP_TILE_STORE_PACK);
+    if (quotas.contains(guint(id)))
+        maep_source_manager_set_quota(manager, source.source,
+                                      guint64(quotas.value(guint(id))) * MIB);
+    if (maxStales.contains(guint(id)))
+        maep_source_manager_set_max_stale(manager, source.source,
+                                          maxStales.value(guint(id)));
+    if (maxConns.contains(guint(id)))
+        maep_source_manager_set_max_connections(manager, source.source,
+                                                maxConns.value(guint(id)));
+
     // Insert id sorted.
     int i;
     for (i = 0; i < sources.count(); i++) {
@@ -98,22 +229,57 @@ QVariant Maep::SourceModel::data(const QModelIndex& index, int role) const
             case Label:
               result.setValue<QString>(maep_source_get_friendly_name(sources.at(row).source));
               break;
-            case CopyrightNotice:
-              const gchar *notice;
+            case CopyrightNotice: {
+              const gchar *notice = NULL;
               maep_source_get_repo_copyright(sources.at(row).source, &notice, NULL);
               result.setValue<QString>(notice);
               break;
-            case CopyrightUrl:
-              const gchar *url;
+            }
+            case CopyrightUrl: {
+              const gchar *url = NULL;
               maep_source_get_repo_copyright(sources.at(row).source, NULL, &url);
               result.setValue<QString>(url);
               break;
+            }
             case Active:
               result.setValue<bool>(maep_source_is_valid(sources.at(row).source));
               break;
             case Enabled:
               result.setValue<bool>(sources.at(row).enabled);
               break;
+            case Packed:
+              result.setValue<bool>(packedList.contains(maep_source_get_id(sources.at(row).source)));
+              break;
+            case CacheUsage: {
+              guint64 usage = 0;
+              maep_source_get_cache_usage(sources.at(row).source, &usage, NULL, NULL);
+              result.setValue<qreal>(usage);
+              break;
+            }
+            case CacheQuota:
+              result.setValue<qreal>(maep_source_get_quota(sources.at(row).source));
+              break;
+            case EvictedBytes: {
+              guint64 evicted = 0;
+              maep_source_get_cache_usage(sources.at(row).source, NULL, &evicted, NULL);
+              result.setValue<qreal>(evicted);
+              break;
+            }
+            case EvictedTiles: {
+              guint count = 0;
+              maep_source_get_cache_usage(sources.at(row).source, NULL, NULL, &count);
+              result.setValue<int>(count);
+              break;
+            }
+            case MaxStale: {
+              // Any outdated tile is allowed for negative values.
+              guint stale = maep_source_get_max_stale(sources.at(row).source);
+              result.setValue<qreal>(stale == G_MAXUINT ? -1. : qreal(stale));
+              break;
+            }
+            case MaxConnections:
+              result.setValue<int>(maep_source_get_max_connections(sources.at(row).source));
+              break;
             case Section:
                 result.setValue<int>(int(sources.at(row).section));
               break;
@@ -128,7 +294,9 @@ QVariant Maep::SourceModel::data(const QModelIndex& index, int role) const
 
 bool Maep::SourceModel::setData(const QModelIndex &index, const QVariant &value, int role)
 {
-    if (role != Maep::SourceModel::Enabled)
+    if (role != Maep::SourceModel::Enabled && role != Maep::SourceModel::Packed &&
+        role != Maep::SourceModel::CacheQuota && role != Maep::SourceModel::MaxStale &&
+        role != Maep::SourceModel::MaxConnections)
         return false;
     if (!index.isValid())
         return false;
@@ -137,6 +305,67 @@ bool Maep::SourceModel::setData(const QModelIndex &index, const QVariant &value,
     if (row < 0 || row >= sources.count())
         return false;
 
+    if (role == Maep::SourceModel::Packed) {
+        guint id = maep_source_get_id(sources.at(row).source);
+        bool packed(value.toBool());
+        if (packed == packedList.contains(id))
+            return false;
+
+        if (packed)
+            packedList.append(id);
+        else
+            packedList.removeAll(id);
+        // Tiles already on disk are moved in the background.
+        maep_source_manager_set_store(manager, sources.at(row).source,
+                                      packed ? MAEP_TILE_STORE_PACK : MAEP_TILE_STORE_DIRECTORY);
+        emit dataChanged(index, index, QVector<int>() << int(Maep::SourceModel::Packed));
+        return true;
+    }
+
+    if (role == Maep::SourceModel::CacheQuota) {
+        guint id = maep_source_get_id(sources.at(row).source);
+        guint mib = guint(value.toReal() / MIB);
+        if (mib == quotas.value(id, 0))
+            return false;
+
+        if (mib)
+            quotas.insert(id, mib);
+        else
+            quotas.remove(id);
+        maep_source_manager_set_quota(manager, sources.at(row).source,
+                                      guint64(mib) * MIB);
+        emit dataChanged(index, index, QVector<int>() << int(Maep::SourceModel::CacheQuota));
+        return true;
+    }
+
+    if (role == Maep::SourceModel::MaxStale) {
+        guint id = maep_source_get_id(sources.at(row).source);
+        guint stale = value.toReal() < 0. ? G_MAXUINT : guint(value.toReal());
+        if (stale == maep_source_get_max_stale(sources.at(row).source))
+            return false;
+
+        maxStales.insert(id, stale);
+        maep_source_manager_set_max_stale(manager, sources.at(row).source, stale);
+        emit dataChanged(index, index, QVector<int>() << int(Maep::SourceModel::MaxStale));
+        return true;
+    }
+
+    if (role == Maep::SourceModel::MaxConnections) {
+        guint id = maep_source_get_id(sources.at(row).source);
+        guint conns = guint(qMax(value.toInt(), 0));
+        if (conns == maxConns.value(id, 0))
+            return false;
+
+        // Zero goes back to the default.
+        if (conns)
+            maxConns.insert(id, conns);
+        else
+            maxConns.remove(id);
+        maep_source_manager_set_max_connections(manager, sources.at(row).source, conns);
+        emit dataChanged(index, index, QVector<int>() << int(Maep::SourceModel::MaxConnections));
+        return true;
+    }
+
     bool enabled(value.toBool());
     if (enabled == sources.at(row).enabled)
         return false;
@@ -48,6 +48,7 @@ class SourceModel : public QAbstractListModel
 
     Q_ENUMS(SourceId)
     Q_ENUMS(SectionId)
+    Q_PROPERTY(qreal cacheQuota READ cacheQuota WRITE setCacheQuota NOTIFY cacheQuotaChanged)
 
 public:
     enum SourceModelRoles {
@@ -57,7 +58,14 @@ public:
         CopyrightUrl,
         Section,
         Enabled,
-        Active
+        Active,
+        Packed,
+        CacheUsage,
+        CacheQuota,
+        EvictedBytes,
+        EvictedTiles,
+        MaxStale,
+        MaxConnections
     };
 
     enum SourceId {
@@ -104,9 +112,18 @@ public:
 
     Q_INVOKABLE void addPreset(SourceId id, SectionId section);
 
+    qreal cacheQuota() const;
+    void setCacheQuota(qreal quota);
+
+signals:
+    void cacheQuotaChanged();
+
 private:
     friend SourceModelFilter;
 
+    static void onCacheUsageChanged(MaepSourceManager *manager, guint id,
+                                    SourceModel *model);
+
     QHash<int, QByteArray> roles;
 
     struct Source {
@@ -133,6 +150,13 @@ private:
     MaepSourceManager *manager;
     QList<Source> sources;
     QList<guint> confList;
+    QList<guint> packedList;
+    // Quotas in MiB, by source id.
+    QHash<guint, guint> quotas;
+    // Age allowed past the cache period in seconds, by source id.
+    QHash<guint, guint> maxStales;
+    // Downloads allowed at once, by source id.
+    QHash<guint, guint> maxConns;
 };
 
 }
@@ -0,0 +1,358 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * Copyright (C) 2017 Damien Caliste <dcaliste@free.fr>
+ *
+ * This file is part of Maep.
+ *
+ * Maep is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Maep is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Maep.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tile-cache.h"
+
+#include <string.h>
+
+/* Open addressing table with linear probing. A slot is free when its
+   value is NULL, so NULL values cannot be stored. Removal is done by
+   shifting back the following entries of the probe sequence, so no
+   tombstone is ever left in the table.
+
+   When a budget is given, entries are evicted with the CLOCK
+   algorithm: a hand sweeps the slots, giving a second chance to
+   entries that have been looked up since its last pass and skipping
+   the ones the keep function wants to protect. */
+
+#define MIN_SLOTS 64
+
+typedef struct
+{
+    MaepTileKey key;
+    gpointer value;
+    gsize size;
+    gboolean referenced;
+} MaepTileCacheSlot;
+
+struct _MaepTileCache
+{
+    MaepTileCacheSlot *slots;
+    guint mask;
+    guint n_items;
+
+    GDestroyNotify value_free;
+
+    /* Memory accounting and CLOCK eviction. */
+    MaepTileCacheSizeFunc value_size;
+    gsize budget, n_bytes;
+    guint hand;
+    MaepTileCacheRemoveFunc keep;
+    gpointer keep_data;
+
+    guint hits, misses, evictions;
+};
+
+static inline guint _hash(MaepTileKey key)
+{
+    /* Finalizer of splitmix64, spreads neighbouring tiles. */
+    key ^= key >> 30;
+    key *= G_GUINT64_CONSTANT(0xbf58476d1ce4e5b9);
+    key ^= key >> 27;
+    key *= G_GUINT64_CONSTANT(0x94d049bb133111eb);
+    key ^= key >> 31;
+    return (guint)key;
+}
+
+MaepTileCache* maep_tile_cache_new(GDestroyNotify value_free)
+{
+    return maep_tile_cache_new_full(value_free, NULL, 0);
+}
+
+/* With a value_size function, the cache will not hold more than
+   budget bytes, apart from the protected entries. */
+MaepTileCache* maep_tile_cache_new_full(GDestroyNotify value_free,
+                                        MaepTileCacheSizeFunc value_size,
+                                        gsize budget)
+{
+    MaepTileCache *cache;
+
+    cache = g_slice_new0(MaepTileCache);
+    cache->slots = g_new0(MaepTileCacheSlot, MIN_SLOTS);
+    cache->mask = MIN_SLOTS - 1;
+    cache->value_free = value_free;
+    cache->value_size = value_size;
+    cache->budget = budget;
+
+    return cache;
+}
+
+void maep_tile_cache_free(MaepTileCache *cache)
+{
+    g_return_if_fail(cache);
+
+    maep_tile_cache_remove_all(cache);
+    g_free(cache->slots);
+    g_slice_free(MaepTileCache, cache);
+}
+
+static guint _find(const MaepTileCache *cache, MaepTileKey key)
+{
+    guint i;
+
+    for (i = _hash(key) & cache->mask;
+         cache->slots[i].value && cache->slots[i].key != key;
+         i = (i + 1) & cache->mask);
+    return i;
+}
+
+static void _resize(MaepTileCache *cache, guint n_slots)
+{
+    MaepTileCacheSlot *old;
+    guint i, n_old;
+
+    old = cache->slots;
+    n_old = cache->mask + 1;
+    cache->slots = g_new0(MaepTileCacheSlot, n_slots);
+    cache->mask = n_slots - 1;
+    cache->hand = 0;
+    for (i = 0; i < n_old; i++)
+        if (old[i].value)
+            cache->slots[_find(cache, old[i].key)] = old[i];
+    g_free(old);
+}
+
+gpointer maep_tile_cache_lookup(MaepTileCache *cache, MaepTileKey key)
+{
+    MaepTileCacheSlot *slot;
+
+    g_return_val_if_fail(cache, NULL);
+
+    slot = cache->slots + _find(cache, key);
+    if (!slot->value) {
+        cache->misses += 1;
+        return NULL;
+    }
+    cache->hits += 1;
+    slot->referenced = TRUE;
+    return slot->value;
+}
+
+/* Like lookup, but neither counted in the statistics nor marked as
+   recently used. */
+gpointer maep_tile_cache_peek(const MaepTileCache *cache, MaepTileKey key)
+{
+    g_return_val_if_fail(cache, NULL);
+
+    return cache->slots[_find(cache, key)].value;
+}
+
+static void _remove_at(MaepTileCache *cache, guint i);
+
+static void _evict(MaepTileCache *cache)
+{
+    MaepTileCacheSlot *slot;
+    guint scanned;
+
+    if (!cache->value_size)
+        return;
+
+    /* Two full turns without any eviction means that every entry
+       left is protected. */
+    for (scanned = 0; cache->n_bytes > cache->budget &&
+             scanned < 2 * (cache->mask + 1); ) {
+        slot = cache->slots + cache->hand;
+        if (!slot->value || slot->referenced ||
+            (cache->keep && cache->keep(slot->key, slot->value, cache->keep_data))) {
+            slot->referenced = FALSE;
+            cache->hand = (cache->hand + 1) & cache->mask;
+            scanned += 1;
+        } else {
+            /* The hand is not moved since the slot may be refilled
+               by a shifted entry. */
+            _remove_at(cache, cache->hand);
+            cache->evictions += 1;
+            scanned = 0;
+        }
+    }
+}
+
+void maep_tile_cache_insert(MaepTileCache *cache, MaepTileKey key, gpointer value)
+{
+    guint i;
+
+    g_return_if_fail(cache && value);
+
+    /* Keep the load factor under 3/4. */
+    if (4 * (cache->n_items + 1) > 3 * (cache->mask + 1))
+        _resize(cache, 2 * (cache->mask + 1));
+
+    i = _find(cache, key);
+    if (cache->slots[i].value) {
+        if (cache->slots[i].value != value && cache->value_free)
+            cache->value_free(cache->slots[i].value);
+        cache->n_bytes -= cache->slots[i].size;
+    } else
+        cache->n_items += 1;
+    cache->slots[i].key = key;
+    cache->slots[i].value = value;
+    cache->slots[i].size = cache->value_size ? cache->value_size(value) : 0;
+    cache->slots[i].referenced = TRUE;
+    cache->n_bytes += cache->slots[i].size;
+
+    _evict(cache);
+}
+
+static void _remove_at(MaepTileCache *cache, guint i)
+{
+    guint j, home;
+
+    if (cache->value_free)
+        cache->value_free(cache->slots[i].value);
+    cache->slots[i].value = NULL;
+    cache->n_items -= 1;
+    cache->n_bytes -= cache->slots[i].size;
+
+    /* Shift back the entries that were displaced behind slot i. */
+    for (j = (i + 1) & cache->mask; cache->slots[j].value;
+         j = (j + 1) & cache->mask) {
+        home = _hash(cache->slots[j].key) & cache->mask;
+        /* Entry j can move to i only if its home slot is not in ]i, j]. */
+        if ((j > i && (home <= i || home > j)) ||
+            (j < i && (home <= i && home > j))) {
+            cache->slots[i] = cache->slots[j];
+            cache->slots[j].value = NULL;
+            i = j;
+        }
+    }
+}
+
+gboolean maep_tile_cache_remove(MaepTileCache *cache, MaepTileKey key)
+{
+    guint i;
+
+    g_return_val_if_fail(cache, FALSE);
+
+    i = _find(cache, key);
+    if (!cache->slots[i].value)
+        return FALSE;
+
+    _remove_at(cache, i);
+    return TRUE;
+}
+
+void maep_tile_cache_remove_all(MaepTileCache *cache)
+{
+    guint i;
+
+    g_return_if_fail(cache);
+
+    for (i = 0; i <= cache->mask; i++)
+        if (cache->slots[i].value && cache->value_free)
+            cache->value_free(cache->slots[i].value);
+    if (cache->mask + 1 > MIN_SLOTS) {
+        g_free(cache->slots);
+        cache->slots = g_new0(MaepTileCacheSlot, MIN_SLOTS);
+        cache->mask = MIN_SLOTS - 1;
+    } else
+        memset(cache->slots, '\0', sizeof(MaepTileCacheSlot) * (cache->mask + 1));
+    cache->n_items = 0;
+    cache->n_bytes = 0;
+    cache->hand = 0;
+}
+
+guint maep_tile_cache_foreach_remove(MaepTileCache *cache,
+                                     MaepTileCacheRemoveFunc func,
+                                     gpointer user_data)
+{
+    GArray *keys;
+    guint i, n;
+
+    g_return_val_if_fail(cache && func, 0);
+
+    /* Removal shifts entries around, so collect the keys first. */
+    keys = g_array_new(FALSE, FALSE, sizeof(MaepTileKey));
+    for (i = 0; i <= cache->mask; i++)
+        if (cache->slots[i].value &&
+            func(cache->slots[i].key, cache->slots[i].value, user_data))
+            g_array_append_val(keys, cache->slots[i].key);
+    for (i = 0; i < keys->len; i++)
+        maep_tile_cache_remove(cache, g_array_index(keys, MaepTileKey, i));
+    n = keys->len;
+    g_array_free(keys, TRUE);
+
+    return n;
+}
+
+/* The cache must not be modified by func. */
+void maep_tile_cache_foreach(const MaepTileCache *cache,
+                             MaepTileCacheFunc func, gpointer user_data)
+{
+    guint i;
+
+    g_return_if_fail(cache && func);
+
+    for (i = 0; i <= cache->mask; i++)
+        if (cache->slots[i].value)
+            func(cache->slots[i].key, cache->slots[i].value, user_data);
+}
+
+guint maep_tile_cache_size(const MaepTileCache *cache)
+{
+    g_return_val_if_fail(cache, 0);
+
+    return cache->n_items;
+}
+
+void maep_tile_cache_set_budget(MaepTileCache *cache, gsize budget)
+{
+    g_return_if_fail(cache);
+
+    cache->budget = budget;
+    _evict(cache);
+}
+
+gsize maep_tile_cache_get_budget(const MaepTileCache *cache)
+{
+    g_return_val_if_fail(cache, 0);
+
+    return cache->budget;
+}
+
+gsize maep_tile_cache_get_bytes(const MaepTileCache *cache)
+{
+    g_return_val_if_fail(cache, 0);
+
+    return cache->n_bytes;
+}
+
+/* Entries for which keep returns TRUE are never evicted. */
+void maep_tile_cache_set_keep_func(MaepTileCache *cache,
+                                   MaepTileCacheRemoveFunc keep,
+                                   gpointer user_data)
+{
+    g_return_if_fail(cache);
+
+    cache->keep = keep;
+    cache->keep_data = user_data;
+}
+
+void maep_tile_cache_get_stats(const MaepTileCache *cache,
+                               guint *hits, guint *misses, guint *evictions)
+{
+    g_return_if_fail(cache);
+
+    if (hits)
+        *hits = cache->hits;
+    if (misses)
+        *misses = cache->misses;
+    if (evictions)
+        *evictions = cache->evictions;
+}
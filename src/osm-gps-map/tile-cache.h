@@ -0,0 +1,87 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * Copyright (C) 2017 Damien Caliste <dcaliste@free.fr>
+ *
+ * This file is part of Maep.
+ *
+ * Maep is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Maep is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Maep.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TILE_CACHE_H
+#define TILE_CACHE_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* A tile is identified by its source id, its zoom level and its
+   coordinates, packed into a single integer: 16 bits for the source,
+   8 bits for the zoom and 20 bits for each coordinate (enough up to
+   zoom level 20). */
+typedef guint64 MaepTileKey;
+
+#define MAEP_TILE_KEY(id, zoom, x, y)                   \
+    ((((guint64)(id) & 0xffff) << 48) |                 \
+     (((guint64)(zoom) & 0xff) << 40) |                 \
+     (((guint64)(x) & 0xfffff) << 20) |                 \
+     ((guint64)(y) & 0xfffff))
+#define MAEP_TILE_KEY_SOURCE(key) ((guint)(((key) >> 48) & 0xffff))
+#define MAEP_TILE_KEY_ZOOM(key)   ((int)(((key) >> 40) & 0xff))
+#define MAEP_TILE_KEY_X(key)      ((int)(((key) >> 20) & 0xfffff))
+#define MAEP_TILE_KEY_Y(key)      ((int)((key) & 0xfffff))
+
+typedef struct _MaepTileCache MaepTileCache;
+
+typedef gboolean (*MaepTileCacheRemoveFunc)(MaepTileKey key, gpointer value,
+                                            gpointer user_data);
+typedef gsize    (*MaepTileCacheSizeFunc)(gconstpointer value);
+typedef void     (*MaepTileCacheFunc)(MaepTileKey key, gpointer value,
+                                      gpointer user_data);
+
+MaepTileCache* maep_tile_cache_new         (GDestroyNotify value_free);
+MaepTileCache* maep_tile_cache_new_full    (GDestroyNotify value_free,
+                                            MaepTileCacheSizeFunc value_size,
+                                            gsize budget);
+void           maep_tile_cache_free        (MaepTileCache *cache);
+
+void           maep_tile_cache_set_budget  (MaepTileCache *cache, gsize budget);
+gsize          maep_tile_cache_get_budget  (const MaepTileCache *cache);
+gsize          maep_tile_cache_get_bytes   (const MaepTileCache *cache);
+void           maep_tile_cache_set_keep_func(MaepTileCache *cache,
+                                             MaepTileCacheRemoveFunc keep,
+                                             gpointer user_data);
+void           maep_tile_cache_get_stats   (const MaepTileCache *cache,
+                                            guint *hits, guint *misses,
+                                            guint *evictions);
+
+gpointer       maep_tile_cache_lookup      (MaepTileCache *cache,
+                                            MaepTileKey key);
+gpointer       maep_tile_cache_peek        (const MaepTileCache *cache,
+                                            MaepTileKey key);
+void           maep_tile_cache_insert      (MaepTileCache *cache,
+                                            MaepTileKey key, gpointer value);
+gboolean       maep_tile_cache_remove      (MaepTileCache *cache,
+                                            MaepTileKey key);
+void           maep_tile_cache_remove_all  (MaepTileCache *cache);
+guint          maep_tile_cache_foreach_remove(MaepTileCache *cache,
+                                              MaepTileCacheRemoveFunc func,
+                                              gpointer user_data);
+void           maep_tile_cache_foreach     (const MaepTileCache *cache,
+                                            MaepTileCacheFunc func,
+                                            gpointer user_data);
+guint          maep_tile_cache_size        (const MaepTileCache *cache);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,212 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * Copyright (C) 2017 Damien Caliste <dcaliste@free.fr>
+ *
+ * This file is part of Maep.
+ *
+ * Maep is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Maep is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Maep.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tile-index.h"
+
+#include <string.h>
+
+/* Open addressing table with linear probing, like the tile cache, but
+   the entries are stored in the slots, right after their key. A slot
+   is free when its key is EMPTY_KEY, which is not a valid tile
+   key. Removal shifts back the following entries of the probe
+   sequence, so no tombstone is ever left in the table. */
+
+#define MIN_SLOTS 64
+#define EMPTY_KEY G_MAXUINT64
+
+struct _MaepTileIndex
+{
+    guchar *slots;
+    gsize slot_size, entry_size;
+    guint mask;
+    guint n_items;
+};
+
+#define SLOT(index, i) ((index)->slots + (gsize)(i) * (index)->slot_size)
+#define SLOT_KEY(slot) (*(MaepTileKey*)(slot))
+#define SLOT_ENTRY(slot) ((gpointer)((slot) + sizeof(MaepTileKey)))
+
+static inline guint _hash(MaepTileKey key)
+{
+    /* Finalizer of splitmix64, spreads neighbouring tiles. */
+    key ^= key >> 30;
+    key *= G_GUINT64_CONSTANT(0xbf58476d1ce4e5b9);
+    key ^= key >> 27;
+    key *= G_GUINT64_CONSTANT(0x94d049bb133111eb);
+    key ^= key >> 31;
+    return (guint)key;
+}
+
+static guchar* _slots_new(gsize slot_size, guint n_slots)
+{
+    guchar *slots;
+
+    /* Every byte of EMPTY_KEY is 0xff. */
+    slots = g_malloc(slot_size * n_slots);
+    memset(slots, 0xff, slot_size * n_slots);
+    return slots;
+}
+
+MaepTileIndex* maep_tile_index_new(gsize entry_size)
+{
+    MaepTileIndex *index;
+
+    index = g_slice_new0(MaepTileIndex);
+    index->entry_size = entry_size;
+    /* Keys stay aligned. */
+    index->slot_size = (sizeof(MaepTileKey) + entry_size + sizeof(MaepTileKey) - 1)
+        / sizeof(MaepTileKey) * sizeof(MaepTileKey);
+    index->slots = _slots_new(index->slot_size, MIN_SLOTS);
+    index->mask = MIN_SLOTS - 1;
+
+    return index;
+}
+
+void maep_tile_index_free(MaepTileIndex *index)
+{
+    g_return_if_fail(index);
+
+    g_free(index->slots);
+    g_slice_free(MaepTileIndex, index);
+}
+
+static guint _find(const MaepTileIndex *index, MaepTileKey key)
+{
+    guint i;
+
+    for (i = _hash(key) & index->mask;
+         SLOT_KEY(SLOT(index, i)) != EMPTY_KEY && SLOT_KEY(SLOT(index, i)) != key;
+         i = (i + 1) & index->mask);
+    return i;
+}
+
+static void _resize(MaepTileIndex *index, guint n_slots)
+{
+    guchar *old, *slot;
+    guint i, n_old;
+
+    old = index->slots;
+    n_old = index->mask + 1;
+    index->slots = _slots_new(index->slot_size, n_slots);
+    index->mask = n_slots - 1;
+    for (i = 0; i < n_old; i++) {
+        slot = old + (gsize)i * index->slot_size;
+        if (SLOT_KEY(slot) != EMPTY_KEY)
+            memcpy(SLOT(index, _find(index, SLOT_KEY(slot))), slot, index->slot_size);
+    }
+    g_free(old);
+}
+
+/* The entry of key, NULL if not indexed. */
+gpointer maep_tile_index_lookup(const MaepTileIndex *index, MaepTileKey key)
+{
+    guchar *slot;
+
+    g_return_val_if_fail(index, NULL);
+
+    slot = SLOT(index, _find(index, key));
+    return SLOT_KEY(slot) != EMPTY_KEY ? SLOT_ENTRY(slot) : NULL;
+}
+
+/* The entry of key, a zeroed one if not indexed yet. */
+gpointer maep_tile_index_insert(MaepTileIndex *index, MaepTileKey key)
+{
+    guchar *slot;
+
+    g_return_val_if_fail(index && key != EMPTY_KEY, NULL);
+
+    /* Keep the load factor under 3/4. */
+    if (4 * (index->n_items + 1) > 3 * (index->mask + 1))
+        _resize(index, 2 * (index->mask + 1));
+
+    slot = SLOT(index, _find(index, key));
+    if (SLOT_KEY(slot) == EMPTY_KEY) {
+        SLOT_KEY(slot) = key;
+        memset(SLOT_ENTRY(slot), '\0', index->entry_size);
+        index->n_items += 1;
+    }
+    return SLOT_ENTRY(slot);
+}
+
+gboolean maep_tile_index_remove(MaepTileIndex *index, MaepTileKey key)
+{
+    guchar *slot;
+    guint i, j, home;
+
+    g_return_val_if_fail(index, FALSE);
+
+    i = _find(index, key);
+    if (SLOT_KEY(SLOT(index, i)) == EMPTY_KEY)
+        return FALSE;
+
+    SLOT_KEY(SLOT(index, i)) = EMPTY_KEY;
+    index->n_items -= 1;
+
+    /* Shift back the entries that were displaced behind slot i. */
+    for (j = (i + 1) & index->mask; SLOT_KEY(SLOT(index, j)) != EMPTY_KEY;
+         j = (j + 1) & index->mask) {
+        slot = SLOT(index, j);
+        home = _hash(SLOT_KEY(slot)) & index->mask;
+        /* Entry j can move to i only if its home slot is not in ]i, j]. */
+        if ((j > i && (home <= i || home > j)) ||
+            (j < i && (home <= i && home > j))) {
+            memcpy(SLOT(index, i), slot, index->slot_size);
+            SLOT_KEY(slot) = EMPTY_KEY;
+            i = j;
+        }
+    }
+    return TRUE;
+}
+
+void maep_tile_index_remove_all(MaepTileIndex *index)
+{
+    g_return_if_fail(index);
+
+    if (index->mask + 1 > MIN_SLOTS) {
+        g_free(index->slots);
+        index->slots = _slots_new(index->slot_size, MIN_SLOTS);
+        index->mask = MIN_SLOTS - 1;
+    } else
+        memset(index->slots, 0xff, index->slot_size * (index->mask + 1));
+    index->n_items = 0;
+}
+
+/* The index must not be modified by func, entries may be. */
+void maep_tile_index_foreach(const MaepTileIndex *index,
+                             MaepTileIndexFunc func, gpointer user_data)
+{
+    guchar *slot;
+    guint i;
+
+    g_return_if_fail(index && func);
+
+    for (i = 0; i <= index->mask; i++) {
+        slot = SLOT(index, i);
+        if (SLOT_KEY(slot) != EMPTY_KEY)
+            func(SLOT_KEY(slot), SLOT_ENTRY(slot), user_data);
+    }
+}
+
+guint maep_tile_index_size(const MaepTileIndex *index)
+{
+    g_return_val_if_fail(index, 0);
+
+    return index->n_items;
+}
@@ -0,0 +1,53 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * Copyright (C) 2017 Damien Caliste <dcaliste@free.fr>
+ *
+ * This file is part of Maep.
+ *
+ * Maep is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Maep is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Maep.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TILE_INDEX_H
+#define TILE_INDEX_H
+
+#include "tile-cache.h"
+
+G_BEGIN_DECLS
+
+/* What a tile store knows about its tiles, by tile key. Entries have
+   a fixed size and are kept inside the table itself, a pointer to an
+   entry is only valid until the next insertion or removal. */
+typedef struct _MaepTileIndex MaepTileIndex;
+
+typedef void (*MaepTileIndexFunc)(MaepTileKey key, gpointer entry,
+                                  gpointer user_data);
+
+MaepTileIndex* maep_tile_index_new       (gsize entry_size);
+void           maep_tile_index_free      (MaepTileIndex *index);
+
+gpointer       maep_tile_index_lookup    (const MaepTileIndex *index,
+                                          MaepTileKey key);
+gpointer       maep_tile_index_insert    (MaepTileIndex *index,
+                                          MaepTileKey key);
+gboolean       maep_tile_index_remove    (MaepTileIndex *index,
+                                          MaepTileKey key);
+void           maep_tile_index_remove_all(MaepTileIndex *index);
+void           maep_tile_index_foreach   (const MaepTileIndex *index,
+                                          MaepTileIndexFunc func,
+                                          gpointer user_data);
+guint          maep_tile_index_size      (const MaepTileIndex *index);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,249 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * Copyright (C) 2017 Damien Caliste <dcaliste@free.fr>
+ *
+ * This file is part of Maep.
+ *
+ * Maep is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Maep is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Maep.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "tile-missing.h"
+
+#include <string.h>
+#include <time.h>
+#include <glib/gstdio.h>
+
+/* The set is a tile cache of the time each tile has been found
+   missing, with a budget counted in tiles. On disk, a header is
+   followed by the entries, the key without the source id and the
+   time, in little endian. */
+
+#define MISSING_BUDGET      4096
+#define MISSING_MAGIC       "MAEPMIS1"
+#define MISSING_HEADER_SIZE 8
+#define MISSING_ENTRY_SIZE  12
+#define SOURCE_MASK         (G_GUINT64_CONSTANT(0xffff) << 48)
+
+struct _MaepTileMissing
+{
+    gchar *filename;
+    guint source_id;
+    guint ttl;
+    MaepTileCache *tiles;
+    gboolean dirty;
+};
+
+static gsize _entry_size(G_GNUC_UNUSED gconstpointer value)
+{
+    return 1;
+}
+
+static inline gboolean _expired(const MaepTileMissing *missing,
+                                gpointer value, time_t now)
+{
+    return now - (time_t)GPOINTER_TO_UINT(value) > (time_t)missing->ttl;
+}
+
+static void _load(MaepTileMissing *missing)
+{
+    gchar *data;
+    gsize len, i;
+    guint64 key;
+    guint32 stamp;
+    time_t now;
+
+    if (!g_file_get_contents(missing->filename, &data, &len, NULL))
+        return;
+
+    if (len < MISSING_HEADER_SIZE ||
+        memcmp(data, MISSING_MAGIC, MISSING_HEADER_SIZE)) {
+        g_warning("ignoring unknown missing tiles file '%s'.", missing->filename);
+        g_free(data);
+        return;
+    }
+
+    now = time(NULL);
+    for (i = MISSING_HEADER_SIZE; i + MISSING_ENTRY_SIZE <= len;
+         i += MISSING_ENTRY_SIZE) {
+        memcpy(&key, data + i, sizeof(key));
+        memcpy(&stamp, data + i + 8, sizeof(stamp));
+        key = GUINT64_FROM_LE(key) & ~SOURCE_MASK;
+        stamp = GUINT32_FROM_LE(stamp);
+        if (stamp && !_expired(missing, GUINT_TO_POINTER(stamp), now))
+            maep_tile_cache_insert(missing->tiles,
+                                   key | MAEP_TILE_KEY(missing->source_id, 0, 0, 0),
+                                   GUINT_TO_POINTER(stamp));
+    }
+    g_free(data);
+}
+
+/**
+ * maep_tile_missing_new:
+ * @filename: (allow-none): where the set is kept.
+ * @source_id: the source of the tiles.
+ * @ttl: how long, in seconds, a tile is considered missing.
+ *
+ * Create a set of missing tiles, loading the ones still valid from
+ * @filename if any.
+ *
+ * Returns: a new #MaepTileMissing.
+ */
+MaepTileMissing* maep_tile_missing_new(const gchar *filename,
+                                       guint source_id, guint ttl)
+{
+    MaepTileMissing *missing;
+
+    missing = g_slice_new0(MaepTileMissing);
+    missing->filename = g_strdup(filename);
+    missing->source_id = source_id;
+    missing->ttl = ttl;
+    missing->tiles = maep_tile_cache_new_full(NULL, _entry_size, MISSING_BUDGET);
+    if (filename)
+        _load(missing);
+
+    return missing;
+}
+
+/* Save the pending changes before freeing. */
+void maep_tile_missing_free(MaepTileMissing *missing)
+{
+    GError *error = NULL;
+
+    g_return_if_fail(missing);
+
+    if (missing->dirty && !maep_tile_missing_save(missing, &error)) {
+        g_warning("%s", error->message);
+        g_error_free(error);
+    }
+    maep_tile_cache_free(missing->tiles);
+    g_free(missing->filename);
+    g_slice_free(MaepTileMissing, missing);
+}
+
+void maep_tile_missing_set_ttl(MaepTileMissing *missing, guint ttl)
+{
+    g_return_if_fail(missing);
+
+    missing->ttl = ttl;
+}
+
+/* Expired tiles are forgotten on lookup. */
+gboolean maep_tile_missing_contains(MaepTileMissing *missing, MaepTileKey key)
+{
+    gpointer stamp;
+
+    g_return_val_if_fail(missing, FALSE);
+
+    stamp = maep_tile_cache_lookup(missing->tiles, key);
+    if (!stamp)
+        return FALSE;
+    if (!_expired(missing, stamp, time(NULL)))
+        return TRUE;
+
+    maep_tile_cache_remove(missing->tiles, key);
+    missing->dirty = TRUE;
+    return FALSE;
+}
+
+void maep_tile_missing_add(MaepTileMissing *missing, MaepTileKey key)
+{
+    g_return_if_fail(missing);
+
+    maep_tile_cache_insert(missing->tiles, key, GUINT_TO_POINTER((guint)time(NULL)));
+    missing->dirty = TRUE;
+}
+
+void maep_tile_missing_remove(MaepTileMissing *missing, MaepTileKey key)
+{
+    g_return_if_fail(missing);
+
+    if (maep_tile_cache_remove(missing->tiles, key))
+        missing->dirty = TRUE;
+}
+
+void maep_tile_missing_clear(MaepTileMissing *missing)
+{
+    g_return_if_fail(missing);
+
+    maep_tile_cache_remove_all(missing->tiles);
+    missing->dirty = TRUE;
+}
+
+gboolean maep_tile_missing_is_dirty(const MaepTileMissing *missing)
+{
+    g_return_val_if_fail(missing, FALSE);
+
+    return missing->dirty;
+}
+
+typedef struct {
+    const MaepTileMissing *missing;
+    time_t now;
+    GByteArray *data;
+} missing_save_t;
+
+static void _append_entry(MaepTileKey key, gpointer value, gpointer data)
+{
+    missing_save_t *save = (missing_save_t*)data;
+    guint64 key_le;
+    guint32 stamp_le;
+
+    if (_expired(save->missing, value, save->now))
+        return;
+
+    key_le = GUINT64_TO_LE(key & ~SOURCE_MASK);
+    stamp_le = GUINT32_TO_LE(GPOINTER_TO_UINT(value));
+    g_byte_array_append(save->data, (const guint8*)&key_le, sizeof(key_le));
+    g_byte_array_append(save->data, (const guint8*)&stamp_le, sizeof(stamp_le));
+}
+
+/* Write the tiles still missing, the file is removed when there are
+   none. */
+gboolean maep_tile_missing_save(MaepTileMissing *missing, GError **error)
+{
+    missing_save_t save;
+    gchar *dirname;
+    gboolean ret;
+
+    g_return_val_if_fail(missing, FALSE);
+
+    if (!missing->filename) {
+        missing->dirty = FALSE;
+        return TRUE;
+    }
+
+    save.missing = missing;
+    save.now = time(NULL);
+    save.data = g_byte_array_sized_new(MISSING_HEADER_SIZE + MISSING_ENTRY_SIZE *
+                                       maep_tile_cache_size(missing->tiles));
+    g_byte_array_append(save.data, (const guint8*)MISSING_MAGIC, MISSING_HEADER_SIZE);
+    maep_tile_cache_foreach(missing->tiles, _append_entry, &save);
+
+    if (save.data->len == MISSING_HEADER_SIZE) {
+        g_unlink(missing->filename);
+        ret = TRUE;
+    } else {
+        dirname = g_path_get_dirname(missing->filename);
+        g_mkdir_with_parents(dirname, 0700);
+        g_free(dirname);
+        ret = g_file_set_contents(missing->filename, (const gchar*)save.data->data,
+                                  save.data->len, error);
+    }
+    g_byte_array_free(save.data, TRUE);
+
+    if (ret)
+        missing->dirty = FALSE;
+    return ret;
+}
@@ -0,0 +1,57 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * Copyright (C) 2017 Damien Caliste <dcaliste@free.fr>
+ *
+ * This file is part of Maep.
+ *
+ * Maep is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Maep is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Maep.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef TILE_MISSING_H
+#define TILE_MISSING_H
+
+#include <glib.h>
+
+#include "tile-cache.h"
+
+G_BEGIN_DECLS
+
+/* The tiles a server answered it does not have, so they are not asked
+   again before some time. The set is bounded in memory, the least
+   used tiles are forgotten first, and it can be kept in a file. Not
+   thread safe. */
+typedef struct _MaepTileMissing MaepTileMissing;
+
+MaepTileMissing* maep_tile_missing_new      (const gchar *filename,
+                                             guint source_id, guint ttl);
+void             maep_tile_missing_free     (MaepTileMissing *missing);
+
+void             maep_tile_missing_set_ttl  (MaepTileMissing *missing,
+                                             guint ttl);
+gboolean         maep_tile_missing_contains (MaepTileMissing *missing,
+                                             MaepTileKey key);
+void             maep_tile_missing_add      (MaepTileMissing *missing,
+                                             MaepTileKey key);
+void             maep_tile_missing_remove   (MaepTileMissing *missing,
+                                             MaepTileKey key);
+void             maep_tile_missing_clear    (MaepTileMissing *missing);
+
+gboolean         maep_tile_missing_is_dirty (const MaepTileMissing *missing);
+gboolean         maep_tile_missing_save     (MaepTileMissing *missing,
+                                             GError **error);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,1619 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * Copyright (C) 2017 Damien Caliste <dcaliste@free.fr>
+ *
+ * This file is part of Maep.
+ *
+ * Maep is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Maep is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Maep.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tile-store.h"
+#include "tile-index.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <utime.h>
+#include <glib/gstdio.h>
+
+/* The validators of a tile are kept next to it in the directory
+   layout. */
+#define META_SUFFIX ".meta"
+
+/* The tiles present in a directory layout are indexed in memory with
+   their mtime, one zoom level at a time, when first asked for. Until
+   a level is scanned, tiles are looked up on disk. The system often
+   does not maintain the access time of the files, it is set when
+   tiles are used, not more often than every ATIME_PERIOD seconds. */
+#define ZOOM_LEVELS        256
+#define ATIME_PERIOD       3600
+enum {
+    ZOOM_UNKNOWN,
+    ZOOM_SCANNING,
+    ZOOM_INDEXED
+};
+
+/* A pack is a header followed by records, each made of a record
+   header, the tile data and its validators. Records are only
+   appended, a newer record for the same tile hides the older
+   ones. All integers are little endian.
+
+   pack header:   "MAEPPACK" | version (4) | reserved (4)
+   record header: magic (4) | zoom (1) | flags (1) | meta length (2) |
+                  x (4) | y (4) | data length (4) | reserved (4) |
+                  mtime (8)
+
+   The position of the last record of each tile is kept in memory,
+   with its last access, and saved in an index file aside on close,
+   on sync and every INDEX_SAVE_PERIOD while tiles are written. On
+   open, the records appended after the saved index are scanned
+   again, so a pack is never lost when the index is outdated or
+   missing. */
+#define PACK_SUFFIX        ".pack"
+#define PACK_INDEX_SUFFIX  ".idx"
+#define PACK_MAGIC         "MAEPPACK"
+#define PACK_VERSION       1
+#define PACK_HEADER_SIZE   16
+#define RECORD_MAGIC       0x454c4954
+#define RECORD_HEADER_SIZE 32
+#define RECORD_MTIME       24
+#define RECORD_REMOVED     (1 << 0)
+#define INDEX_MAGIC        "MAEPIDX2"
+#define INDEX_HEADER_SIZE  24
+#define INDEX_ENTRY_SIZE   40
+#define INDEX_SAVE_PERIOD  (60 * G_TIME_SPAN_SECOND)
+#define COMPACT_SUFFIX     ".tmp"
+
+typedef struct
+{
+    guint64 offset;
+    guint32 len;
+    guint16 meta_len;
+    gint64 mtime;
+    guint32 atime;
+} MaepPackEntry;
+
+typedef struct
+{
+    gint64 mtime;
+    guint32 atime;
+    guint32 size;
+} MaepDirEntry;
+
+/* A read only mapping of the pack, shared with the borrowed tiles. A
+   larger one replaces it when the pack has grown, the older one is
+   unmapped once its last tile is released. */
+typedef struct
+{
+    gint ref_count;
+    guchar *addr;
+    gsize len;
+} MaepPackMap;
+
+struct _MaepTileStore
+{
+    gint ref_count;
+    MaepTileStoreKind kind;
+    gchar *path;
+    gchar *suffix;
+
+    /* Protected by lock. For a pack, the last record of each tile,
+       for a directory, the mtime of the tiles found on disk. The
+       generation changes on clear. */
+    GMutex lock;
+    MaepTileIndex *index;
+    guint generation;
+
+    /* Pack only, protected by lock. */
+    gboolean opened;
+    int fd;
+    guint64 end;
+    MaepPackMap *map;
+    gboolean dirty, broken, unmappable;
+    gint64 saved_at;
+
+    /* Directory only, zooms is protected by lock. */
+    GThreadPool *scanner;
+    guchar zooms[ZOOM_LEVELS];
+    gint closing;
+};
+
+static GQuark store_quark = 0;
+
+GQuark maep_tile_store_get_error()
+{
+    if (!store_quark)
+        store_quark = g_quark_from_static_string("MAEP_TILE_STORE");
+    return store_quark;
+}
+
+static gboolean _pread_all(int fd, gpointer buf, gsize len, guint64 offset)
+{
+    gssize n;
+
+    while (len > 0) {
+        n = pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        buf = (guchar*)buf + n;
+        len -= n;
+        offset += n;
+    }
+    return TRUE;
+}
+
+static gboolean _pwrite_all(int fd, gconstpointer buf, gsize len, guint64 offset)
+{
+    gssize n;
+
+    while (len > 0) {
+        n = pwrite(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        buf = (const guchar*)buf + n;
+        len -= n;
+        offset += n;
+    }
+    return TRUE;
+}
+
+static inline void _put32(guchar *at, guint32 val)
+{
+    val = GUINT32_TO_LE(val);
+    memcpy(at, &val, sizeof(val));
+}
+static inline void _put64(guchar *at, guint64 val)
+{
+    val = GUINT64_TO_LE(val);
+    memcpy(at, &val, sizeof(val));
+}
+static inline guint32 _get32(const guchar *at)
+{
+    guint32 val;
+
+    memcpy(&val, at, sizeof(val));
+    return GUINT32_FROM_LE(val);
+}
+static inline guint64 _get64(const guchar *at)
+{
+    guint64 val;
+
+    memcpy(&val, at, sizeof(val));
+    return GUINT64_FROM_LE(val);
+}
+
+static inline MaepTileKey _key(int zoom, int x, int y)
+{
+    return MAEP_TILE_KEY(0, zoom, x, y);
+}
+
+/* Directory layout. */
+
+static gchar* _dir_filename(const MaepTileStore *store, int zoom, int x, int y)
+{
+    return g_strdup_printf("%s%c%d%c%d%c%d.%s",
+                           store->path, G_DIR_SEPARATOR,
+                           zoom, G_DIR_SEPARATOR,
+                           x, G_DIR_SEPARATOR,
+                           y, store->suffix);
+}
+
+/* Called with the lock held. */
+static void _dir_set(MaepTileStore *store, MaepTileKey key,
+                     time_t mtime, time_t atime, gsize size)
+{
+    MaepDirEntry *entry;
+
+    entry = maep_tile_index_insert(store->index, key);
+    entry->mtime = mtime;
+    entry->atime = atime;
+    entry->size = size;
+}
+
+static gboolean _dir_write(MaepTileStore *store, int zoom, int x, int y,
+                           const gchar *data, gsize len,
+                           const gchar *meta, time_t mtime, GError **error)
+{
+    gchar *filename, *folder, *meta_file;
+    struct utimbuf times;
+    gboolean saved;
+
+    filename = _dir_filename(store, zoom, x, y);
+    folder = g_path_get_dirname(filename);
+    if (g_mkdir_with_parents(folder, 0700)) {
+        g_set_error(error, MAEP_TILE_STORE_ERROR, MAEP_TILE_STORE_ERROR_FILE,
+                    "cannot create tile directory '%s'", folder);
+        g_free(folder);
+        g_free(filename);
+        return FALSE;
+    }
+    g_free(folder);
+
+    /* Written atomically, so a partial tile is never read back. */
+    saved = g_file_set_contents(filename, data, len, error);
+    if (saved && mtime) {
+        times.actime = times.modtime = mtime;
+        g_utime(filename, &times);
+    }
+    if (saved) {
+        g_mutex_lock(&store->lock);
+        _dir_set(store, _key(zoom, x, y), mtime ? mtime : time(NULL), time(NULL), len);
+        g_mutex_unlock(&store->lock);
+    }
+
+    /* Validators of a previous version must not stay. */
+    meta_file = g_strconcat(filename, META_SUFFIX, NULL);
+    if (saved && meta)
+        g_file_set_contents(meta_file, meta, -1, NULL);
+    else
+        g_unlink(meta_file);
+    g_free(meta_file);
+
+    g_free(filename);
+    return saved;
+}
+
+static gboolean _parse_int(const gchar *str, const gchar *suffix, int *val)
+{
+    gchar *end;
+    gint64 v;
+
+    v = g_ascii_strtoll(str, &end, 10);
+    if (end == str || v < 0 || v > G_MAXINT)
+        return FALSE;
+    if (suffix ? (*end != '.' || strcmp(end + 1, suffix)) : *end != '\0')
+        return FALSE;
+    *val = (int)v;
+    return TRUE;
+}
+
+/* Walk the <zoom>/<x>/<y>.<suffix> tree, removing the files and the
+   emptied directories if asked so. */
+static void _dir_walk(MaepTileStore *store, MaepTileStoreFunc func,
+                      gpointer user_data, gboolean remove)
+{
+    GDir *zdir, *xdir, *ydir;
+    const gchar *zname, *xname, *yname;
+    gchar *zpath, *xpath, *ypath;
+    int zoom, x, y;
+
+    zdir = g_dir_open(store->path, 0, NULL);
+    if (!zdir)
+        return;
+    while ((zname = g_dir_read_name(zdir))) {
+        if (!_parse_int(zname, NULL, &zoom))
+            continue;
+        zpath = g_build_filename(store->path, zname, NULL);
+        xdir = g_dir_open(zpath, 0, NULL);
+        while (xdir && (xname = g_dir_read_name(xdir))) {
+            if (!_parse_int(xname, NULL, &x))
+                continue;
+            xpath = g_build_filename(zpath, xname, NULL);
+            ydir = g_dir_open(xpath, 0, NULL);
+            while (ydir && (yname = g_dir_read_name(ydir))) {
+                if (remove) {
+                    if (_parse_int(yname, store->suffix, &y) ||
+                        g_str_has_suffix(yname, META_SUFFIX)) {
+                        ypath = g_build_filename(xpath, yname, NULL);
+                        g_unlink(ypath);
+                        g_free(ypath);
+                    }
+                } else if (_parse_int(yname, store->suffix, &y))
+                    func(zoom, x, y, user_data);
+            }
+            if (ydir)
+                g_dir_close(ydir);
+            if (remove)
+                g_rmdir(xpath);
+            g_free(xpath);
+        }
+        if (xdir)
+            g_dir_close(xdir);
+        if (remove)
+            g_rmdir(zpath);
+        g_free(zpath);
+    }
+    g_dir_close(zdir);
+    if (remove)
+        g_rmdir(store->path);
+}
+
+typedef struct
+{
+    MaepTileKey key;
+    gint64 mtime, atime;
+    gsize size;
+} MaepDirTile;
+
+/* Index the tiles of one zoom level. The access time of the files is
+   the one set when last used, not older than when written. */
+static void _dir_scan_zoom(MaepTileStore *store, int zoom)
+{
+    GDir *xdir, *ydir;
+    const gchar *xname, *yname;
+    gchar *zpath, *xpath, *ypath;
+    GArray *found;
+    MaepDirTile tile;
+    struct stat buf;
+    guint generation, i;
+    int x, y;
+
+    g_mutex_lock(&store->lock);
+    generation = store->generation;
+    g_mutex_unlock(&store->lock);
+
+    found = g_array_new(FALSE, FALSE, sizeof(MaepDirTile));
+    zpath = g_strdup_printf("%s%c%d", store->path, G_DIR_SEPARATOR, zoom);
+    xdir = g_dir_open(zpath, 0, NULL);
+    while (xdir && (xname = g_dir_read_name(xdir)) &&
+           !g_atomic_int_get(&store->closing)) {
+        if (!_parse_int(xname, NULL, &x))
+            continue;
+        xpath = g_build_filename(zpath, xname, NULL);
+        ydir = g_dir_open(xpath, 0, NULL);
+        while (ydir && (yname = g_dir_read_name(ydir))) {
+            if (!_parse_int(yname, store->suffix, &y))
+                continue;
+            ypath = g_build_filename(xpath, yname, NULL);
+            if (!g_stat(ypath, &buf)) {
+                tile.key = _key(zoom, x, y);
+                tile.mtime = buf.st_mtime;
+                tile.atime = MAX(buf.st_atime, buf.st_mtime);
+                tile.size = buf.st_size;
+                g_array_append_val(found, tile);
+            }
+            g_free(ypath);
+        }
+        if (ydir)
+            g_dir_close(ydir);
+        g_free(xpath);
+    }
+    if (xdir)
+        g_dir_close(xdir);
+    g_free(zpath);
+
+    g_mutex_lock(&store->lock);
+    /* Tiles written meanwhile are newer, a clear makes the scan
+       useless. */
+    if (generation == store->generation && !g_atomic_int_get(&store->closing)) {
+        for (i = 0; i < found->len; i++) {
+            tile = g_array_index(found, MaepDirTile, i);
+            if (!maep_tile_index_lookup(store->index, tile.key))
+                _dir_set(store, tile.key, (time_t)tile.mtime,
+                         (time_t)tile.atime, tile.size);
+        }
+        store->zooms[zoom] = ZOOM_INDEXED;
+    } else if (!g_atomic_int_get(&store->closing))
+        /* Scanned again when next looked up. */
+        store->zooms[zoom] = ZOOM_UNKNOWN;
+    g_mutex_unlock(&store->lock);
+    g_array_free(found, TRUE);
+}
+
+/* Run in the scanner thread. */
+static void _dir_scan(gpointer data, gpointer user_data)
+{
+    _dir_scan_zoom((MaepTileStore*)user_data, GPOINTER_TO_INT(data) - 1);
+}
+
+/* Index all the zoom levels on disk now. */
+static void _dir_index_all(MaepTileStore *store)
+{
+    GDir *zdir;
+    const gchar *zname;
+    gboolean indexed;
+    int zoom;
+
+    zdir = g_dir_open(store->path, 0, NULL);
+    if (!zdir)
+        return;
+    while ((zname = g_dir_read_name(zdir))) {
+        if (!_parse_int(zname, NULL, &zoom) || zoom >= ZOOM_LEVELS)
+            continue;
+        g_mutex_lock(&store->lock);
+        indexed = (store->zooms[zoom] == ZOOM_INDEXED);
+        if (!indexed)
+            store->zooms[zoom] = ZOOM_SCANNING;
+        g_mutex_unlock(&store->lock);
+        /* A scan may be queued for this level already, the second
+           one only finds the level indexed. */
+        if (!indexed)
+            _dir_scan_zoom(store, zoom);
+    }
+    g_dir_close(zdir);
+}
+
+/* Tell if the zoom level is indexed, start its scan otherwise. Called
+   with the lock held. */
+static gboolean _dir_indexed(MaepTileStore *store, int zoom)
+{
+    if (zoom < 0 || zoom >= ZOOM_LEVELS)
+        return FALSE;
+
+    if (store->zooms[zoom] == ZOOM_UNKNOWN) {
+        store->zooms[zoom] = ZOOM_SCANNING;
+        g_thread_pool_push(store->scanner, GINT_TO_POINTER(zoom + 1), NULL);
+    }
+    return (store->zooms[zoom] == ZOOM_INDEXED);
+}
+
+/* Pack layout. */
+
+static void _pack_set(MaepTileStore *store, const guchar *header, guint64 offset)
+{
+    MaepPackEntry *entry;
+    MaepTileKey key;
+
+    key = _key(header[4], _get32(header + 8), _get32(header + 12));
+    if (header[5] & RECORD_REMOVED) {
+        maep_tile_index_remove(store->index, key);
+        return;
+    }
+
+    entry = maep_tile_index_insert(store->index, key);
+    entry->offset = offset;
+    entry->len = _get32(header + 16);
+    entry->meta_len = header[6] | (header[7] << 8);
+    entry->mtime = (gint64)_get64(header + RECORD_MTIME);
+    entry->atime = (guint32)entry->mtime;
+}
+
+static void _pack_map_unref(gpointer data)
+{
+    MaepPackMap *map = (MaepPackMap*)data;
+
+    if (!g_atomic_int_dec_and_test(&map->ref_count))
+        return;
+
+    munmap(map->addr, map->len);
+    g_slice_free(MaepPackMap, map);
+}
+
+/* Map the pack up to at least end, called with the lock held. When
+   the pack cannot be mapped, it is not tried again until it is
+   rewritten, tiles are read instead. */
+static MaepPackMap* _pack_map(MaepTileStore *store, guint64 end)
+{
+    MaepPackMap *map;
+    gpointer addr;
+
+    if (store->map && store->map->len >= end)
+        return store->map;
+    if (store->unmappable)
+        return NULL;
+
+    addr = mmap(NULL, store->end, PROT_READ, MAP_SHARED, store->fd, 0);
+    if (addr == MAP_FAILED) {
+        g_warning("Cannot map '%s': %s, reading tiles instead.",
+                  store->path, g_strerror(errno));
+        store->unmappable = TRUE;
+        return NULL;
+    }
+    /* Tiles are read in no particular order. */
+    madvise(addr, store->end, MADV_RANDOM);
+
+    map = g_slice_new(MaepPackMap);
+    map->ref_count = 1;
+    map->addr = addr;
+    map->len = store->end;
+    if (store->map)
+        _pack_map_unref(store->map);
+    store->map = map;
+    return map;
+}
+
+static guint64 _pack_load_index(MaepTileStore *store)
+{
+    gchar *filename, *data;
+    gsize len, n, i;
+    const guchar *at;
+    MaepPackEntry *entry;
+    guint64 end;
+
+    filename = g_strconcat(store->path, PACK_INDEX_SUFFIX, NULL);
+    if (!g_file_get_contents(filename, &data, &len, NULL)) {
+        g_free(filename);
+        return PACK_HEADER_SIZE;
+    }
+    g_free(filename);
+
+    at = (const guchar*)data;
+    if (len < INDEX_HEADER_SIZE || memcmp(at, INDEX_MAGIC, 8)) {
+        g_free(data);
+        return PACK_HEADER_SIZE;
+    }
+    end = _get64(at + 8);
+    n = _get32(at + 16);
+    if (len != INDEX_HEADER_SIZE + n * INDEX_ENTRY_SIZE) {
+        g_free(data);
+        return PACK_HEADER_SIZE;
+    }
+
+    for (i = 0, at += INDEX_HEADER_SIZE; i < n; i++, at += INDEX_ENTRY_SIZE) {
+        entry = maep_tile_index_insert(store->index, _get64(at));
+        entry->offset = _get64(at + 8);
+        entry->len = _get32(at + 16);
+        entry->meta_len = _get32(at + 20);
+        entry->mtime = (gint64)_get64(at + 24);
+        entry->atime = _get32(at + 32);
+    }
+    g_free(data);
+
+    return end;
+}
+
+static void _pack_append_entry(MaepTileKey key, gpointer value, gpointer data)
+{
+    MaepPackEntry *entry = (MaepPackEntry*)value;
+    guchar buf[INDEX_ENTRY_SIZE];
+
+    _put64(buf, key);
+    _put64(buf + 8, entry->offset);
+    _put32(buf + 16, entry->len);
+    _put32(buf + 20, entry->meta_len);
+    _put64(buf + 24, (guint64)entry->mtime);
+    _put32(buf + 32, entry->atime);
+    _put32(buf + 36, 0);
+    g_byte_array_append((GByteArray*)data, buf, INDEX_ENTRY_SIZE);
+}
+
+static void _pack_save_index(MaepTileStore *store)
+{
+    GByteArray *data;
+    guchar header[INDEX_HEADER_SIZE];
+    gchar *filename;
+    GError *error;
+
+    memset(header, '\0', INDEX_HEADER_SIZE);
+    memcpy(header, INDEX_MAGIC, 8);
+    _put64(header + 8, store->end);
+    _put32(header + 16, maep_tile_index_size(store->index));
+
+    data = g_byte_array_sized_new(INDEX_HEADER_SIZE +
+                                  maep_tile_index_size(store->index) * INDEX_ENTRY_SIZE);
+    g_byte_array_append(data, header, INDEX_HEADER_SIZE);
+    maep_tile_index_foreach(store->index, _pack_append_entry, data);
+
+    filename = g_strconcat(store->path, PACK_INDEX_SUFFIX, NULL);
+    error = NULL;
+    if (!g_file_set_contents(filename, (const gchar*)data->data, data->len, &error)) {
+        g_warning("%s", error->message);
+        g_error_free(error);
+    } else
+        store->dirty = FALSE;
+    store->saved_at = g_get_monotonic_time();
+    g_free(filename);
+    g_byte_array_free(data, TRUE);
+}
+
+/* Index the records after from, a truncated last record is dropped. */
+static void _pack_scan(MaepTileStore *store, guint64 from)
+{
+    guchar header[RECORD_HEADER_SIZE];
+    struct stat buf;
+    guint64 offset, next;
+
+    if (fstat(store->fd, &buf))
+        return;
+
+    for (offset = from; offset + RECORD_HEADER_SIZE <= (guint64)buf.st_size;
+         offset = next) {
+        if (!_pread_all(store->fd, header, RECORD_HEADER_SIZE, offset) ||
+            _get32(header) != RECORD_MAGIC)
+            break;
+        next = offset + RECORD_HEADER_SIZE + _get32(header + 16) +
+            (header[6] | (header[7] << 8));
+        if (next > (guint64)buf.st_size)
+            break;
+        _pack_set(store, header, offset);
+        store->dirty = TRUE;
+    }
+    if (offset < (guint64)buf.st_size) {
+        g_warning("Dropping %"G_GUINT64_FORMAT" trailing bytes from '%s'.",
+                  (guint64)buf.st_size - offset, store->path);
+        if (ftruncate(store->fd, offset))
+            g_warning("Cannot truncate '%s'.", store->path);
+    }
+    store->end = offset;
+}
+
+static void _pack_open(MaepTileStore *store)
+{
+    guchar header[PACK_HEADER_SIZE];
+    struct stat buf;
+    guint64 from;
+
+    store->fd = g_open(store->path, O_RDWR, 0);
+    if (store->fd < 0)
+        return;
+
+    if (!fstat(store->fd, &buf) && buf.st_size < PACK_HEADER_SIZE) {
+        /* Interrupted creation, start again on next write. */
+        close(store->fd);
+        store->fd = -1;
+        return;
+    }
+    if (!_pread_all(store->fd, header, PACK_HEADER_SIZE, 0) ||
+        memcmp(header, PACK_MAGIC, 8) || _get32(header + 8) != PACK_VERSION) {
+        g_warning("'%s' is not a tile pack, ignoring.", store->path);
+        close(store->fd);
+        store->fd = -1;
+        store->broken = TRUE;
+        return;
+    }
+
+    from = _pack_load_index(store);
+    if (fstat(store->fd, &buf) || from > (guint64)buf.st_size || from < PACK_HEADER_SIZE) {
+        /* The index does not belong to this pack. */
+        maep_tile_index_remove_all(store->index);
+        from = PACK_HEADER_SIZE;
+    }
+    _pack_scan(store, from);
+    store->saved_at = g_get_monotonic_time();
+}
+
+/* Take the lock. A pack is opened on first use, so that creating a
+   store never reads the disk. */
+static void _lock(MaepTileStore *store)
+{
+    g_mutex_lock(&store->lock);
+    if (store->kind == MAEP_TILE_STORE_PACK && !store->opened) {
+        store->opened = TRUE;
+        _pack_open(store);
+    }
+}
+
+static gboolean _pack_create(MaepTileStore *store, GError **error)
+{
+    guchar header[PACK_HEADER_SIZE];
+    gchar *folder, *filename;
+
+    folder = g_path_get_dirname(store->path);
+    g_mkdir_with_parents(folder, 0700);
+    g_free(folder);
+
+    /* An index left from a previous pack would describe records
+       that are not there anymore. */
+    filename = g_strconcat(store->path, PACK_INDEX_SUFFIX, NULL);
+    g_unlink(filename);
+    g_free(filename);
+
+    store->fd = g_open(store->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (store->fd < 0) {
+        g_set_error(error, MAEP_TILE_STORE_ERROR, MAEP_TILE_STORE_ERROR_FILE,
+                    "cannot create tile pack '%s': %s", store->path,
+                    g_strerror(errno));
+        return FALSE;
+    }
+
+    memset(header, '\0', PACK_HEADER_SIZE);
+    memcpy(header, PACK_MAGIC, 8);
+    _put32(header + 8, PACK_VERSION);
+    if (!_pwrite_all(store->fd, header, PACK_HEADER_SIZE, 0)) {
+        g_set_error(error, MAEP_TILE_STORE_ERROR, MAEP_TILE_STORE_ERROR_FILE,
+                    "cannot write tile pack '%s': %s", store->path,
+                    g_strerror(errno));
+        close(store->fd);
+        store->fd = -1;
+        g_unlink(store->path);
+        return FALSE;
+    }
+    store->end = PACK_HEADER_SIZE;
+    store->saved_at = g_get_monotonic_time();
+    return TRUE;
+}
+
+static gboolean _pack_write(MaepTileStore *store, int zoom, int x, int y,
+                            const gchar *data, gsize len,
+                            const gchar *meta, time_t mtime, GError **error)
+{
+    guchar *record;
+    gsize meta_len, size;
+    gboolean saved;
+
+    meta_len = meta ? MIN(strlen(meta), G_MAXUINT16) : 0;
+    size = RECORD_HEADER_SIZE + len + meta_len;
+    record = g_malloc0(size);
+    _put32(record, RECORD_MAGIC);
+    record[4] = zoom;
+    record[6] = meta_len & 0xff;
+    record[7] = meta_len >> 8;
+    _put32(record + 8, x);
+    _put32(record + 12, y);
+    _put32(record + 16, len);
+    _put64(record + RECORD_MTIME, (guint64)(mtime ? mtime : time(NULL)));
+    memcpy(record + RECORD_HEADER_SIZE, data, len);
+    if (meta_len)
+        memcpy(record + RECORD_HEADER_SIZE + len, meta, meta_len);
+
+    _lock(store);
+    saved = !store->broken && (store->fd >= 0 || _pack_create(store, error));
+    if (saved && !_pwrite_all(store->fd, record, size, store->end)) {
+        g_set_error(error, MAEP_TILE_STORE_ERROR, MAEP_TILE_STORE_ERROR_FILE,
+                    "cannot write tile pack '%s': %s", store->path,
+                    g_strerror(errno));
+        /* Drop what may have been written. */
+        if (ftruncate(store->fd, store->end))
+            g_warning("Cannot truncate '%s'.", store->path);
+        saved = FALSE;
+    } else if (saved) {
+        _pack_set(store, record, store->end);
+        store->end += size;
+        store->dirty = TRUE;
+        /* Keep the index close to the pack, should the application
+           not be closed properly. */
+        if (g_get_monotonic_time() - store->saved_at >= INDEX_SAVE_PERIOD)
+            _pack_save_index(store);
+    } else if (store->broken)
+        g_set_error(error, MAEP_TILE_STORE_ERROR, MAEP_TILE_STORE_ERROR_FILE,
+                    "'%s' is not a tile pack", store->path);
+    g_mutex_unlock(&store->lock);
+
+    g_free(record);
+    return saved;
+}
+
+typedef struct
+{
+    MaepTileKey key;
+    guint64 from, to;
+    guint32 size;
+    gint64 mtime;
+} MaepPackMove;
+
+static void _collect_move(MaepTileKey key, gpointer value, gpointer data)
+{
+    MaepPackEntry *entry = (MaepPackEntry*)value;
+    MaepPackMove move;
+
+    move.key = key;
+    move.from = entry->offset;
+    move.to = 0;
+    move.size = RECORD_HEADER_SIZE + entry->len + entry->meta_len;
+    move.mtime = entry->mtime;
+    g_array_append_val((GArray*)data, move);
+}
+
+static gint _cmp_from(gconstpointer a, gconstpointer b)
+{
+    guint64 fa = ((const MaepPackMove*)a)->from;
+    guint64 fb = ((const MaepPackMove*)b)->from;
+
+    return (fa < fb) ? -1 : (fa > fb);
+}
+
+typedef struct
+{
+    guint64 from, to;
+} MaepPackShift;
+
+static void _shift_entry(G_GNUC_UNUSED MaepTileKey key, gpointer value, gpointer data)
+{
+    MaepPackEntry *entry = (MaepPackEntry*)value;
+    MaepPackShift *shift = (MaepPackShift*)data;
+
+    if (entry->offset >= shift->from)
+        entry->offset = entry->offset - shift->from + shift->to;
+}
+
+/* Rewrite the pack with the indexed records only, so the space of the
+   removed and replaced tiles is given back. The records are copied
+   without the lock, in the pack order, while readers and the writer
+   go on with the old pack. Under the lock, the records appended
+   meanwhile are copied too and the new pack replaces the old one. */
+static gboolean _pack_compact(MaepTileStore *store)
+{
+    GArray *moves;
+    MaepPackMove *move;
+    MaepPackEntry *entry;
+    MaepPackShift shift;
+    guchar header[PACK_HEADER_SIZE], mtime[8], *buf;
+    gchar *filename;
+    gsize size, alloc;
+    guint64 end, from;
+    guint generation, i;
+    gboolean done;
+    int fd, src;
+
+    g_mutex_lock(&store->lock);
+    src = store->fd >= 0 ? dup(store->fd) : -1;
+    from = store->end;
+    generation = store->generation;
+    moves = g_array_sized_new(FALSE, FALSE, sizeof(MaepPackMove),
+                              maep_tile_index_size(store->index));
+    maep_tile_index_foreach(store->index, _collect_move, moves);
+    g_mutex_unlock(&store->lock);
+    if (src < 0) {
+        g_array_free(moves, TRUE);
+        return FALSE;
+    }
+    g_array_sort(moves, _cmp_from);
+
+    filename = g_strconcat(store->path, COMPACT_SUFFIX, NULL);
+    fd = g_open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        g_warning("Cannot create '%s': %s.", filename, g_strerror(errno));
+        close(src);
+        g_free(filename);
+        g_array_free(moves, TRUE);
+        return FALSE;
+    }
+
+    memset(header, '\0', PACK_HEADER_SIZE);
+    memcpy(header, PACK_MAGIC, 8);
+    _put32(header + 8, PACK_VERSION);
+    done = _pwrite_all(fd, header, PACK_HEADER_SIZE, 0);
+    end = PACK_HEADER_SIZE;
+
+    buf = NULL;
+    alloc = 0;
+    for (i = 0; done && i < moves->len; i++) {
+        move = &g_array_index(moves, MaepPackMove, i);
+        if (move->size > alloc) {
+            alloc = move->size;
+            buf = g_realloc(buf, alloc);
+        }
+        done = _pread_all(src, buf, move->size, move->from) &&
+            _pwrite_all(fd, buf, move->size, end);
+        move->to = end;
+        end += move->size;
+    }
+    close(src);
+    done = done && !fsync(fd);
+
+    g_mutex_lock(&store->lock);
+    /* Cleared meanwhile. */
+    done = done && store->generation == generation && store->fd >= 0;
+    shift.from = from;
+    shift.to = end;
+    if (done && store->end > from) {
+        size = store->end - from;
+        if (size > alloc) {
+            alloc = size;
+            buf = g_realloc(buf, alloc);
+        }
+        done = _pread_all(store->fd, buf, size, from) &&
+            _pwrite_all(fd, buf, size, end);
+        end += size;
+    }
+    g_free(buf);
+    for (i = 0; done && i < moves->len; i++) {
+        move = &g_array_index(moves, MaepPackMove, i);
+        entry = maep_tile_index_lookup(store->index, move->key);
+        /* Removed or stored again meanwhile. */
+        if (!entry || entry->offset != move->from) {
+            move->to = 0;
+            continue;
+        }
+        /* Touched after being copied. */
+        if (entry->mtime != move->mtime) {
+            _put64(mtime, (guint64)entry->mtime);
+            done = _pwrite_all(fd, mtime, sizeof(mtime), move->to + RECORD_MTIME);
+        }
+    }
+    done = done && !fsync(fd) && !g_rename(filename, store->path);
+    if (!done) {
+        g_mutex_unlock(&store->lock);
+        g_warning("Cannot compact '%s': %s.", store->path, g_strerror(errno));
+        close(fd);
+        g_unlink(filename);
+        g_free(filename);
+        g_array_free(moves, TRUE);
+        return FALSE;
+    }
+    g_free(filename);
+
+    maep_tile_index_foreach(store->index, _shift_entry, &shift);
+    for (i = 0; i < moves->len; i++) {
+        move = &g_array_index(moves, MaepPackMove, i);
+        if (move->to)
+            ((MaepPackEntry*)maep_tile_index_lookup(store->index, move->key))->offset =
+                move->to;
+    }
+    g_array_free(moves, TRUE);
+
+    /* Tiles borrowed from the old pack stay mapped. */
+    close(store->fd);
+    store->fd = fd;
+    store->end = end;
+    if (store->map)
+        _pack_map_unref(store->map);
+    store->map = NULL;
+    store->unmappable = FALSE;
+    _pack_save_index(store);
+    g_mutex_unlock(&store->lock);
+    return TRUE;
+}
+
+/* Public API. */
+
+MaepTileStore* maep_tile_store_new(MaepTileStoreKind kind,
+                                   const gchar *path, const gchar *suffix)
+{
+    MaepTileStore *store;
+
+    g_return_val_if_fail(path && suffix, NULL);
+
+    store = g_slice_new0(MaepTileStore);
+    store->ref_count = 1;
+    store->kind = kind;
+    store->suffix = g_strdup(suffix);
+    store->fd = -1;
+    g_mutex_init(&store->lock);
+    if (kind == MAEP_TILE_STORE_PACK) {
+        store->path = g_strconcat(path, PACK_SUFFIX, NULL);
+        store->index = maep_tile_index_new(sizeof(MaepPackEntry));
+    } else {
+        store->path = g_strdup(path);
+        store->index = maep_tile_index_new(sizeof(MaepDirEntry));
+        store->scanner = g_thread_pool_new(_dir_scan, store, 1, FALSE, NULL);
+    }
+
+    return store;
+}
+
+MaepTileStore* maep_tile_store_ref(MaepTileStore *store)
+{
+    g_return_val_if_fail(store, NULL);
+
+    g_atomic_int_inc(&store->ref_count);
+    return store;
+}
+
+void maep_tile_store_unref(MaepTileStore *store)
+{
+    g_return_if_fail(store);
+
+    if (!g_atomic_int_dec_and_test(&store->ref_count))
+        return;
+
+    if (store->kind == MAEP_TILE_STORE_PACK) {
+        if (store->fd >= 0) {
+            if (store->dirty)
+                _pack_save_index(store);
+            close(store->fd);
+        }
+        if (store->map)
+            _pack_map_unref(store->map);
+    } else {
+        /* Stop a running scan early. */
+        g_atomic_int_set(&store->closing, 1);
+        g_thread_pool_free(store->scanner, TRUE, TRUE);
+    }
+    maep_tile_index_free(store->index);
+    g_mutex_clear(&store->lock);
+    g_free(store->path);
+    g_free(store->suffix);
+    g_slice_free(MaepTileStore, store);
+}
+
+MaepTileStoreKind maep_tile_store_get_kind(const MaepTileStore *store)
+{
+    g_return_val_if_fail(store, MAEP_TILE_STORE_DIRECTORY);
+
+    return store->kind;
+}
+
+/* Only tiles of a directory layout have a file of their own. */
+gchar* maep_tile_store_get_filename(const MaepTileStore *store,
+                                    int zoom, int x, int y)
+{
+    g_return_val_if_fail(store, NULL);
+
+    if (store->kind != MAEP_TILE_STORE_DIRECTORY)
+        return NULL;
+
+    return _dir_filename(store, zoom, x, y);
+}
+
+/* Tell if a tile is stored, without disk access once its zoom level
+   is indexed. */
+gboolean maep_tile_store_stat(MaepTileStore *store, int zoom, int x, int y,
+                              time_t *mtime)
+{
+    MaepPackEntry *entry;
+    MaepDirEntry *dir_entry;
+    struct stat buf;
+    gchar *filename;
+    gboolean found, indexed;
+
+    g_return_val_if_fail(store, FALSE);
+
+    if (store->kind == MAEP_TILE_STORE_DIRECTORY) {
+        _lock(store);
+        indexed = _dir_indexed(store, zoom);
+        dir_entry = indexed ? maep_tile_index_lookup(store->index, _key(zoom, x, y)) : NULL;
+        if (dir_entry && mtime)
+            *mtime = (time_t)dir_entry->mtime;
+        g_mutex_unlock(&store->lock);
+        if (indexed)
+            return (dir_entry != NULL);
+
+        filename = _dir_filename(store, zoom, x, y);
+        found = !g_stat(filename, &buf);
+        g_free(filename);
+        if (found && mtime)
+            *mtime = buf.st_mtime;
+        return found;
+    }
+
+    _lock(store);
+    entry = maep_tile_index_lookup(store->index, _key(zoom, x, y));
+    if (entry && mtime)
+        *mtime = (time_t)entry->mtime;
+    g_mutex_unlock(&store->lock);
+    return (entry != NULL);
+}
+
+gboolean maep_tile_store_read(MaepTileStore *store, int zoom, int x, int y,
+                              gchar **data, gsize *len, GError **error)
+{
+    MaepPackEntry *entry;
+    gchar *filename;
+    gboolean read;
+
+    g_return_val_if_fail(store && data, FALSE);
+
+    if (store->kind == MAEP_TILE_STORE_DIRECTORY) {
+        filename = _dir_filename(store, zoom, x, y);
+        read = g_file_get_contents(filename, data, len, error);
+        g_free(filename);
+        return read;
+    }
+
+    _lock(store);
+    entry = maep_tile_index_lookup(store->index, _key(zoom, x, y));
+    if (!entry) {
+        g_mutex_unlock(&store->lock);
+        g_set_error(error, MAEP_TILE_STORE_ERROR, MAEP_TILE_STORE_ERROR_MISSING,
+                    "no tile %d/%d/%d in '%s'", zoom, x, y, store->path);
+        return FALSE;
+    }
+    *data = g_malloc(entry->len);
+    read = _pread_all(store->fd, *data, entry->len,
+                      entry->offset + RECORD_HEADER_SIZE);
+    if (read && len)
+        *len = entry->len;
+    g_mutex_unlock(&store->lock);
+
+    if (!read) {
+        g_set_error(error, MAEP_TILE_STORE_ERROR, MAEP_TILE_STORE_ERROR_FILE,
+                    "cannot read tile pack '%s': %s", store->path,
+                    g_strerror(errno));
+        g_free(*data);
+        *data = NULL;
+    }
+    return read;
+}
+
+gchar* maep_tile_store_get_meta(MaepTileStore *store, int zoom, int x, int y)
+{
+    MaepPackEntry *entry;
+    gchar *filename, *meta;
+
+    g_return_val_if_fail(store, NULL);
+
+    meta = NULL;
+    if (store->kind == MAEP_TILE_STORE_DIRECTORY) {
+        filename = _dir_filename(store, zoom, x, y);
+        if (g_file_test(filename, G_FILE_TEST_EXISTS)) {
+            gchar *meta_file = g_strconcat(filename, META_SUFFIX, NULL);
+            g_file_get_contents(meta_file, &meta, NULL, NULL);
+            g_free(meta_file);
+        }
+        g_free(filename);
+        return meta;
+    }
+
+    _lock(store);
+    entry = maep_tile_index_lookup(store->index, _key(zoom, x, y));
+    if (entry && entry->meta_len) {
+        meta = g_malloc0(entry->meta_len + 1);
+        if (!_pread_all(store->fd, meta, entry->meta_len,
+                        entry->offset + RECORD_HEADER_SIZE + entry->len)) {
+            g_free(meta);
+            meta = NULL;
+        }
+    }
+    g_mutex_unlock(&store->lock);
+    return meta;
+}
+
+/* Give access to the data of a tile without copying it, from a
+   mapping of its file or of the pack. The mapping is kept as long as
+   the returned bytes are. */
+GBytes* maep_tile_store_borrow(MaepTileStore *store, int zoom, int x, int y,
+                               GError **error)
+{
+    MaepPackEntry *entry;
+    MaepPackMap *map;
+    GMappedFile *file;
+    GBytes *bytes;
+    gchar *filename, *data;
+    gsize len;
+
+    g_return_val_if_fail(store, NULL);
+
+    if (store->kind == MAEP_TILE_STORE_DIRECTORY) {
+        filename = _dir_filename(store, zoom, x, y);
+        file = g_mapped_file_new(filename, FALSE, error);
+        g_free(filename);
+        if (!file)
+            return NULL;
+        bytes = g_mapped_file_get_bytes(file);
+        g_mapped_file_unref(file);
+        return bytes;
+    }
+
+    bytes = NULL;
+    _lock(store);
+    entry = maep_tile_index_lookup(store->index, _key(zoom, x, y));
+    map = entry ? _pack_map(store, entry->offset + RECORD_HEADER_SIZE + entry->len) : NULL;
+    if (map) {
+        g_atomic_int_inc(&map->ref_count);
+        bytes = g_bytes_new_with_free_func(map->addr + entry->offset + RECORD_HEADER_SIZE,
+                                           entry->len, _pack_map_unref, map);
+    }
+    g_mutex_unlock(&store->lock);
+    if (map)
+        return bytes;
+
+    /* The tile is missing, or the pack cannot be mapped. */
+    if (!maep_tile_store_read(store, zoom, x, y, &data, &len, error))
+        return NULL;
+    return g_bytes_new_take(data, len);
+}
+
+/* Hint that the tiles from (x0, y0) to (x1, y1) at zoom are about to
+   be borrowed, so the pages of a pack can be read ahead at once.
+   Separate files are left to the kernel. */
+void maep_tile_store_advise(MaepTileStore *store, int zoom,
+                            int x0, int y0, int x1, int y1)
+{
+    MaepPackEntry *entry;
+    MaepPackMap *map;
+    guint64 start, end;
+    gsize page;
+    int x, y;
+
+    g_return_if_fail(store);
+
+    if (store->kind != MAEP_TILE_STORE_PACK)
+        return;
+
+    page = sysconf(_SC_PAGESIZE);
+    _lock(store);
+    map = store->fd >= 0 ? _pack_map(store, store->end) : NULL;
+    for (x = x0; map && x <= x1; x++)
+        for (y = y0; y <= y1; y++) {
+            entry = maep_tile_index_lookup(store->index, _key(zoom, x, y));
+            if (!entry)
+                continue;
+            start = (entry->offset + RECORD_HEADER_SIZE) / page * page;
+            end = entry->offset + RECORD_HEADER_SIZE + entry->len;
+            madvise(map->addr + start, end - start, MADV_WILLNEED);
+        }
+    g_mutex_unlock(&store->lock);
+}
+
+/* Store a tile with its validators, if any. A zero mtime means
+   now. */
+gboolean maep_tile_store_write(MaepTileStore *store, int zoom, int x, int y,
+                               const gchar *data, gsize len,
+                               const gchar *meta, time_t mtime, GError **error)
+{
+    g_return_val_if_fail(store && data, FALSE);
+
+    if (store->kind == MAEP_TILE_STORE_DIRECTORY)
+        return _dir_write(store, zoom, x, y, data, len, meta, mtime, error);
+    else
+        return _pack_write(store, zoom, x, y, data, len, meta, mtime, error);
+}
+
+/* Mark a tile as fresh. */
+gboolean maep_tile_store_touch(MaepTileStore *store, int zoom, int x, int y)
+{
+    MaepPackEntry *entry;
+    MaepDirEntry *dir_entry;
+    gchar *filename;
+    guchar mtime[8];
+    gboolean done;
+
+    g_return_val_if_fail(store, FALSE);
+
+    if (store->kind == MAEP_TILE_STORE_DIRECTORY) {
+        filename = _dir_filename(store, zoom, x, y);
+        done = !g_utime(filename, NULL);
+        g_free(filename);
+        if (done) {
+            _lock(store);
+            dir_entry = maep_tile_index_lookup(store->index, _key(zoom, x, y));
+            if (dir_entry)
+                dir_entry->mtime = dir_entry->atime = time(NULL);
+            g_mutex_unlock(&store->lock);
+        }
+        return done;
+    }
+
+    _lock(store);
+    entry = maep_tile_index_lookup(store->index, _key(zoom, x, y));
+    done = FALSE;
+    if (entry) {
+        entry->mtime = entry->atime = time(NULL);
+        _put64(mtime, (guint64)entry->mtime);
+        /* Records are otherwise never modified. */
+        done = _pwrite_all(store->fd, mtime, sizeof(mtime),
+                           entry->offset + RECORD_MTIME);
+        store->dirty = TRUE;
+    }
+    g_mutex_unlock(&store->lock);
+    return done;
+}
+
+/* Record that a tile has been used, for the eviction of the least
+   recently used tiles. In a directory, it is also kept as the access
+   time of the file, at most once per ATIME_PERIOD. */
+void maep_tile_store_mark_used(MaepTileStore *store, int zoom, int x, int y)
+{
+    struct timespec times[2];
+    gpointer entry;
+    gchar *filename;
+    gboolean outdated;
+    time_t now;
+
+    g_return_if_fail(store);
+
+    now = time(NULL);
+    outdated = FALSE;
+    _lock(store);
+    entry = maep_tile_index_lookup(store->index, _key(zoom, x, y));
+    if (entry && store->kind == MAEP_TILE_STORE_PACK) {
+        ((MaepPackEntry*)entry)->atime = now;
+        store->dirty = TRUE;
+    } else if (entry) {
+        outdated = (now - ((MaepDirEntry*)entry)->atime >= ATIME_PERIOD);
+        ((MaepDirEntry*)entry)->atime = now;
+    } else
+        outdated = (store->kind == MAEP_TILE_STORE_DIRECTORY);
+    g_mutex_unlock(&store->lock);
+
+    if (!outdated)
+        return;
+    filename = _dir_filename(store, zoom, x, y);
+    times[0].tv_sec = now;
+    times[0].tv_nsec = 0;
+    times[1].tv_nsec = UTIME_OMIT;
+    utimensat(AT_FDCWD, filename, times, 0);
+    g_free(filename);
+}
+
+/* Drop a tile that cannot be used from the index, so it is looked
+   for again. The data on disk are left. */
+void maep_tile_store_forget(MaepTileStore *store, int zoom, int x, int y)
+{
+    g_return_if_fail(store);
+
+    _lock(store);
+    if (maep_tile_index_remove(store->index, _key(zoom, x, y)) &&
+        store->kind == MAEP_TILE_STORE_PACK)
+        store->dirty = TRUE;
+    g_mutex_unlock(&store->lock);
+}
+
+gboolean maep_tile_store_is_empty(MaepTileStore *store)
+{
+    GDir *dir;
+    gboolean empty;
+
+    g_return_val_if_fail(store, TRUE);
+
+    if (store->kind == MAEP_TILE_STORE_DIRECTORY) {
+        dir = g_dir_open(store->path, 0, NULL);
+        if (!dir)
+            return TRUE;
+        empty = (g_dir_read_name(dir) == NULL);
+        g_dir_close(dir);
+        return empty;
+    }
+
+    _lock(store);
+    empty = (maep_tile_index_size(store->index) == 0);
+    g_mutex_unlock(&store->lock);
+    return empty;
+}
+
+static void _collect_key(MaepTileKey key, G_GNUC_UNUSED gpointer value,
+                         gpointer data)
+{
+    g_array_append_val((GArray*)data, key);
+}
+
+/* Call func for every tile of the store. For packs, func can safely
+   access the store. */
+void maep_tile_store_foreach(MaepTileStore *store, MaepTileStoreFunc func,
+                             gpointer user_data)
+{
+    GArray *keys;
+    MaepTileKey key;
+    guint i;
+
+    g_return_if_fail(store && func);
+
+    if (store->kind == MAEP_TILE_STORE_DIRECTORY) {
+        _dir_walk(store, func, user_data, FALSE);
+        return;
+    }
+
+    _lock(store);
+    keys = g_array_sized_new(FALSE, FALSE, sizeof(MaepTileKey),
+                             maep_tile_index_size(store->index));
+    maep_tile_index_foreach(store->index, _collect_key, keys);
+    g_mutex_unlock(&store->lock);
+
+    for (i = 0; i < keys->len; i++) {
+        key = g_array_index(keys, MaepTileKey, i);
+        func(MAEP_TILE_KEY_ZOOM(key), MAEP_TILE_KEY_X(key), MAEP_TILE_KEY_Y(key),
+             user_data);
+    }
+    g_array_free(keys, TRUE);
+}
+
+struct _CopyData
+{
+    MaepTileStore *dest, *src;
+    guint n;
+};
+
+static void _copy_tile(int zoom, int x, int y, gpointer user_data)
+{
+    struct _CopyData *copy = (struct _CopyData*)user_data;
+    gchar *data, *meta;
+    gsize len;
+    time_t mtime;
+    GError *error;
+
+    /* Tiles already in dest are newer. */
+    if (maep_tile_store_stat(copy->dest, zoom, x, y, NULL) ||
+        !maep_tile_store_stat(copy->src, zoom, x, y, &mtime))
+        return;
+
+    error = NULL;
+    if (!maep_tile_store_read(copy->src, zoom, x, y, &data, &len, &error)) {
+        g_warning("%s", error->message);
+        g_error_free(error);
+        return;
+    }
+    meta = maep_tile_store_get_meta(copy->src, zoom, x, y);
+    if (maep_tile_store_write(copy->dest, zoom, x, y, data, len, meta, mtime, &error))
+        copy->n += 1;
+    else {
+        g_warning("%s", error->message);
+        g_error_free(error);
+    }
+    g_free(meta);
+    g_free(data);
+}
+
+/* Copy into dest the tiles of src it does not have yet, keeping their
+   age and validators. This is slow, call it from a thread. */
+guint maep_tile_store_copy(MaepTileStore *dest, MaepTileStore *src)
+{
+    struct _CopyData copy;
+
+    g_return_val_if_fail(dest && src, 0);
+
+    copy.dest = dest;
+    copy.src = src;
+    copy.n = 0;
+    maep_tile_store_foreach(src, _copy_tile, &copy);
+
+    if (dest->kind == MAEP_TILE_STORE_PACK) {
+        _lock(dest);
+        if (dest->fd >= 0 && dest->dirty)
+            _pack_save_index(dest);
+        g_mutex_unlock(&dest->lock);
+    }
+
+    return copy.n;
+}
+
+static void _list_entry(MaepTileKey key, gpointer value, gpointer data)
+{
+    MaepTileStoreEntry tile;
+    MaepPackEntry *entry = (MaepPackEntry*)value;
+
+    tile.zoom = MAEP_TILE_KEY_ZOOM(key);
+    tile.x = MAEP_TILE_KEY_X(key);
+    tile.y = MAEP_TILE_KEY_Y(key);
+    tile.size = RECORD_HEADER_SIZE + entry->len + entry->meta_len;
+    tile.atime = entry->atime;
+    tile.mtime = entry->mtime;
+    g_array_append_val((GArray*)data, tile);
+}
+
+static void _list_dir_entry(MaepTileKey key, gpointer value, gpointer data)
+{
+    MaepTileStoreEntry tile;
+    MaepDirEntry *entry = (MaepDirEntry*)value;
+
+    tile.zoom = MAEP_TILE_KEY_ZOOM(key);
+    tile.x = MAEP_TILE_KEY_X(key);
+    tile.y = MAEP_TILE_KEY_Y(key);
+    tile.size = entry->size;
+    tile.atime = entry->atime;
+    tile.mtime = entry->mtime;
+    g_array_append_val((GArray*)data, tile);
+}
+
+static void _add_record_size(G_GNUC_UNUSED MaepTileKey key, gpointer value,
+                             gpointer data)
+{
+    MaepPackEntry *entry = (MaepPackEntry*)value;
+
+    *(guint64*)data += RECORD_HEADER_SIZE + entry->len + entry->meta_len;
+}
+
+/* All the tiles of the store, as an array of MaepTileStoreEntry. A
+   directory is fully indexed first, call it from a thread. */
+GArray* maep_tile_store_list(MaepTileStore *store)
+{
+    GArray *tiles;
+
+    g_return_val_if_fail(store, NULL);
+
+    if (store->kind == MAEP_TILE_STORE_DIRECTORY)
+        _dir_index_all(store);
+
+    _lock(store);
+    tiles = g_array_sized_new(FALSE, FALSE, sizeof(MaepTileStoreEntry),
+                              maep_tile_index_size(store->index));
+    maep_tile_index_foreach(store->index, store->kind == MAEP_TILE_STORE_PACK ?
+                            _list_entry : _list_dir_entry, tiles);
+    g_mutex_unlock(&store->lock);
+
+    return tiles;
+}
+
+/* Remove the listed tiles, unless they have been stored again since
+   listed. A pack is compacted when removed or replaced tiles make a
+   significant part of it. Returns the size of the removed tiles. */
+guint64 maep_tile_store_evict(MaepTileStore *store,
+                              const MaepTileStoreEntry *tiles, guint n)
+{
+    MaepPackEntry *entry;
+    MaepDirEntry *dir_entry;
+    GHashTable *folders;
+    GHashTableIter iter;
+    gpointer folder;
+    gchar *filename, *meta_file;
+    guint64 freed, live;
+    gboolean compact;
+    guint i;
+
+    g_return_val_if_fail(store, 0);
+
+    freed = 0;
+    if (store->kind == MAEP_TILE_STORE_DIRECTORY) {
+        folders = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        for (i = 0; i < n; i++) {
+            _lock(store);
+            dir_entry = maep_tile_index_lookup(store->index,
+                                               _key(tiles[i].zoom, tiles[i].x, tiles[i].y));
+            if (dir_entry && dir_entry->mtime == tiles[i].mtime) {
+                freed += dir_entry->size;
+                maep_tile_index_remove(store->index,
+                                       _key(tiles[i].zoom, tiles[i].x, tiles[i].y));
+                filename = _dir_filename(store, tiles[i].zoom, tiles[i].x, tiles[i].y);
+                meta_file = g_strconcat(filename, META_SUFFIX, NULL);
+                g_unlink(filename);
+                g_unlink(meta_file);
+                g_hash_table_add(folders, g_path_get_dirname(filename));
+                g_free(meta_file);
+                g_free(filename);
+            }
+            g_mutex_unlock(&store->lock);
+        }
+        /* Only the emptied columns are removed. */
+        g_hash_table_iter_init(&iter, folders);
+        while (g_hash_table_iter_next(&iter, &folder, NULL))
+            g_rmdir((const gchar*)folder);
+        g_hash_table_destroy(folders);
+        return freed;
+    }
+
+    _lock(store);
+    for (i = 0; i < n; i++) {
+        entry = maep_tile_index_lookup(store->index,
+                                       _key(tiles[i].zoom, tiles[i].x, tiles[i].y));
+        if (entry && entry->mtime == tiles[i].mtime) {
+            freed += RECORD_HEADER_SIZE + entry->len + entry->meta_len;
+            maep_tile_index_remove(store->index,
+                                   _key(tiles[i].zoom, tiles[i].x, tiles[i].y));
+            store->dirty = TRUE;
+        }
+    }
+    compact = FALSE;
+    if (store->fd >= 0) {
+        live = PACK_HEADER_SIZE;
+        maep_tile_index_foreach(store->index, _add_record_size, &live);
+        compact = (store->end - live > live / 4);
+    }
+    g_mutex_unlock(&store->lock);
+
+    /* The space is given back by the compaction. */
+    if (compact)
+        _pack_compact(store);
+
+    return freed;
+}
+
+/* Save the index of a pack if it changed since last saved. */
+void maep_tile_store_sync(MaepTileStore *store)
+{
+    g_return_if_fail(store);
+
+    if (store->kind != MAEP_TILE_STORE_PACK)
+        return;
+
+    _lock(store);
+    if (store->fd >= 0 && store->dirty)
+        _pack_save_index(store);
+    g_mutex_unlock(&store->lock);
+}
+
+/* Remove all tiles from disk. */
+void maep_tile_store_clear(MaepTileStore *store)
+{
+    gchar *filename;
+
+    g_return_if_fail(store);
+
+    if (store->kind == MAEP_TILE_STORE_DIRECTORY) {
+        _lock(store);
+        store->generation += 1;
+        memset(store->zooms, ZOOM_UNKNOWN, ZOOM_LEVELS);
+        maep_tile_index_remove_all(store->index);
+        g_mutex_unlock(&store->lock);
+        _dir_walk(store, NULL, NULL, TRUE);
+        return;
+    }
+
+    /* Nothing to read from the pack before removing it. */
+    g_mutex_lock(&store->lock);
+    store->opened = TRUE;
+    store->generation += 1;
+    if (store->fd >= 0)
+        close(store->fd);
+    store->fd = -1;
+    store->end = 0;
+    store->dirty = FALSE;
+    if (store->map)
+        _pack_map_unref(store->map);
+    store->map = NULL;
+    store->unmappable = FALSE;
+    maep_tile_index_remove_all(store->index);
+    if (!store->broken)
+        g_unlink(store->path);
+    filename = g_strconcat(store->path, PACK_INDEX_SUFFIX, NULL);
+    g_unlink(filename);
+    g_free(filename);
+    g_mutex_unlock(&store->lock);
+}
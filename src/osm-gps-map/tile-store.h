@@ -0,0 +1,113 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * Copyright (C) 2017 Damien Caliste <dcaliste@free.fr>
+ *
+ * This file is part of Maep.
+ *
+ * Maep is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Maep is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Maep.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TILE_STORE_H
+#define TILE_STORE_H
+
+#include <glib.h>
+#include <time.h>
+
+G_BEGIN_DECLS
+
+/* How the tiles of a source are kept on disk: one file per tile in a
+   <zoom>/<x>/<y>.<suffix> tree, or all tiles appended into a single
+   pack file. */
+typedef enum {
+    MAEP_TILE_STORE_DIRECTORY,
+    MAEP_TILE_STORE_PACK
+} MaepTileStoreKind;
+
+enum {
+    MAEP_TILE_STORE_ERROR_FILE,
+    MAEP_TILE_STORE_ERROR_MISSING
+};
+
+GQuark maep_tile_store_get_error();
+#define MAEP_TILE_STORE_ERROR maep_tile_store_get_error()
+
+/* All functions are thread safe, stores are shared between the main
+   thread and the writer and decoder threads. */
+typedef struct _MaepTileStore MaepTileStore;
+
+typedef void (*MaepTileStoreFunc)(int zoom, int x, int y, gpointer user_data);
+
+typedef struct _MaepTileStoreEntry MaepTileStoreEntry;
+struct _MaepTileStoreEntry
+{
+    int zoom, x, y;
+    guint32 size;
+    /* Last time the tile has been used. */
+    guint32 atime;
+    gint64 mtime;
+};
+
+MaepTileStore*    maep_tile_store_new         (MaepTileStoreKind kind,
+                                               const gchar *path,
+                                               const gchar *suffix);
+MaepTileStore*    maep_tile_store_ref         (MaepTileStore *store);
+void              maep_tile_store_unref       (MaepTileStore *store);
+
+MaepTileStoreKind maep_tile_store_get_kind    (const MaepTileStore *store);
+gchar*            maep_tile_store_get_filename(const MaepTileStore *store,
+                                               int zoom, int x, int y);
+
+gboolean          maep_tile_store_stat        (MaepTileStore *store,
+                                               int zoom, int x, int y,
+                                               time_t *mtime);
+gboolean          maep_tile_store_read        (MaepTileStore *store,
+                                               int zoom, int x, int y,
+                                               gchar **data, gsize *len,
+                                               GError **error);
+gchar*            maep_tile_store_get_meta    (MaepTileStore *store,
+                                               int zoom, int x, int y);
+GBytes*           maep_tile_store_borrow      (MaepTileStore *store,
+                                               int zoom, int x, int y,
+                                               GError **error);
+void              maep_tile_store_advise      (MaepTileStore *store, int zoom,
+                                               int x0, int y0, int x1, int y1);
+gboolean          maep_tile_store_write       (MaepTileStore *store,
+                                               int zoom, int x, int y,
+                                               const gchar *data, gsize len,
+                                               const gchar *meta, time_t mtime,
+                                               GError **error);
+gboolean          maep_tile_store_touch       (MaepTileStore *store,
+                                               int zoom, int x, int y);
+
+void              maep_tile_store_mark_used   (MaepTileStore *store,
+                                               int zoom, int x, int y);
+void              maep_tile_store_forget      (MaepTileStore *store,
+                                               int zoom, int x, int y);
+
+gboolean          maep_tile_store_is_empty    (MaepTileStore *store);
+void              maep_tile_store_foreach     (MaepTileStore *store,
+                                               MaepTileStoreFunc func,
+                                               gpointer user_data);
+guint             maep_tile_store_copy        (MaepTileStore *dest,
+                                               MaepTileStore *src);
+GArray*           maep_tile_store_list        (MaepTileStore *store);
+guint64           maep_tile_store_evict       (MaepTileStore *store,
+                                               const MaepTileStoreEntry *tiles,
+                                               guint n);
+void              maep_tile_store_sync        (MaepTileStore *store);
+void              maep_tile_store_clear       (MaepTileStore *store);
+
+G_END_DECLS
+
+#endif